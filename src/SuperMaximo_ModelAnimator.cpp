@@ -10,12 +10,20 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <new>
+#include <iomanip>
+#include <cfloat>
 using namespace std;
 
 #include <GL/glew.h>
 #include <GL/glu.h>
+#include <GL/glx.h>
 
 #include <gtk-3.0/gtk/gtk.h>
+#include <SDL/SDL.h>
 
 #include "SuperMaximo_GameLibrary/headers/SMSDL.h"
 #include "SuperMaximo_GameLibrary/headers/Display.h"
@@ -47,6 +55,13 @@ enum modeEnum {
 	ANIMATION_MODE
 };
 
+enum tangentModeEnum {
+	TANGENT_AUTO = 0,
+	TANGENT_LINEAR,
+	TANGENT_STEPPED,
+	TANGENT_USER
+};
+
 struct boneIteratorAssociation {
 	bone * pBone;
 	GtkTreeIter iterator;
@@ -55,6 +70,291 @@ struct boneIteratorAssociation {
 struct animationDetail {
 	string name;
 	unsigned length;
+	vector<float> rootMotion; //the root bone's heading at each frame, in degrees, once extracted
+};
+
+//steps is the row's key steps in order, rebuilt only when the track's key count changes or the row is invalidated
+struct timelineRow {
+	bone * pBone;
+	string name;
+	unsigned sourceSize;
+	vector<unsigned> steps;
+};
+
+struct keyAdjustment {
+	unsigned step;
+	float overflow[3];
+};
+
+struct keyTangent {
+	tangentModeEnum mode;
+	vec3 slope; //degrees per frame, only used by TANGENT_USER
+};
+
+//Cubic in the fraction of the way through the segment: value = c[0]+(c[1]*t)+(c[2]*t^2)+(c[3]*t^3)
+struct curveSegment {
+	unsigned startStep, length;
+	float coefficients[3][4];
+};
+
+//Keys without an entry in tangents use TANGENT_AUTO. segments is rebuilt from the keys whenever curvesDirty is set
+struct trackCurve {
+	map<unsigned, keyTangent> tangents;
+	vector<curveSegment> segments;
+};
+
+//One animation's keys for every bone, in boneList order, built from the keys and their curves. Each column holds a
+//float per key, and bone i's keys are the range [offsets[i], offsets[i+1]) of every column
+struct animationColumns {
+	vector<unsigned> offsets;
+	vector<float> data; //ANIMATION_COLUMN_COUNT columns of keyCount floats, in one block
+	unsigned keyCount;
+};
+
+struct smaTrack {
+	unsigned boneId;
+	bone::animation animation;
+};
+
+struct smaTangent {
+	unsigned boneId, step;
+	keyTangent tangent;
+};
+
+//Source bones are indexed by id. Corrections are 16 floats per source bone, taking the target's rest direction to
+//the source's
+struct retargetBatch {
+	vector<string> fileNames;
+	string outputDirectory;
+	vector<bone *> sourceBones;
+	vector<int> targetIds;
+	vector<float> corrections, inverseCorrections;
+	vector<unsigned char> converted;
+};
+
+struct keyReduction {
+	float tolerance;
+	vector<unsigned> removed, tracks; //tracks lists the work items of the depth being reduced
+	vector<float> error;
+	vector<int> parents; //the boneList index of each bone's parent, -1 for the root
+	vector<unsigned> worldStart; //where each track's frames start in the world rotations, which are indexed by step
+	vector<float> originalWorld, reducedWorld; //each bone's world rotation at every frame, before and after reducing
+};
+
+//Bounds are the minimum x, y and z then the maximum. Nodes are stored depth first, so an interior node's left child
+//directly follows it
+struct bvhNode {
+	float bounds[6];
+	unsigned first, count, rightChild; //count is 0 for interior nodes
+};
+
+//items holds the item indices grouped by leaf. itemBounds is 6 floats per item and itemLeaf the leaf each item is in
+struct pickBvh {
+	vector<bvhNode> nodes;
+	vector<unsigned> items, itemLeaf;
+	vector<float> itemBounds;
+	vector<unsigned char> nodeDirty;
+};
+
+struct pickRay {
+	float origin[3], direction[3], inverseDirection[3];
+};
+
+//Undo history entries and the current heads share these, so a version is only copied when it is about to change.
+//references counts the holders
+struct trackVersion {
+	vector<bone::keyFrame> frames;
+	unsigned references;
+};
+
+//The bone ids of SKIN_PAGE_VERTICES consecutive vertices
+struct skinPage {
+	vector<GLfloat> ids;
+	unsigned references;
+};
+
+struct trackChange {
+	unsigned boneId, animationId;
+	trackVersion * before, * after;
+};
+
+struct skinChange {
+	unsigned page;
+	skinPage * before, * after;
+};
+
+//Root motion tracks are short (a float per frame), so they're simply copied rather than shared
+struct rootMotionChange {
+	unsigned animationId;
+	vector<float> before, after;
+};
+
+struct undoStep {
+	vector<trackChange> tracks;
+	vector<skinChange> skin;
+	vector<rootMotionChange> rootMotion;
+};
+
+//A file being read on the loader thread. Everything but the flags belongs to the loader thread until finished is set
+struct fileLoad {
+	string fileName;
+	char type; //the last letter of the extension
+	GThread * thread;
+	gint progress, cancelled, building, finished; //progress is in thousandths of the load done
+	bool succeeded;
+	Model * model;
+	vector<bone *> bones;
+	vector<smaTrack> tracks;
+	vector<smaTangent> tangents;
+	vector<float> rootMotion;
+	GtkWidget * window, * progressBar;
+};
+
+struct bonePool {
+	vector<bone *> chunks; //blocks of BONE_POOL_CHUNK bones
+	vector<bone *> freeBones;
+	unsigned liveBones;
+	GMutex mutex; //the loader thread allocates bones too
+};
+
+struct shaderBuild {
+	string vertexFile, fragmentFile, sourceVertexFile, sourceFragmentFile, cacheFile; //no cacheFile if not cacheable
+	bool cached; //whether the files are the placeholders, for the cached binary to be loaded over
+	GLenum binaryFormat;
+	string binary;
+};
+
+struct meshCluster {
+	unsigned firstIndex, indexCount; //into clusterIndices
+	float bounds[6]; //at rest
+	vector<int> boneIds; //the bones its vertices are skinned to, -1 for none
+	vector<float> boneBounds; //6 per entry of boneIds, the rest bounds of the vertices on that bone
+};
+
+struct meshLod {
+	vector<GLfloat> vertices; //laid out like the model's VBO, 24 floats per vertex
+	vector<unsigned> skinSources; //the model vertex each vertex takes its bone id from
+	unsigned triangleCount;
+	GLuint vao, vbo;
+};
+
+//The simplifier's working copy of the model. Corners with the same position are welded into one vertex, but each
+//triangle corner remembers the model vertex its normal, texture coordinates and material come from
+struct lodMesh {
+	vector<float> positions; //3 per vertex
+	vector<unsigned> skinSources; //per vertex, a model vertex at that position
+	vector<double> quadrics; //10 per vertex, the upper triangle of its error quadric
+	vector<unsigned> triangles, corners; //3 per triangle, its vertices and the model vertices they came from
+	vector<unsigned> adjacencyStart, adjacency; //the triangles around each vertex, rebuilt every pass
+	vector<unsigned> collapseTargets, remap;
+	vector<float> collapseCosts;
+	vector<unsigned char> locked;
+};
+
+struct boneTransform {
+	float x, y, z, xRot, yRot, zRot;
+};
+
+struct viewCamera {
+	viewOrientationEnum orientation;
+	float zoom, xRotation, yRotation;
+	vec2 translation;
+};
+
+//Only touched by the render thread once created
+struct quadViewTarget {
+	GLuint framebuffer, renderbuffers[2];
+	bool drawn;
+	viewCamera camera; //what the view was last drawn with
+	unsigned sceneVersion;
+	gint64 drawTime;
+};
+
+//Everything the render thread needs to draw a frame. glLoop builds one on the main thread and hands it over through
+//frameQueue, after which the main thread doesn't touch it
+struct frameSnapshot {
+	modeEnum mode;
+	viewOrientationEnum viewOrientation;
+	float zoom, xRotation, yRotation, boneScale;
+	vec2 viewTranslation, boxStartPosition, mousePosition;
+	unsigned viewWidth, viewHeight; //the size drawn at, which only differs from the screen's for headless renders
+	bool wireframe, skinning, crowd, showSkeleton, showArrow, showRing, showIkTarget, showBox;
+	axisEnum axis;
+	int selectedBoneId;
+	vector<boneTransform> selectedChain; //root first, the transforms the arrow and ring are drawn under
+	vec3 overlayPosition, ikTarget;
+	Model * model;
+	vector<float> bonePalette; //16 floats per bone id, the bone's matrix relative to the model
+	unsigned skeletonVersion, skeletonInstanceCount;
+	vector<float> skeletonInstances; //only filled until the render thread has uploaded this version
+	unsigned crowdSize;
+	vector<float> crowdPalette;
+	GLuint lodVao; //0 to draw the model itself
+	unsigned lodVertexCount;
+	bool clustered; //whether the clusters below were culled for this frame
+	vector<unsigned> clusterDraws, pointDraws; //first index and index count of each cluster to draw, nearest first
+	vector<float> clusterBounds; //6 per entry of clusterDraws, as posed
+	bool quadView;
+	unsigned activeView, sceneVersion; //the view the camera above belongs to, and what changes when the scene does
+	vector<viewCamera> views; //empty unless quadView is set
+};
+
+#ifdef EDITOR_BENCHMARKS
+struct benchmarkCase {
+	unsigned bones, depth, keys, vertices;
+};
+#endif
+
+#ifdef FRAME_PROFILING
+struct profileCounter {
+	string name;
+	unsigned depth, nextSample;
+	vector<float> samples; //the last PROFILE_HISTORY timings, in milliseconds
+};
+
+struct profileEvent {
+	unsigned counter;
+	gint64 start, duration; //microseconds
+};
+
+//Times from construction until destruction, or until next switches it to another counter. Only the outermost scope of
+//a counter is recorded, so recursive functions aren't counted more than once
+struct profileScope {
+	unsigned counter;
+	gint64 startTime;
+	bool outermost;
+
+	profileScope(unsigned newCounter);
+	~profileScope();
+	void start(unsigned newCounter);
+	void finish();
+	void next(unsigned newCounter);
+};
+#endif
+
+struct workQueue {
+	GMutex mutex;
+	unsigned begin, end;
+};
+
+struct workerPool {
+	vector<GThread *> threads;
+	workQueue * queues;
+	GMutex mutex;
+	GCond wakeCondition, doneCondition;
+	unsigned generation, busyWorkers, grain;
+	bool quit;
+	void (*job)(unsigned, unsigned, void *);
+	void * jobData;
+};
+
+struct blendLayer {
+	bool enabled, additive, synced;
+	unsigned animationId;
+	float frame, speed, weight, fadeStep;
+	int maskBoneId;
+	bool maskDirty;
+	vector<float> mask;
 };
 
 #define INITIAL_MODEL_Z -10.0f
@@ -63,6 +363,15 @@ struct animationDetail {
 #define BONE_CREATE_DELAY 10.0f
 #define BONE_DELETE_DELAY 10.0f
 #define DEFAULT_ZOOM 8.0f
+#define KEYCODE_COUNT 320
+
+#define ACTIVE_FRAME_INTERVAL 16 //milliseconds
+#define IDLE_POLL_INTERVAL 100 //milliseconds
+#define IDLE_TICKS_BEFORE_SLOWDOWN 30
+#define MAX_COMPENSATION 4.0f
+#define TARGET_FRAME_TIME 16667 //microseconds, what a compensation of 1 corresponds to
+
+#define FRAME_QUEUE_SIZE 4
 
 #define CONTROL_KEYCODE 306
 #define SHIFT_KEYCODE 304
@@ -78,31 +387,211 @@ struct animationDetail {
 #define UPPER_LIMIT 0
 #define LOWER_LIMIT 1
 
+#define TIMELINE_HEIGHT 96
+#define TIMELINE_NAME_WIDTH 96
+#define TIMELINE_RULER_HEIGHT 16
+#define TIMELINE_MAX_ROWS 5 //the selected bone and the first of its descendants
+#define TIMELINE_TICK_SPACING 8 //minimum pixels between frame ticks
+#define TIMELINE_MIN_VISIBLE_FRAMES 10
+
+#define BLEND_LAYER_COUNT 4
+#define DEFAULT_BLEND_FADE_FRAMES 20
+
+#define DEFAULT_KEY_REDUCTION_TOLERANCE 0.5f //degrees, of where a bone's end points in world space
+
+#define DEFAULT_IK_CHAIN_LENGTH 2
+#define MAX_IK_CHAIN_LENGTH 64
+#define IK_MAX_ITERATIONS 16
+#define IK_TOLERANCE 0.01f
+#define IK_TIME_BUDGET 1000 //microseconds
+
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 64
+#define PICK_READBACK_VERTICES 65536
+#define BONE_PICK_RADIUS 0.2f //fraction of the bone scale
+#define BONE_PICK_PIXELS 4.0f
+
+#define CLUSTER_TRIANGLES 2048
+#define CLUSTER_BOX_MARGIN 4.0f //pixels, covering the distance a click snaps to a vertex from
+
+#define BONE_POOL_CHUNK 256 //bones
+
+//Columns of animationColumns
+#define ANIMATION_STEP_COLUMN 0
+#define ANIMATION_LENGTH_COLUMN 1 //1/length of the segment starting at the key, 0 for the last key
+#define ANIMATION_COEFFICIENT_COLUMN 2 //four Hermite coefficients per axis, as in curveSegment
+#define ANIMATION_COLUMN_COUNT 14
+
+#define LOAD_CHUNK_SIZE 4194304 //bytes read at a time before the loader thread checks for a cancel
+#define LOAD_CHECK_LINES 4096 //lines of a text file read or parsed between checks for a cancel
+#define LOAD_POLL_INTERVAL 50 //milliseconds
+
+#define SHADER_CACHE_DIRECTORY "supermaximo_modelanimator" //under the user's cache directory
+#define CACHED_VERTEX_SHADER "shaders/cached_vertex_shader.vs"
+#define CACHED_FRAGMENT_SHADER "shaders/cached_fragment_shader.fs"
+
+#define QUAD_VIEW_COUNT 4
+#define QUAD_VIEW_IDLE_INTERVAL 100000 //microseconds between redraws of the views the mouse isn't over
+#define QUAD_VIEW_BORDER 2 //pixels
+
+#define HEADLESS_BATCH_FRAMES 32 //frames rendered before the workers encode them
+#define HEADLESS_FILL 0.9f //how much of the shorter side of the frame the model's bounding sphere spans
+
+#define LOD_LEVELS 3 //each with half the triangles of the one before
+#define LOD_SWITCH_SCREEN_FRACTION 0.5f //LOD 1 is drawn once the model is smaller than this much of the screen height
+#define LOD_PASS_FRACTION 4 //each pass only considers the cheapest quarter of the candidate collapses
+#define LOD_NO_COLLAPSE ((unsigned)-1)
+
+#define UNDO_HISTORY_LIMIT 500
+#define SKIN_PAGE_VERTICES 4096
+
+//Build with -DFRAME_PROFILING to time the phases of glLoop and the main edit operations. Otherwise the macros below
+//expand to nothing. Timings are only taken on the main thread, except for drawing and swapping a frame, which the
+//render thread hands back through renderDrawMicroseconds and renderSwapMicroseconds
+#ifdef FRAME_PROFILING
+#define PROFILE_HISTORY 240
+#define PROFILE_REPORT_INTERVAL 30
+#define PROFILE_CONCATENATE_(a, b) a##b
+#define PROFILE_CONCATENATE(a, b) PROFILE_CONCATENATE_(a, b)
+#define PROFILE_SCOPE(name) static unsigned PROFILE_CONCATENATE(profileCounter, __LINE__) = profileCounterId(name); \
+	profileScope PROFILE_CONCATENATE(profileScope, __LINE__)(PROFILE_CONCATENATE(profileCounter, __LINE__))
+#define PROFILE_PHASES(name) static unsigned firstPhaseCounter = profileCounterId(name); \
+	profileScope phaseScope(firstPhaseCounter)
+#define PROFILE_PHASE(name) do { \
+	static unsigned phaseCounter = profileCounterId(name); \
+	phaseScope.next(phaseCounter); \
+} while (0)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_PHASES(name)
+#define PROFILE_PHASE(name)
+#endif
+
+//Build with -DEDITOR_BENCHMARKS and run with --benchmark to time the editor's core operations on synthetic rigs. The
+//results are printed to stdout as one JSON object per line
+#ifdef EDITOR_BENCHMARKS
+#define BENCHMARK_MIN_TIME 200000 //microseconds spent repeating each measurement
+#define BENCHMARK_MAX_ITERATIONS 1000
+#define BENCHMARK_MAX_TOTAL_KEYS 10000000 //bones*keys, beyond which a case is skipped
+#define BENCHMARK_MESH_BONES 100
+#endif
+
+#define MAX_CROWD_SIZE 4096
+#define DEFAULT_CROWD_SIZE 100
+#define CROWD_FRAME_STAGGER 7
+#define CROWD_TIMING_REPORT_INTERVAL 30
+
 bool executeOpenFile = false, wireframeModeEnabled = false, boneCreationEnabled = false, skinningEnabled = false,
-		creatingBone = false, trueBool = true, falseBool = false, playAnimation = false, autoKeyEnabled = false;
+		creatingBone = false, trueBool = true, falseBool = false, playAnimation = false, autoKeyEnabled = false,
+		blendPreviewEnabled = false, crowdEnabled = false, crowdVaryAnimations = false, ikEnabled = false,
+		curvesDirty = true, redrawNeeded = true, pickMeshDirty = true, pickSkinningDirty = false, pickMeshPosed = false;
 Model * loadedModel = NULL, * boneModel = NULL;
-Shader * skeletonShader, * animationShader, * boneShader, * arrowShader, * boxShader, * ringShader;
+Shader * skeletonShader, * animationShader, * boneShader, * arrowShader, * boxShader, * ringShader, * crowdShader;
 vec2 lastMousePosition = {{0.0f}, {0.0f}}, viewTranslation = {{0.0f}, {0.0f}};
 GtkWidget * wireframeToggleButton, * boneCreationToggleButton, * skinningToggleButton,
 	* viewToggleButton[VIEW_ORIENTATION_ENUM_COUNT], * boneView, * boneScaleSpinButton, * animationLengthSpinButton,
 	* timelineJumpEntry, * timeline, * boneWindow, * animationWindow, * switchModeButton,
 	* boneRotationLimitSpinButton[3][2], * playAnimationToggleButton, * autoKeyToggleButton, * boneNameEntry,
-	* animationNameEntry, * animationSelectSpinButton;
-gulong boneCreationToggleHandler, skinningToggleHandler, viewToggleHandler[VIEW_ORIENTATION_ENUM_COUNT],
-	boneRotationLimitSpinHandler[3][2], playAnimationToggleHandler, autoKeyToggleHandler;
+	* animationNameEntry, * animationSelectSpinButton, * blendWindow, * blendPreviewToggleButton,
+	* blendFadeLengthSpinButton, * blendLayerToggleButton[BLEND_LAYER_COUNT],
+	* blendAnimationSpinButton[BLEND_LAYER_COUNT], * blendWeightSpinButton[BLEND_LAYER_COUNT],
+	* blendSpeedSpinButton[BLEND_LAYER_COUNT], * blendSyncToggleButton[BLEND_LAYER_COUNT],
+	* blendAdditiveToggleButton[BLEND_LAYER_COUNT], * blendMaskToggleButton[BLEND_LAYER_COUNT], * crowdSizeSpinButton,
+	* crowdVaryToggleButton, * crowdTimingLabel, * ikChainLengthSpinButton, * keyReductionToleranceSpinButton,
+	* keyReductionLabel, * tangentModeComboBox, * tangentSlopeSpinButton[3], * lodPreviewComboBox, * lodInfoLabel,
+	* retargetLabel;
+gulong boneCreationToggleHandler, skinningToggleHandler, boneSelectHandler,
+	viewToggleHandler[VIEW_ORIENTATION_ENUM_COUNT], boneRotationLimitSpinHandler[3][2], playAnimationToggleHandler,
+	autoKeyToggleHandler,
+	blendWeightSpinHandler[BLEND_LAYER_COUNT];
 float xRotation = 0.0f, yRotation = 0.0f, zoom = DEFAULT_ZOOM, boneScale = 1.0f;
 bone * root = NULL, * selectedBone = NULL;
 vector<bone *> boneList;
+map<bone *, vector<trackCurve> > boneCurves;
+vector<animationColumns> animationColumnCache; //one per animation
+vector<bone *> animationColumnBones; //boneList when animationColumnCache was built
+unsigned animationColumnsVersion = 0; //moved on each time animationColumnCache is built
 viewOrientationEnum viewOrientation,
 	viewOrientationArr[VIEW_ORIENTATION_ENUM_COUNT] = {TOP, BOTTOM, LEFT, RIGHT, FRONT, BACK, FREE};
 GtkTreeStore * boneStore;
 vector<boneIteratorAssociation> boneIteratorAssociations;
 GtkTreeSelection * boneSelect;
-GLuint arrowVao, arrowVbo, boxVao, boxVbo, ringVao, ringVbo, * modelVbo;
-unsigned currentFrame = 1, currentAnimation = 0;
+GLuint arrowVao, arrowVbo, boxVao, boxVbo, ringVao, ringVbo, * modelVbo, crowdVao = 0, crowdVaoVbo = 0,
+	crowdPaletteBuffer = 0, crowdPaletteTexture = 0, crowdTimerQuery = 0, skeletonVao = 0, skeletonInstanceBuffer = 0,
+	skeletonInstanceTexture = 0;
+unsigned currentFrame = 1, currentAnimation = 0, glLoopInterval = ACTIVE_FRAME_INTERVAL, idleTicks = 0;
 modeEnum mode = SKELETON_MODE;
 vector<int> freeBoneIds;
 vector<animationDetail> animations;
+blendLayer blendLayers[BLEND_LAYER_COUNT];
+vector<vec3> blendPose, blendLayerPose;
+workerPool workers;
+unsigned crowdSize = DEFAULT_CROWD_SIZE, crowdFramesSinceReport = 0, ikChainLength = DEFAULT_IK_CHAIN_LENGTH;
+float crowdTime = 1.0f, crowdSpacing = 1.0f, crowdEvaluateTime = 0.0f, crowdUploadTime = 0.0f, crowdDrawTime = 0.0f;
+vector<bone *> crowdBoneOrder;
+vector<bone *> crowdBones, crowdBoneParents; //the skeleton crowdBoneOrder was made from
+vector<unsigned> crowdBoneColumns; //index in animationColumnBones of each bone of crowdBoneOrder
+vector<float> skeletonInstances, skeletonSnapshot;
+unsigned skeletonVersion = 0;
+volatile gint uploadedSkeletonVersion = -1; //set by whichever thread draws
+frameSnapshot * frameQueue[FRAME_QUEUE_SIZE];
+gint frameQueueHead = 0, frameQueueTail = 0, crowdUploadMicroseconds = 0, crowdDrawMicroseconds = -1;
+gint renderDrawMicroseconds = -1, renderSwapMicroseconds = -1; //-1 once the main thread has taken the timing
+GThread * renderThread = NULL;
+GMutex renderMutex;
+GCond renderCondition;
+bool renderQuit = false, renderParked = false, glContextRequested = false;
+unsigned glContextLockDepth = 0;
+::Display * glDisplay = NULL;
+GLXDrawable glDrawable;
+GLXContext glContext;
+GLint maxTextureBufferTexels = 0;
+Model * crowdSpacingModel = NULL;
+float frameCompensationValue = 1.0f, orthographicMatrix[16];
+vector<float> crowdPalette, spareCrowdPalette; //the spare is handed back by the render thread once it's uploaded
+GMutex crowdPaletteMutex;
+pickBvh bonePickBvh, meshPickBvh;
+vector<float> pickRestVertices, pickPosedVertices, pickBoneIds, pickBoneMatrices, pickBoneSegments;
+vector<float> pickBoneGeometry; //x, y, z, endX, endY and endZ of each bone of boneList when its capsule was fitted
+vector<bone *> pickBones, pickBoneParents; //the skeleton bonePickBvh was built for
+vector<unsigned char> pickBoneChanged;
+float pickBoneRadius = 0.0f;
+vector<vector<trackVersion *> > trackHeads; //by bone id then animation, the tracks as of the last undo step
+vector<vector<float> > rootMotionHeads; //by animation, the root motion tracks as of the last undo step
+vector<skinPage *> skinPageHeads; //NULL for pages that haven't been edited since the model was loaded
+Model * skinPageModel = NULL;
+map<unsigned, skinPage *> openSkinChanges; //the pages edited since the last undo step, and what they were before
+deque<undoStep> undoHistory;
+unsigned undoPosition = 0; //steps before this can be undone, steps from it on redone
+bool undoStepPending = false;
+vector<meshLod> meshLods; //LOD 1 onwards, LOD 0 being the model itself
+Model * lodModel = NULL;
+float lodModelRadius = 0.0f;
+int lodPreview = 0; //0 picks the LOD by the model's size on screen, otherwise the LOD+1 to always draw
+bool lodSkinDirty = false;
+vector<meshCluster> meshClusters;
+vector<GLuint> clusterIndices; //the model's vertex indices, cluster by cluster
+Model * clusterModel = NULL, * modelTextureModel = NULL;
+bool clusterSkinDirty = false, clusterModelTextured = false;
+GLuint clusterVao = 0, clusterIndexBuffer = 0, clusterBoxVao = 0, clusterBoxVbo = 0, modelTexture = 0;
+vector<GLuint> clusterQueries; //only touched by the render thread
+bool quadViewEnabled = false;
+viewCamera quadViews[QUAD_VIEW_COUNT]; //top left, top right, bottom left, bottom right
+quadViewTarget quadViewTargets[QUAD_VIEW_COUNT];
+unsigned activeQuadView = QUAD_VIEW_COUNT-1, quadSceneVersion = 0, glObjectsVersion = 0;
+gint64 quadSceneChangeTime = 0;
+fileLoad * activeFileLoad = NULL;
+bonePool boneStorage;
+bool bonePoolEnabled = true; //turned off by the benchmarks to compare against allocating each bone on its own
+vector<timelineRow> timelineRows;
+unsigned timelineAnimation = 0, timelineFirstFrame = 1, timelineVisibleFrames = 0; //0 shows the whole animation
+#ifdef FRAME_PROFILING
+vector<profileCounter> profileCounters;
+vector<profileEvent> profileTrace;
+bool profileRecording = false;
+unsigned profileFramesSinceReport = 0;
+GtkWidget * profileLabel;
+#endif
 
 void createGlWindow();
 
@@ -118,7 +607,9 @@ GtkWidget * createBoneWindow();
 
 GtkWidget * createAnimationWindow();
 
-void setCurrentFrameFromScale();
+void setTimelineJumpText();
+
+void setTimelineFrame(unsigned);
 
 void setRotationLimitValues(bone *);
 
@@ -126,8 +617,391 @@ void verifyBoneAnimationCounts(bone * = NULL);
 
 void updateAnimationSpinButtonRange();
 
+void invalidateAnimationMarks();
+
+void destroyCrowd();
+
+trackCurve * findTrackCurve(bone *, unsigned);
+
+void lockGlContext();
+
+void undoEdit();
+
+void redoEdit();
+
+void unlockGlContext();
+
+void borrowGlContext();
+
+void returnGlContext();
+
+void renderFrame(frameSnapshot *);
+
+void buildMeshClusters();
+
+void selectionRect(vec2, float *);
+
+void projectBounds(const float *, double *, double *, int *, float *, float *);
+
+bool rectsOverlap(const float *, const float *);
+
+#ifdef FRAME_PROFILING
+unsigned profileCounterId(const char * name) {
+	for (unsigned i = 0; i < profileCounters.size(); i++) if (profileCounters[i].name == name) return i;
+	profileCounters.push_back(profileCounter());
+	profileCounters.back().name = name;
+	profileCounters.back().depth = profileCounters.back().nextSample = 0;
+	return profileCounters.size()-1;
+}
+
+profileScope::profileScope(unsigned newCounter) {
+	start(newCounter);
+}
+
+profileScope::~profileScope() {
+	finish();
+}
+
+void profileScope::start(unsigned newCounter) {
+	counter = newCounter;
+	outermost = (profileCounters[counter].depth == 0);
+	profileCounters[counter].depth++;
+	startTime = g_get_monotonic_time();
+}
+
+void addProfileSample(unsigned counter, gint64 startTime, gint64 endTime) {
+	profileCounter * pCounter = &profileCounters[counter];
+	float duration = (endTime-startTime)/1000.0f;
+	if (pCounter->samples.size() < PROFILE_HISTORY) pCounter->samples.push_back(duration); else {
+		pCounter->samples[pCounter->nextSample] = duration;
+		pCounter->nextSample = (pCounter->nextSample+1)%PROFILE_HISTORY;
+	}
+	if (profileRecording) profileTrace.push_back((profileEvent){counter, startTime, endTime-startTime});
+}
+
+void profileScope::finish() {
+	gint64 endTime = g_get_monotonic_time();
+	profileCounters[counter].depth--;
+	if (outermost) addProfileSample(counter, startTime, endTime);
+}
+
+//Takes a timing the render thread handed back, if there is a new one. Only its length is handed back, so the trace
+//shows it as ending when it was taken
+void takeRenderTiming(gint * timing, unsigned counter) {
+	gint microseconds = g_atomic_int_get(timing);
+	if ((microseconds < 0) || !g_atomic_int_compare_and_exchange(timing, microseconds, -1)) return;
+	gint64 endTime = g_get_monotonic_time();
+	addProfileSample(counter, endTime-microseconds, endTime);
+}
+
+void profileScope::next(unsigned newCounter) {
+	finish();
+	start(newCounter);
+}
+#endif
+
+bool takeWork(unsigned worker, unsigned * begin, unsigned * end) {
+	unsigned queueCount = workers.threads.size()+1;
+	for (unsigned i = 0; i < queueCount; i++) {
+		workQueue * queue = &workers.queues[(worker+i)%queueCount];
+		g_mutex_lock(&queue->mutex);
+		if (queue->begin < queue->end) {
+			if (i == 0) {
+				//Take a chunk from the front of our own queue
+				*begin = queue->begin;
+				*end = min(queue->begin+workers.grain, queue->end);
+				queue->begin = *end;
+			} else {
+				//Steal the back half of another worker's queue, working on one chunk and keeping the rest
+				unsigned stolen = max((queue->end-queue->begin)/2, 1u);
+				unsigned stolenBegin = queue->end-stolen, stolenEnd = queue->end;
+				queue->end = stolenBegin;
+				g_mutex_unlock(&queue->mutex);
+
+				*begin = stolenBegin;
+				*end = min(stolenBegin+workers.grain, stolenEnd);
+				g_mutex_lock(&workers.queues[worker].mutex);
+				workers.queues[worker].begin = *end;
+				workers.queues[worker].end = stolenEnd;
+				g_mutex_unlock(&workers.queues[worker].mutex);
+				return true;
+			}
+			g_mutex_unlock(&queue->mutex);
+			return true;
+		}
+		g_mutex_unlock(&queue->mutex);
+	}
+	return false;
+}
+
+void runWork(unsigned worker) {
+	unsigned begin, end;
+	while (takeWork(worker, &begin, &end)) workers.job(begin, end, workers.jobData);
+}
+
+gpointer workerThread(gpointer data) {
+	unsigned worker = GPOINTER_TO_UINT(data), generation = 0;
+	while (true) {
+		g_mutex_lock(&workers.mutex);
+		while ((workers.generation == generation) && !workers.quit) g_cond_wait(&workers.wakeCondition, &workers.mutex);
+		if (workers.quit) {
+			g_mutex_unlock(&workers.mutex);
+			return NULL;
+		}
+		generation = workers.generation;
+		g_mutex_unlock(&workers.mutex);
+
+		runWork(worker);
+
+		g_mutex_lock(&workers.mutex);
+		workers.busyWorkers--;
+		if (workers.busyWorkers == 0) g_cond_signal(&workers.doneCondition);
+		g_mutex_unlock(&workers.mutex);
+	}
+}
+
+void startWorkerThreads() {
+	unsigned threadCount = max(g_get_num_processors(), 1u)-1;
+	workers.queues = new workQueue[threadCount+1];
+	for (unsigned i = 0; i <= threadCount; i++) {
+		g_mutex_init(&workers.queues[i].mutex);
+		workers.queues[i].begin = workers.queues[i].end = 0;
+	}
+	g_mutex_init(&workers.mutex);
+	g_cond_init(&workers.wakeCondition);
+	g_cond_init(&workers.doneCondition);
+	workers.generation = workers.busyWorkers = 0;
+	workers.quit = false;
+	for (unsigned i = 1; i <= threadCount; i++)
+		workers.threads.push_back(g_thread_new("worker", workerThread, GUINT_TO_POINTER(i)));
+}
+
+void stopWorkerThreads() {
+	if (workers.queues == NULL) return;
+
+	g_mutex_lock(&workers.mutex);
+	workers.quit = true;
+	g_cond_broadcast(&workers.wakeCondition);
+	g_mutex_unlock(&workers.mutex);
+	for (unsigned i = 0; i < workers.threads.size(); i++) g_thread_join(workers.threads[i]);
+
+	for (unsigned i = 0; i <= workers.threads.size(); i++) g_mutex_clear(&workers.queues[i].mutex);
+	g_mutex_clear(&workers.mutex);
+	g_cond_clear(&workers.wakeCondition);
+	g_cond_clear(&workers.doneCondition);
+	delete[] workers.queues;
+	workers.queues = NULL;
+	workers.threads.clear();
+}
+
+//Runs job over [0, count) in chunks of grain, split across the worker threads (and this thread), which steal
+//from each other when they run out. Returns once every chunk has been processed
+void parallelFor(unsigned count, unsigned grain, void (*job)(unsigned, unsigned, void *), void * data) {
+	if (count == 0) return;
+	if (workers.queues == NULL) startWorkerThreads();
+
+	unsigned queueCount = workers.threads.size()+1, share = count/queueCount, extra = count%queueCount, begin = 0;
+	for (unsigned i = 0; i < queueCount; i++) {
+		g_mutex_lock(&workers.queues[i].mutex);
+		workers.queues[i].begin = begin;
+		begin += share+((i < extra) ? 1 : 0);
+		workers.queues[i].end = begin;
+		g_mutex_unlock(&workers.queues[i].mutex);
+	}
+	workers.grain = max(grain, 1u);
+	workers.job = job;
+	workers.jobData = data;
+
+	g_mutex_lock(&workers.mutex);
+	workers.busyWorkers = workers.threads.size();
+	workers.generation++;
+	g_cond_broadcast(&workers.wakeCondition);
+	g_mutex_unlock(&workers.mutex);
+
+	runWork(0);
+
+	g_mutex_lock(&workers.mutex);
+	while (workers.busyWorkers > 0) g_cond_wait(&workers.doneCondition, &workers.mutex);
+	g_mutex_unlock(&workers.mutex);
+}
+
+trackVersion * newTrackVersion(vector<bone::keyFrame> * frames) {
+	trackVersion * version = new trackVersion;
+	version->frames = *frames;
+	version->references = 1;
+	return version;
+}
+
+void releaseTrackVersion(trackVersion * version) {
+	if (--version->references == 0) delete version;
+}
+
+void releaseSkinPage(skinPage * page) {
+	if ((page != NULL) && (--page->references == 0)) delete page;
+}
+
+void releaseUndoStep(undoStep * step) {
+	for (unsigned i = 0; i < step->tracks.size(); i++) {
+		releaseTrackVersion(step->tracks[i].before);
+		releaseTrackVersion(step->tracks[i].after);
+	}
+	for (unsigned i = 0; i < step->skin.size(); i++) {
+		releaseSkinPage(step->skin[i].before);
+		releaseSkinPage(step->skin[i].after);
+	}
+}
+
+//Forgets the history and the track heads, but not the skin pages, so skinning edits that haven't been committed yet
+//survive into the next step
+void resetTrackHistory() {
+	for (unsigned i = 0; i < undoHistory.size(); i++) releaseUndoStep(&undoHistory[i]);
+	undoHistory.clear();
+	undoPosition = 0;
+	for (unsigned i = 0; i < trackHeads.size(); i++)
+		for (unsigned j = 0; j < trackHeads[i].size(); j++) releaseTrackVersion(trackHeads[i][j]);
+	trackHeads.clear();
+	rootMotionHeads.clear();
+}
+
+//Forgets the skin page heads and any uncommitted skinning edits. Steps already in the history keep their own pages
+void resetSkinPages() {
+	for (map<unsigned, skinPage *>::iterator i = openSkinChanges.begin(); i != openSkinChanges.end(); i++)
+		releaseSkinPage(i->second);
+	openSkinChanges.clear();
+	for (unsigned i = 0; i < skinPageHeads.size(); i++) releaseSkinPage(skinPageHeads[i]);
+	skinPageHeads.clear();
+	skinPageModel = NULL;
+}
+
+//Forgets the history and every head. Needed whenever bones, animations or the model are replaced or renumbered, since
+//the steps refer to them by id and vertex index. The next commit takes the tracks as they are then as its baseline
+void resetUndoHistory() {
+	resetTrackHistory();
+	resetSkinPages();
+	undoStepPending = true;
+}
+
+//Call whenever keyframes may have been edited, so that the curves are rebuilt and the edit becomes an undo step
+void tracksChanged() {
+	curvesDirty = true;
+	undoStepPending = true;
+}
+
+//Deletes the LODs along with their buffers. The caller must hold the GL context
+void destroyMeshLods() {
+	for (unsigned i = 0; i < meshLods.size(); i++) {
+		glDeleteBuffers(1, &meshLods[i].vbo);
+		glDeleteVertexArrays(1, &meshLods[i].vao);
+	}
+	meshLods.clear();
+	lodModel = NULL;
+}
+
+//Deletes the clusters along with their buffers. The caller must hold the GL context
+void destroyMeshClusters() {
+	if (clusterVao != 0) glDeleteVertexArrays(1, &clusterVao);
+	if (clusterIndexBuffer != 0) glDeleteBuffers(1, &clusterIndexBuffer);
+	clusterVao = clusterIndexBuffer = 0;
+	meshClusters.clear();
+	clusterIndices.clear();
+	clusterModel = modelTextureModel = NULL;
+}
+
+//Whether boneList, or any bone's parent, differs from the copy in bones and parents, which is then brought up to date.
+//Only the pointers are compared, which is enough for anything that only orders the bones by their hierarchy
+bool skeletonStructureChanged(vector<bone *> * bones, vector<bone *> * parents) {
+	bool changed = (*bones != boneList);
+	for (unsigned i = 0; !changed && (i < boneList.size()); i++) changed = ((*parents)[i] != boneList[i]->parent);
+	if (changed) {
+		*bones = boneList;
+		parents->resize(boneList.size());
+		for (unsigned i = 0; i < boneList.size(); i++) (*parents)[i] = boneList[i]->parent;
+	}
+	return changed;
+}
+
+bool bonePoolOwns(bone * pBone) {
+	for (unsigned i = 0; i < boneStorage.chunks.size(); i++) {
+		if ((pBone >= boneStorage.chunks[i]) && (pBone < boneStorage.chunks[i]+BONE_POOL_CHUNK)) return true;
+	}
+	return false;
+}
+
+//Bones are handed out of blocks of BONE_POOL_CHUNK, so that a skeleton sits together in memory while it's posed
+//instead of being scattered over the heap. Safe to call from the loader thread
+bone * allocateBone() {
+	if (!bonePoolEnabled) return new bone;
+	g_mutex_lock(&boneStorage.mutex);
+	if (boneStorage.freeBones.empty()) {
+		bone * chunk = (bone *)operator new(sizeof(bone)*BONE_POOL_CHUNK);
+		boneStorage.chunks.push_back(chunk);
+		for (unsigned i = BONE_POOL_CHUNK; i > 0; i--) boneStorage.freeBones.push_back(chunk+i-1);
+	}
+	bone * pBone = boneStorage.freeBones.back();
+	boneStorage.freeBones.pop_back();
+	boneStorage.liveBones++;
+	g_mutex_unlock(&boneStorage.mutex);
+	return new (pBone) bone;
+}
+
+//Frees bones from the pool or, for the ones a Model or the benchmarks made, from the heap. The pool's blocks all go
+//at once when the last bone in them has been freed
+void freeBones(vector<bone *> * bones) {
+	g_mutex_lock(&boneStorage.mutex);
+	for (unsigned i = 0; i < bones->size(); i++) {
+		bone * pBone = (*bones)[i];
+		if (!bonePoolOwns(pBone)) {
+			delete pBone;
+			continue;
+		}
+		pBone->~bone();
+		boneStorage.freeBones.push_back(pBone);
+		boneStorage.liveBones--;
+	}
+	if (boneStorage.liveBones == 0) {
+		for (unsigned i = 0; i < boneStorage.chunks.size(); i++) operator delete(boneStorage.chunks[i]);
+		boneStorage.chunks.clear();
+		boneStorage.freeBones.clear();
+	}
+	g_mutex_unlock(&boneStorage.mutex);
+}
+
+void freeBone(bone * pBone) {
+	vector<bone *> bones(1, pBone);
+	freeBones(&bones);
+}
+
+//Unbinds every vertex from its bone, in one read and one write of the VBO
+void unbindModelSkin() {
+	if ((loadedModel == NULL) || loadedModel->triangles()->empty()) return;
+	vector<GLfloat> vertices(loadedModel->triangles()->size()*3*24);
+	lockGlContext();
+	glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
+	glGetBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*vertices.size(), &vertices[0]);
+	for (unsigned i = 0; i < vertices.size()/24; i++) vertices[(i*24)+23] = -1.0f;
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*vertices.size(), &vertices[0]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	unlockGlContext();
+	pickSkinningDirty = lodSkinDirty = clusterSkinDirty = true;
+}
+
+//Frees the whole skeleton at once. Of what deleteBone does bone by bone, only what matters once no bones are left is
+//kept: the model is unbound from the skeleton in one pass and every id is freed
 void resetBones() {
-	if (root != NULL) deleteBone(root);
+	PROFILE_SCOPE("resetBones");
+	if (!boneList.empty()) {
+		resetUndoHistory();
+		timelineRows.clear();
+		for (unsigned i = 0; i < boneList.size(); i++) freeBoneIds.push_back(boneList[i]->id);
+		sort(freeBoneIds.begin(), freeBoneIds.end());
+		freeBoneIds.erase(unique(freeBoneIds.begin(), freeBoneIds.end()), freeBoneIds.end());
+		boneCurves.clear();
+		animationColumnCache.clear();
+		animationColumnBones.clear();
+		curvesDirty = true;
+		unbindModelSkin();
+		freeBones(&boneList);
+	}
 	boneList.clear();
 	boneIteratorAssociations.clear();
 	gtk_tree_store_clear(boneStore);
@@ -143,16 +1017,25 @@ void resetAnimations() {
 	for (unsigned i = 0; i < boneList.size(); i++) {
 		boneList[i]->animations.clear();
 	}
+	boneCurves.clear();
+	tracksChanged();
 	if (boneList.size() > 0) verifyBoneAnimationCounts();
+	invalidateAnimationMarks();
 }
 
 void resetAll() {
 	resetBones();
 	resetAnimations();
 	if (loadedModel != NULL) {
+		lockGlContext();
+		destroyMeshLods();
+		destroyMeshClusters();
 		delete loadedModel;
 		loadedModel = NULL;
+		crowdSpacingModel = NULL;
+		unlockGlContext();
 	}
+	resetUndoHistory();
 }
 
 string getFileNameOpen() {
@@ -180,6 +1063,47 @@ string getFileNameOpen() {
 	return "";
 }
 
+vector<string> getFileNamesOpen(string caption, string pattern) {
+	vector<string> fileNames;
+	GtkWidget * window = gtk_window_new(GTK_WINDOW_TOPLEVEL),
+			* dialog = gtk_file_chooser_dialog_new(caption.c_str(), GTK_WINDOW(window), GTK_FILE_CHOOSER_ACTION_OPEN,
+					GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, GTK_STOCK_OPEN, GTK_RESPONSE_ACCEPT, NULL);
+	gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), true);
+
+	GtkFileFilter * filter = gtk_file_filter_new();
+	gtk_file_filter_add_pattern(filter, pattern.c_str());
+	gtk_file_chooser_set_filter(GTK_FILE_CHOOSER(dialog), filter);
+
+	if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+		GSList * list = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+		for (GSList * item = list; item != NULL; item = item->next) {
+			fileNames.push_back((char*)item->data);
+			g_free(item->data);
+		}
+		g_slist_free(list);
+	}
+	gtk_widget_destroy(dialog);
+	gtk_widget_destroy(window);
+	return fileNames;
+}
+
+string getFolderName(string caption) {
+	GtkWidget * window = gtk_window_new(GTK_WINDOW_TOPLEVEL),
+			* dialog = gtk_file_chooser_dialog_new(caption.c_str(), GTK_WINDOW(window),
+					GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER, GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, GTK_STOCK_OPEN,
+					GTK_RESPONSE_ACCEPT, NULL);
+
+	string folderName = "";
+	if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+		gchar * gFolderName = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+		folderName = gFolderName;
+		g_free(gFolderName);
+	}
+	gtk_widget_destroy(dialog);
+	gtk_widget_destroy(window);
+	return folderName;
+}
+
 string getFileNameSave(string caption = "") {
 	if (caption == "") caption = "Save File";
 
@@ -200,6 +1124,7 @@ string getFileNameSave(string caption = "") {
 }
 
 void exportSms(string fileName = "") {
+	PROFILE_SCOPE("exportSms");
 	if (root == NULL) return;
 
 	//just to make sure that the bones are *definitely* in the correct order!
@@ -233,57 +1158,101 @@ void exportSms(string fileName = "") {
 	file.close();
 }
 
+//Returns false if the file couldn't be written
+bool writeSmaTracks(string fileName, vector<smaTrack> * tracks, vector<smaTangent> * tangents,
+		vector<float> * rootMotion = NULL) {
+	ofstream file;
+	file.open(fileName.c_str());
+	if (!file.is_open()) return false;
+
+	file << tracks->size() << "\n";
+	for (unsigned i = 0; i < tracks->size(); i++) {
+		bone::animation * pAnimation = &((*tracks)[i].animation);
+		file << (*tracks)[i].boneId << "\n";
+		file << pAnimation->name << "\n";
+		file << pAnimation->length << "\n";
+		file << pAnimation->frames.size() << "\n";
+		for (unsigned j = 0; j < pAnimation->frames.size(); j++) {
+			file << pAnimation->frames[j].xRot << "\n";
+			file << pAnimation->frames[j].yRot << "\n";
+			file << pAnimation->frames[j].zRot << "\n";
+			file << pAnimation->frames[j].step << "\n";
+		}
+	}
+
+	//Written as comments so that loaders which only know about linear keys still read the file
+	for (unsigned i = 0; i < tangents->size(); i++) {
+		smaTangent * tangent = &(*tangents)[i];
+		file << "//tangent " << tangent->boneId << " " << tangent->step << " " << tangent->tangent.mode << " "
+				<< tangent->tangent.slope.x << " " << tangent->tangent.slope.y << " " << tangent->tangent.slope.z
+				<< "\n";
+	}
+	if ((rootMotion != NULL) && (rootMotion->size() > 0)) {
+		file << "//rootmotion";
+		for (unsigned i = 0; i < rootMotion->size(); i++) file << " " << (*rootMotion)[i];
+		file << "\n";
+	}
+	file.close();
+	return !file.fail();
+}
+
 void exportSma(string fileName = "") {
+	PROFILE_SCOPE("exportSma");
 	if (root == NULL) return;
 
 	if (fileName == "") fileName =
 			getFileNameSave("Saving SuperMaximo Animation ("+animations[currentAnimation].name+")");
 
 	if (lowerCase(rightStr(fileName, 4)) != ".sma") fileName += ".sma";
+
+	vector<smaTrack> tracks(boneList.size());
+	vector<smaTangent> tangents;
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		tracks[i].boneId = boneList[i]->id;
+		tracks[i].animation = boneList[i]->animations[currentAnimation];
+		tracks[i].animation.length = animations[currentAnimation].length;
+
+		trackCurve * curve = findTrackCurve(boneList[i], currentAnimation);
+		if (curve == NULL) continue;
+		for (map<unsigned, keyTangent>::iterator it = curve->tangents.begin(); it != curve->tangents.end(); ++it)
+			tangents.push_back((smaTangent){(unsigned)boneList[i]->id, it->first, it->second});
+	}
+	writeSmaTracks(fileName, &tracks, &tangents, &(animations[currentAnimation].rootMotion));
+}
+
+//Writes vertex data laid out like the model's VBO, along with the model's materials
+void writeSmm(string fileName, vector<GLfloat> * data) {
 	ofstream file;
 	file.open(fileName.c_str());
 
-	file << boneList.size() << "\n";
-	for (unsigned i = 0; i < boneList.size(); i++) {
-		file << boneList[i]->id << "\n";
-		file << boneList[i]->animations[currentAnimation].name << "\n";
-		file << animations[currentAnimation].length << "\n";
-		file << boneList[i]->animations[currentAnimation].frames.size() << "\n";
-		for (unsigned j = 0; j < boneList[i]->animations[currentAnimation].frames.size(); j++) {
-			file << boneList[i]->animations[currentAnimation].frames[j].xRot << "\n";
-			file << boneList[i]->animations[currentAnimation].frames[j].yRot << "\n";
-			file << boneList[i]->animations[currentAnimation].frames[j].zRot << "\n";
-			file << boneList[i]->animations[currentAnimation].frames[j].step << "\n";
-		}
+	file << data->size()/24 << "\n";
+	for (unsigned i = 0; i < data->size(); i++) file << (*data)[i] << "\n";
+
+	file << loadedModel->materials()->size() << "\n";
+	for (unsigned i = 0; i < loadedModel->materials()->size(); i++) {
+		file << loadedModel->materials()->at(i).fileName << "\n";
 	}
+
 	file.close();
 }
 
 void exportSmm(string fileName = "") {
+	PROFILE_SCOPE("exportSmm");
 	if (loadedModel == NULL) return;
 
 	if (fileName == "") fileName = getFileNameSave("Saving SuperMaximo Model");
 
 	if (lowerCase(rightStr(fileName, 4)) != ".smm") fileName += ".smm";
-	ofstream file;
-	file.open(fileName.c_str());
-
-	file << loadedModel->vertexCount() << "\n";
 
 	unsigned arraySize = loadedModel->vertexCount()*24;
-	GLfloat data[arraySize];
+	vector<GLfloat> data(arraySize); //too big for the stack on large meshes
+	lockGlContext();
 	glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
-	glGetBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(data), &data);
+	glGetBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*arraySize, &data[0]);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	unlockGlContext();
 
-	for (unsigned i = 0; i < arraySize; i++) file << data[i] << "\n";
-
-	file << loadedModel->materials()->size() << "\n";
-	for (unsigned i = 0; i < loadedModel->materials()->size(); i++) {
-		file << loadedModel->materials()->at(i).fileName << "\n";
-	}
-
-	file.close();
+	writeSmm(fileName, &data);
 }
 
 void exportSmo() {
@@ -330,30 +1299,60 @@ void exportSmmCallback() {
 	exportSmm();
 }
 
-void loadSms(string fileName) {
-	vector<string> text;
+//Moves a load's progress bar to the fraction given and says whether to carry on. Loads on the main thread have no
+//fileLoad, and always carry on
+bool continueFileLoad(fileLoad * load, double fraction) {
+	if (load == NULL) return true;
+	g_atomic_int_set(&(load->progress), (gint)(min(fraction, 1.0)*1000.0));
+	return !g_atomic_int_get(&(load->cancelled));
+}
+
+//Reads the lines of a SuperMaximo text file, leaving out comments. Comments are collected separately (without the
+//leading "//") if asked, as they carry data that older loaders don't know about. Reading is the first half of a
+//load's progress, and parsing the second
+bool readTextFile(string fileName, vector<string> * text, vector<string> * comments = NULL, fileLoad * load = NULL) {
 	ifstream file;
 	file.open(fileName.c_str());
 	if (file.is_open()) {
-		while (!file.eof()) {
+		double size = 0.0;
+		if (load != NULL) {
+			file.seekg(0, ios::end);
+			size = file.tellg();
+			file.seekg(0, ios::beg);
+		}
+		for (unsigned line = 0; !file.eof(); line++) {
+			if (((line%LOAD_CHECK_LINES) == 0) && (load != NULL)
+					&& !continueFileLoad(load, (size > 0.0) ? (double(file.tellg())/size)*0.5 : 0.5)) return false;
 			string tempStr;
 			getline(file, tempStr);
 			if (leftStr(tempStr, 2) != "//") {
 				if (rightStr(tempStr, 1) == "\n") leftStr(&tempStr, tempStr.size()-1);
-				text.push_back(tempStr);
-			}
+				text->push_back(tempStr);
+			} else if (comments != NULL) comments->push_back(rightStr(tempStr, tempStr.size()-2));
 		}
 		file.close();
 	} else {
 		cout << "File " << fileName << " could not be loaded" << endl;
-		return;
+		return false;
 	}
-	if (text.back() == "") text.pop_back();
+	if ((text->size() > 0) && (text->back() == "")) text->pop_back();
+	return text->size() > 0;
+}
+
+//Appends the skeleton's bones to the list, which parent ids index into. Bones already appended when a load is
+//cancelled are left for the caller to free
+bool readSmsBones(string fileName, vector<bone *> * bones, fileLoad * load = NULL) {
+	vector<string> text;
+	if (!readTextFile(fileName, &text, NULL, load)) return false;
 
-	unsigned boneCount = atoi(text.front().c_str()), line = 1;
+	unsigned boneCount = atoi(text.front().c_str()), line = 1, checkLine = 0;
 
 	for (unsigned i = 0; i < boneCount; i++) {
-		bone * newBone = new bone;
+		if (line >= checkLine) {
+			if (!continueFileLoad(load, 0.5+(double(line)/text.size())*0.5)) return false;
+			checkLine = line+LOAD_CHECK_LINES;
+		}
+		bone * newBone = allocateBone();
 
 		newBone->id = atoi(text[line].c_str());
 		line++;
@@ -373,8 +1372,8 @@ void loadSms(string fileName) {
 		line++;
 		int boneParentId = atoi(text[line].c_str());
 		if (boneParentId < 0) newBone->parent = NULL; else {
-			newBone->parent = boneList[boneParentId];
-			boneList[boneParentId]->child.push_back(newBone);
+			newBone->parent = (*bones)[boneParentId];
+			(*bones)[boneParentId]->child.push_back(newBone);
 		}
 		line++;
 		newBone->rotationUpperLimit.x = strtof(text[line].c_str(), NULL);
@@ -390,74 +1389,90 @@ void loadSms(string fileName) {
 		newBone->rotationLowerLimit.z = strtof(text[line].c_str(), NULL);
 		line++;
 
-		boneList.push_back(newBone);
+		bones->push_back(newBone);
 	}
-	for (unsigned i = 0; i < boneList.size(); i++) {
-		if ((root == NULL) || (selectedBone == NULL)) {
-			root = boneList[i];
-			selectedBone = root;
+	return true;
+}
 
-			boneIteratorAssociations.push_back((boneIteratorAssociation){selectedBone});
-			gtk_tree_store_append(boneStore, &(boneIteratorAssociations.back().iterator), NULL);
-		} else {
-			selectedBone = boneList[i];
+//Adds loaded bones, parents before children, to the bone tree. The store is filled while detached from the view and
+//with selectBone blocked, then the tree is expanded and the last bone selected once at the end, as adding them one at
+//a time used to leave it
+void populateBoneTree(vector<bone *> * bones) {
+	PROFILE_SCOPE("populateBoneTree");
+	if (bones->empty()) return;
+
+	//Each bone's parent's association, found in one pass. Parents that aren't among the new bones must already be in
+	//the tree
+	map<bone *, unsigned> associationIds;
+	for (unsigned i = 0; i < boneIteratorAssociations.size(); i++)
+		associationIds[boneIteratorAssociations[i].pBone] = i;
+	unsigned firstNew = boneIteratorAssociations.size();
+	vector<int> parentIds(bones->size(), -1);
+	for (unsigned i = 0; i < bones->size(); i++) {
+		associationIds[(*bones)[i]] = firstNew+i;
+		if ((*bones)[i]->parent != NULL) {
+			map<bone *, unsigned>::iterator parent = associationIds.find((*bones)[i]->parent);
+			if (parent != associationIds.end()) parentIds[i] = parent->second;
+		}
+	}
 
-			unsigned i;
-			for (i = 0; i < boneIteratorAssociations.size(); i++) {
-				if (boneIteratorAssociations[i].pBone == selectedBone->parent) break;
-			}
+	g_signal_handler_block(boneSelect, boneSelectHandler);
+	g_object_ref(boneStore);
+	gtk_tree_view_set_model(GTK_TREE_VIEW(boneView), NULL);
 
-			boneIteratorAssociations.push_back((boneIteratorAssociation){selectedBone});
-			gtk_tree_store_append(boneStore, &(boneIteratorAssociations.back().iterator),
-					&(boneIteratorAssociations[i].iterator));
-		}
-		selectedBone->xRot = selectedBone->yRot = selectedBone->zRot = 0.0f;
-
-		gtk_tree_store_set(boneStore, &(boneIteratorAssociations.back().iterator), 0, selectedBone->name.c_str(), -1);
+	boneIteratorAssociations.reserve(firstNew+bones->size());
+	for (unsigned i = 0; i < bones->size(); i++) {
+		bone * pBone = (*bones)[i];
+		if (root == NULL) root = pBone;
+		pBone->xRot = pBone->yRot = pBone->zRot = 0.0f;
 
-		GtkTreePath * tempPath = gtk_tree_model_get_path(GTK_TREE_MODEL(boneStore),
-				&(boneIteratorAssociations.back().iterator));
-		gtk_tree_view_expand_to_path(GTK_TREE_VIEW(boneView), tempPath);
-		gtk_tree_path_free(tempPath);
-		gtk_tree_selection_select_iter(boneSelect, &(boneIteratorAssociations.back().iterator));
+		boneIteratorAssociations.push_back((boneIteratorAssociation){pBone});
+		GtkTreeIter * parentIterator = (parentIds[i] == -1) ? NULL : &(boneIteratorAssociations[parentIds[i]].iterator);
+		gtk_tree_store_insert_with_values(boneStore, &(boneIteratorAssociations.back().iterator), parentIterator, -1, 0,
+				pBone->name.c_str(), -1);
 	}
+
+	gtk_tree_view_set_model(GTK_TREE_VIEW(boneView), GTK_TREE_MODEL(boneStore));
+	g_object_unref(boneStore);
+	gtk_tree_view_expand_all(GTK_TREE_VIEW(boneView));
+	g_signal_handler_unblock(boneSelect, boneSelectHandler);
+
+	selectedBone = bones->back();
+	gtk_tree_selection_select_iter(boneSelect, &(boneIteratorAssociations.back().iterator));
 }
 
-void loadSma(string fileName) {
-	if (root == NULL) return;
+void loadSms(string fileName) {
+	PROFILE_SCOPE("loadSms");
+	if (!readSmsBones(fileName, &boneList)) return;
+	populateBoneTree(&boneList);
+}
 
-	vector<string> text;
-	ifstream file;
-	file.open(fileName.c_str());
-	if (file.is_open()) {
-		while (!file.eof()) {
-			string tempStr;
-			getline(file, tempStr);
-			if (leftStr(tempStr, 2) != "//") {
-				if (rightStr(tempStr, 1) == "\n") leftStr(&tempStr, tempStr.size()-1);
-				text.push_back(tempStr);
-			}
-		}
-		file.close();
-	} else {
-		cout << "File " << fileName << " could not be loaded" << endl;
-		return;
-	}
-	if (text.back() == "") text.pop_back();
+bool readSmaTracks(string fileName, vector<smaTrack> * tracks, vector<smaTangent> * tangents,
+		vector<float> * rootMotion = NULL, fileLoad * load = NULL) {
+	vector<string> text, comments;
+	if (!readTextFile(fileName, &text, &comments, load)) return false;
 
-	unsigned boneCount = atoi(text.front().c_str()), line = 1;
+	unsigned boneCount = atoi(text.front().c_str()), line = 1, checkLine = 0;
+	tracks->resize(boneCount);
 	for (unsigned i = 0; i < boneCount; i++) {
-		bone::animation newAnimation;
-		unsigned boneId = atoi(text[line].c_str());
+		if (line >= checkLine) {
+			//Tracks can be any length, so the checks go by lines parsed rather than tracks
+			if (!continueFileLoad(load, 0.5+(double(line)/text.size())*0.5)) return false;
+			checkLine = line+LOAD_CHECK_LINES;
+		}
+		bone::animation * newAnimation = &((*tracks)[i].animation);
+		(*tracks)[i].boneId = atoi(text[line].c_str());
 		line++;
 
-		newAnimation.name = text[line];
+		newAnimation->name = text[line];
 		line++;
-		newAnimation.length = atoi(text[line].c_str());
+		newAnimation->length = atoi(text[line].c_str());
 		line++;
 
 		unsigned frameCount = atoi(text[line].c_str());
 		line++;
+		newAnimation->frames.clear();
+		newAnimation->frames.reserve(frameCount);
 		for (unsigned j = 0; j < frameCount; j++) {
 			bone::keyFrame newFrame;
 			newFrame.xRot = strtof(text[line].c_str(), NULL);
@@ -468,75 +1483,69 @@ void loadSma(string fileName) {
 			line++;
 			newFrame.step = atoi(text[line].c_str());
 			line++;
-			newAnimation.frames.push_back(newFrame);
+			newAnimation->frames.push_back(newFrame);
 		}
-		if (boneId < boneList.size()) boneList[boneId]->animations.push_back(newAnimation);
 	}
-	animations.push_back((animationDetail){root->animations.back().name, root->animations.back().length});
-	updateAnimationSpinButtonRange();
+
+	tangents->clear();
+	if (rootMotion != NULL) rootMotion->clear();
+	for (unsigned i = 0; i < comments.size(); i++) {
+		if ((rootMotion != NULL) && (leftStr(comments[i], 11) == "rootmotion ")) {
+			stringstream stream(rightStr(comments[i], comments[i].size()-11), stringstream::in);
+			float heading;
+			while (stream >> heading) rootMotion->push_back(heading);
+			continue;
+		}
+		if (leftStr(comments[i], 8) != "tangent ") continue;
+
+		stringstream stream(rightStr(comments[i], comments[i].size()-8), stringstream::in);
+		smaTangent tangent;
+		int tangentMode;
+		stream >> tangent.boneId >> tangent.step >> tangentMode >> tangent.tangent.slope.x >> tangent.tangent.slope.y
+				>> tangent.tangent.slope.z;
+		if (stream.fail() || (tangentMode < TANGENT_AUTO) || (tangentMode > TANGENT_USER)) continue;
+		tangent.tangent.mode = (tangentModeEnum)tangentMode;
+		tangents->push_back(tangent);
+	}
+	return true;
 }
 
-void bufferObj(GLuint * vbo, Model * model, void *) {
-	modelVbo = vbo;
+//Adds an animation read by readSmaTracks to the skeleton
+void addSmaTracks(vector<smaTrack> * tracks, vector<smaTangent> * tangents, vector<float> * rootMotion) {
+	vector<unsigned char> trackAdded(boneList.size(), false);
+	for (unsigned i = 0; i < tracks->size(); i++) {
+		smaTrack * track = &(*tracks)[i];
+		if (track->boneId >= boneList.size()) continue;
+		boneList[track->boneId]->animations.push_back(track->animation);
+		trackAdded[track->boneId] = true;
+	}
 
-	GLfloat * vertexArray = new GLfloat[model->vertexCount()*24];
-	unsigned count = 0;
-	for (unsigned i = 0; i < model->vertexCount()/3; i++) {
-		for (short j = 0; j < 3; j++) {
-			vertexArray[count] = (*(model->triangles()))[i].coords[j].x;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].coords[j].y;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].coords[j].z;
-			count++;
-			vertexArray[count] = 1.0f;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].coords[j].normal_.x;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].coords[j].normal_.y;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].coords[j].normal_.z;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].ambientColor.r;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].ambientColor.g;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].ambientColor.b;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].diffuseColor.r;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].diffuseColor.g;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].diffuseColor.b;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].specularColor.r;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].specularColor.g;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].specularColor.b;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].texCoords[j].x;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].texCoords[j].y;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].texCoords[j].z;
-			count++;
-			vertexArray[count] = (*(model->triangles()))[i].mtlNum;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].hasTexture;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].shininess;
-			count++;
-			vertexArray[count] = (*(model->materials()))[(*(model->triangles()))[i].mtlNum].alpha;
-			count++;
-			vertexArray[count] = -1.0f; //bone ID
-			count++;
-		}
+	//Tangents belong to the track just added, and are dropped for bones the file had no track for
+	for (unsigned i = 0; i < tangents->size(); i++) {
+		smaTangent * tangent = &(*tangents)[i];
+		if ((tangent->boneId >= boneList.size()) || !trackAdded[tangent->boneId]) continue;
+		bone * pBone = boneList[tangent->boneId];
+		vector<trackCurve> * curves = &boneCurves[pBone];
+		if (curves->size() < pBone->animations.size()) curves->resize(pBone->animations.size());
+		(*curves)[pBone->animations.size()-1].tangents[tangent->step] = tangent->tangent;
 	}
+	tracksChanged();
+	animations.push_back((animationDetail){root->animations.back().name, root->animations.back().length, *rootMotion});
+	updateAnimationSpinButtonRange();
+}
 
-	glGenBuffers(1, vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*model->vertexCount()*24, vertexArray, GL_DYNAMIC_DRAW);
+void loadSma(string fileName) {
+	PROFILE_SCOPE("loadSma");
+	if (root == NULL) return;
+
+	vector<smaTrack> tracks;
+	vector<smaTangent> tangents;
+	vector<float> rootMotion;
+	if (readSmaTracks(fileName, &tracks, &tangents, &rootMotion)) addSmaTracks(&tracks, &tangents, &rootMotion);
+}
+
+//Describes the 24 float vertex layout of the model VBO, which must be bound
+void setModelVertexAttributes() {
 	glVertexAttribPointer(VERTEX_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat)*24, 0);
 	glVertexAttribPointer(NORMAL_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat)*24,
 			(const GLvoid*)(sizeof(GLfloat)*4));
@@ -570,6 +1579,49 @@ void bufferObj(GLuint * vbo, Model * model, void *) {
 	glEnableVertexAttribArray(EXTRA2_ATTRIBUTE);
 	glEnableVertexAttribArray(EXTRA3_ATTRIBUTE);
 	glEnableVertexAttribArray(EXTRA4_ATTRIBUTE);
+}
+
+//Fills in the 24 floats the VBO holds for a corner of one of the model's triangles, without a bone
+void fillModelVertex(Model * model, unsigned triangleIndex, short corner, GLfloat * data) {
+	triangle * pTriangle = &(*(model->triangles()))[triangleIndex];
+	material * pMaterial = &(*(model->materials()))[pTriangle->mtlNum];
+	data[0] = pTriangle->coords[corner].x;
+	data[1] = pTriangle->coords[corner].y;
+	data[2] = pTriangle->coords[corner].z;
+	data[3] = 1.0f;
+	data[4] = pTriangle->coords[corner].normal_.x;
+	data[5] = pTriangle->coords[corner].normal_.y;
+	data[6] = pTriangle->coords[corner].normal_.z;
+	data[7] = pMaterial->ambientColor.r;
+	data[8] = pMaterial->ambientColor.g;
+	data[9] = pMaterial->ambientColor.b;
+	data[10] = pMaterial->diffuseColor.r;
+	data[11] = pMaterial->diffuseColor.g;
+	data[12] = pMaterial->diffuseColor.b;
+	data[13] = pMaterial->specularColor.r;
+	data[14] = pMaterial->specularColor.g;
+	data[15] = pMaterial->specularColor.b;
+	data[16] = pTriangle->texCoords[corner].x;
+	data[17] = pTriangle->texCoords[corner].y;
+	data[18] = pTriangle->texCoords[corner].z;
+	data[19] = pTriangle->mtlNum;
+	data[20] = pMaterial->hasTexture;
+	data[21] = pMaterial->shininess;
+	data[22] = pMaterial->alpha;
+	data[23] = -1.0f; //bone ID
+}
+
+//Called from the Model constructor, which may be running on the loader thread
+void bufferObj(GLuint * vbo, Model * model, void *) {
+	GLfloat * vertexArray = new GLfloat[model->vertexCount()*24];
+	for (unsigned i = 0; i < model->vertexCount()/3; i++) {
+		for (short j = 0; j < 3; j++) fillModelVertex(model, i, j, &vertexArray[(i*72)+(j*24)]);
+	}
+
+	glGenBuffers(1, vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, *vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*model->vertexCount()*24, vertexArray, GL_DYNAMIC_DRAW);
+	setModelVertexAttributes();
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	delete[] vertexArray;
@@ -580,83 +1632,224 @@ void flagExecuteOpenFile() {
 }
 
 void loadBonesFromModel() {
-	for (unsigned i = 0; i < loadedModel->bones()->size(); i++) {
-		if ((root == NULL) || (selectedBone == NULL)) {
-			root = loadedModel->bones()->at(i);
-			selectedBone = root;
-
-			boneIteratorAssociations.push_back((boneIteratorAssociation){selectedBone});
-			gtk_tree_store_append(boneStore, &(boneIteratorAssociations.back().iterator), NULL);
-		} else {
-			selectedBone = loadedModel->bones()->at(i);
-
-			unsigned i;
-			for (i = 0; i < boneIteratorAssociations.size(); i++) {
-				if (boneIteratorAssociations[i].pBone == selectedBone->parent) break;
-			}
-
-			boneIteratorAssociations.push_back((boneIteratorAssociation){selectedBone});
-			gtk_tree_store_append(boneStore, &(boneIteratorAssociations.back().iterator),
-					&(boneIteratorAssociations[i].iterator));
-		}
-		selectedBone->xRot = selectedBone->yRot = selectedBone->zRot = 0.0f;
-
-		gtk_tree_store_set(boneStore, &(boneIteratorAssociations.back().iterator), 0, selectedBone->name.c_str(), -1);
-
-		GtkTreePath * tempPath = gtk_tree_model_get_path(GTK_TREE_MODEL(boneStore),
-				&(boneIteratorAssociations.back().iterator));
-		gtk_tree_view_expand_to_path(GTK_TREE_VIEW(boneView), tempPath);
-		gtk_tree_path_free(tempPath);
-		gtk_tree_selection_select_iter(boneSelect, &(boneIteratorAssociations.back().iterator));
-		boneList.push_back(selectedBone);
-	}
+	populateBoneTree(loadedModel->bones());
+	boneList.insert(boneList.end(), loadedModel->bones()->begin(), loadedModel->bones()->end());
 	loadedModel->bones()->clear();
+	tracksChanged();
 	if (selectedBone != NULL) {
 		setRotationLimitValues(selectedBone);
 		if (animations.size() > 0) animations.clear();
 		for (unsigned i = 0; i < selectedBone->animations.size(); i++)
 			animations.push_back((animationDetail){selectedBone->animations[i].name,
 				selectedBone->animations[i].length});
+		invalidateAnimationMarks();
+	}
+}
+
+//The last letter of the extension of a file that can be loaded, otherwise 0
+char loadableFileType(string fileName) {
+	string tempStr = rightStr(fileName, 4);
+	if ((tempStr == ".obj") || (tempStr == ".smo") || (tempStr == ".smm") || (tempStr == ".sms")
+			|| (tempStr == ".sma")) return tempStr[3];
+	cout << "Invalid file type" << endl;
+	return 0;
+}
+
+Model * newModel(string fileName, char type) {
+	int pos = fileName.find_last_of("/")+1;
+	return new Model("model", leftStr(fileName, pos), rightStr(fileName, fileName.size()-pos), 60, DYNAMIC_DRAW,
+			(type == 'j') ? bufferObj : NULL);
+}
+
+//Swaps a model that has already been built in for the loaded one. Called with the GL context held
+void replaceLoadedModel(Model * model, char type) {
+	destroyMeshLods();
+	gtk_label_set_text(GTK_LABEL(lodInfoLabel), "");
+	destroyMeshClusters();
+	if (loadedModel != NULL) delete loadedModel;
+	loadedModel = model;
+	modelVbo = loadedModel->vboPointer();
+	if (type == 'o') loadBonesFromModel();
+	pickMeshDirty = true;
+}
+
+bool loadFile(string fileName) {
+	char type = loadableFileType(fileName);
+	if (type == 0) return false;
+	lockGlContext();
+	switch (type) {
+	case 's':
+		resetBones();
+		loadSms(fileName);
+		break;
+	case 'a':
+		resetAnimations();
+		loadSma(fileName);
+		break;
+	default: replaceLoadedModel(newModel(fileName, type), type);
+	}
+	crowdSpacingModel = NULL;
+	unlockGlContext();
+	resetUndoHistory();
+	return true;
+}
+
+//Reads a model file through once in chunks, so that the progress bar moves and a cancel is noticed while a large file
+//comes off the disk. The library's Model then reads it back from the page cache. Skeletons and animations don't need
+//this, as the editor's own parsers report progress and check for a cancel as they go
+bool readFileAhead(fileLoad * load) {
+	ifstream file;
+	file.open(load->fileName.c_str(), ios::in | ios::binary);
+	if (!file.is_open()) {
+		cout << "File " << load->fileName << " could not be loaded" << endl;
+		return false;
+	}
+	file.seekg(0, ios::end);
+	double size = file.tellg(), done = 0.0;
+	file.seekg(0, ios::beg);
+	vector<char> chunk(LOAD_CHUNK_SIZE);
+	while (file.good() && !g_atomic_int_get(&(load->cancelled))) {
+		file.read(&chunk[0], chunk.size());
+		done += file.gcount();
+		g_atomic_int_set(&(load->progress), (size > 0.0) ? (gint)((done/size)*1000.0) : 1000);
+	}
+	file.close();
+	return true;
+}
+
+//Does everything up to the scene swap: reading and parsing, building the model's vertex array and uploading it.
+//The model is built in the render thread's context, borrowed for the length of the Model constructor, since the
+//library makes its buffers and vertex array there and vertex arrays can't be shared between contexts
+gpointer fileLoadMain(gpointer data) {
+	fileLoad * load = (fileLoad *)data;
+	switch (load->type) {
+	case 's':
+		load->succeeded = readSmsBones(load->fileName, &(load->bones), load);
+		break;
+	case 'a':
+		load->succeeded = readSmaTracks(load->fileName, &(load->tracks), &(load->tangents), &(load->rootMotion), load);
+		break;
+	default:
+		load->succeeded = readFileAhead(load);
+		if (load->succeeded && !g_atomic_int_get(&(load->cancelled))) {
+			g_atomic_int_set(&(load->building), 1);
+			borrowGlContext();
+			load->model = newModel(load->fileName, load->type);
+			glFinish();
+			returnGlContext();
+		}
+	}
+	g_atomic_int_set(&(load->finished), 1);
+	return NULL;
+}
+
+void cancelFileLoad() {
+	if (activeFileLoad != NULL) g_atomic_int_set(&(activeFileLoad->cancelled), 1);
+}
+
+//Waits for the loader thread, then swaps what it made into the scene in one step, or throws it away if the load was
+//cancelled
+void endFileLoad() {
+	fileLoad * load = activeFileLoad;
+	activeFileLoad = NULL;
+	g_thread_join(load->thread);
+	gtk_widget_destroy(load->window);
+
+	if (load->succeeded && !g_atomic_int_get(&(load->cancelled))) {
+		PROFILE_SCOPE("swapLoadedFile");
+		lockGlContext();
+		switch (load->type) {
+		case 's':
+			resetBones();
+			boneList.swap(load->bones);
+			populateBoneTree(&boneList);
+			break;
+		case 'a':
+			resetAnimations();
+			if (root != NULL) addSmaTracks(&(load->tracks), &(load->tangents), &(load->rootMotion));
+			break;
+		default: replaceLoadedModel(load->model, load->type);
+		}
+		crowdSpacingModel = NULL;
+		unlockGlContext();
+		resetUndoHistory();
+	} else {
+		if (load->model != NULL) {
+			lockGlContext();
+			delete load->model;
+			unlockGlContext();
+		}
+		freeBones(&(load->bones));
+	}
+	delete load;
+	redrawNeeded = true;
+}
+
+gboolean pollFileLoad(void *) {
+	if (activeFileLoad == NULL) return false;
+	if (g_atomic_int_get(&(activeFileLoad->finished))) {
+		endFileLoad();
+		return false;
 	}
+
+	GtkWidget * progressBar = activeFileLoad->progressBar;
+	if (g_atomic_int_get(&(activeFileLoad->building))) {
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR(progressBar), "Building");
+		gtk_progress_bar_pulse(GTK_PROGRESS_BAR(progressBar));
+	} else gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progressBar),
+			g_atomic_int_get(&(activeFileLoad->progress))/1000.0);
+	return true;
+}
+
+GtkWidget * createFileLoadWindow(fileLoad * load) {
+	GtkWidget * window = gtk_window_new(GTK_WINDOW_TOPLEVEL), * button, * grid = gtk_grid_new();
+	gtk_window_set_title(GTK_WINDOW(window), ("Loading "+rightStr(load->fileName,
+			load->fileName.size()-(load->fileName.find_last_of("/")+1))).c_str());
+	gtk_window_set_resizable(GTK_WINDOW(window), false);
+	gtk_window_set_deletable(GTK_WINDOW(window), false);
+	gtk_window_set_modal(GTK_WINDOW(window), true); //the other windows would change the scene mid load
+
+	load->progressBar = gtk_progress_bar_new();
+	gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(load->progressBar), true);
+	gtk_grid_attach(GTK_GRID(grid), load->progressBar, 1, 1, 1, 1);
+
+	button = gtk_button_new_with_label("Cancel");
+	g_signal_connect(button, "clicked", G_CALLBACK(cancelFileLoad), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, 2, 1, 1);
+
+	gtk_container_add(GTK_CONTAINER(window), grid);
+	gtk_widget_show_all(window);
+	return window;
 }
 
+//Loads on the loader thread so the windows stay responsive and the load can be cancelled, falling back to loading in
+//place if there's no render thread whose context the loader can borrow
 void openFile() {
 	string fileName = getFileNameOpen();
-	if (fileName != "") {
-		string tempStr = rightStr(fileName, 4);
-		if ((tempStr == ".obj") || (tempStr == ".smo") || (tempStr == ".smm") || (tempStr == ".sms")
-				|| (tempStr == ".sma")) {
-			int pos = fileName.find_last_of("/")+1;
-			switch (tempStr[3]) {
-			case 'j':
-				if (loadedModel != NULL) delete loadedModel;
-				loadedModel = new Model("model", leftStr(fileName, pos), rightStr(fileName, fileName.size()-pos), 60,
-						DYNAMIC_DRAW, bufferObj);
-				break;
-			case 'o':
-				if (loadedModel != NULL) delete loadedModel;
-				loadedModel = new Model("model", leftStr(fileName, pos), rightStr(fileName, fileName.size()-pos), 60,
-						DYNAMIC_DRAW);
-				modelVbo = loadedModel->vboPointer();
-				loadBonesFromModel();
-				break;
-			case 'm':
-				if (loadedModel != NULL) delete loadedModel;
-				loadedModel = new Model("model", leftStr(fileName, pos), rightStr(fileName, fileName.size()-pos), 60,
-						DYNAMIC_DRAW);
-				modelVbo = loadedModel->vboPointer();
-				break;
-			case 's':
-				resetBones();
-				loadSms(fileName);
-				break;
-			case 'a':
-				resetAnimations();
-				loadSma(fileName);
-				break;
-			}
-		} else cout << "Invalid file type" << endl;
+	if (fileName == "") return;
+	if (renderThread == NULL) {
+		loadFile(fileName);
+		return;
 	}
+	char type = loadableFileType(fileName);
+	if ((type == 0) || (activeFileLoad != NULL)) return;
+
+	fileLoad * load = new fileLoad;
+	load->fileName = fileName;
+	load->type = type;
+	load->progress = load->cancelled = load->building = load->finished = 0;
+	load->succeeded = false;
+	load->model = NULL;
+	load->window = createFileLoadWindow(load);
+	load->thread = g_thread_try_new("loader", fileLoadMain, load, NULL);
+	if (load->thread == NULL) {
+		gtk_widget_destroy(load->window);
+		delete load;
+		loadFile(fileName);
+		return;
+	}
+	activeFileLoad = load;
+	g_timeout_add(LOAD_POLL_INTERVAL, pollFileLoad, NULL);
 }
 
 void toggleWireframeMode() {
@@ -694,14 +1887,74 @@ void toggleSkinning() {
 
 void togglePlayAnimation() {
 	playAnimation = !playAnimation;
+	if (!playAnimation) setTimelineJumpText();
 }
 
 void toggleAutoKey() {
 	autoKeyEnabled = !autoKeyEnabled;
 }
 
-void setViewOrientation(GtkWidget *, viewOrientationEnum * newViewOrientation) {
-	viewOrientation = *newViewOrientation;
+void toggleIk() {
+	ikEnabled = !ikEnabled;
+}
+
+void undoEditCallback() {
+	undoEdit();
+}
+
+void redoEditCallback() {
+	redoEdit();
+}
+
+void updateIkChainLength() {
+	ikChainLength = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(ikChainLengthSpinButton));
+}
+
+void toggleCrowd() {
+	crowdEnabled = !crowdEnabled;
+	crowdFramesSinceReport = 0;
+	if (!crowdEnabled) gtk_label_set_text(GTK_LABEL(crowdTimingLabel), "");
+}
+
+void updateCrowdSettings() {
+	crowdSize = gtk_spin_button_get_value(GTK_SPIN_BUTTON(crowdSizeSpinButton));
+	crowdVaryAnimations = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(crowdVaryToggleButton));
+}
+
+//The rotation each fixed view looks from. Returns false for the free view, which keeps whatever rotation it has
+bool fixedViewRotation(viewOrientationEnum orientation, float * newXRotation, float * newYRotation) {
+	switch (orientation) {
+	case TOP:
+		*newXRotation = 90.0f;
+		*newYRotation = 0.0f;
+		return true;
+	case BOTTOM:
+		*newXRotation = -90.0f;
+		*newYRotation = 0.0f;
+		return true;
+	case LEFT:
+		*newXRotation = 0.0f;
+		*newYRotation = 90.0f;
+		return true;
+	case RIGHT:
+		*newXRotation = 0.0f;
+		*newYRotation = -90.0f;
+		return true;
+	case FRONT:
+		*newXRotation = 0.0f;
+		*newYRotation = 0.0f;
+		return true;
+	case BACK:
+		*newXRotation = 0.0f;
+		*newYRotation = 180.0f;
+		return true;
+	default: return false;
+	}
+}
+
+//Only switches the orientation and its toggle buttons, leaving the rotation and the tools alone
+void showViewOrientation(viewOrientationEnum newViewOrientation) {
+	viewOrientation = newViewOrientation;
 	for (int i = TOP; i <= FREE; i++) {
 		if (i != viewOrientation) {
 			g_signal_handler_block(viewToggleButton[i], viewToggleHandler[i]);
@@ -714,121 +1967,479 @@ void setViewOrientation(GtkWidget *, viewOrientationEnum * newViewOrientation) {
 			g_signal_handler_unblock(viewToggleButton[i], viewToggleHandler[i]);
 		}
 	}
-	switch (viewOrientation) {
-	case TOP:
-		xRotation = 90.0f;
-		yRotation = 0.0f;
-		break;
-	case BOTTOM:
-		xRotation = -90.0f;
-		yRotation = 0.0f;
-		break;
-	case LEFT:
-		xRotation = 0.0f;
-		yRotation = 90.0f;
-		break;
-	case RIGHT:
-		xRotation = 0.0f;
-		yRotation = -90.0f;
-		break;
-	case FRONT:
-		xRotation = 0.0f;
-		yRotation = 0.0f;
-		break;
-	case BACK:
-		xRotation = 0.0f;
-		yRotation = 180.0f;
-		break;
-	case FREE:
-		if (boneCreationEnabled) {
-			g_signal_handler_block(boneCreationToggleButton, boneCreationToggleHandler);
-			gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(boneCreationToggleButton), 0);
-			g_signal_handler_unblock(boneCreationToggleButton, boneCreationToggleHandler);
-			boneCreationEnabled = false;
-		}
-		break;
-	default: break;
+}
+
+void setViewOrientation(GtkWidget *, viewOrientationEnum * newViewOrientation) {
+	showViewOrientation(*newViewOrientation);
+	if (!fixedViewRotation(viewOrientation, &xRotation, &yRotation) && boneCreationEnabled) {
+		g_signal_handler_block(boneCreationToggleButton, boneCreationToggleHandler);
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(boneCreationToggleButton), 0);
+		g_signal_handler_unblock(boneCreationToggleButton, boneCreationToggleHandler);
+		boneCreationEnabled = false;
 	}
 }
 
-void createGlWindow() {
-	initSDL(SDL_INIT_EVERYTHING);
-	initDisplay(800, 600, 1000, 60, false, "SuperMaximo ModelAnimator");
-	setClearColor(0.3, 0.3, 0.3, 1.0);
-	initInput();
+void storeViewCamera(viewCamera * camera) {
+	camera->orientation = viewOrientation;
+	camera->zoom = zoom;
+	camera->xRotation = xRotation;
+	camera->yRotation = yRotation;
+	camera->translation = viewTranslation;
+}
 
-	boneShader = new Shader("boneShader", "shaders/bone_vertex_shader.vs", "shaders/bone_fragment_shader.fs", 10,
-			VERTEX_ATTRIBUTE, "vertex", NORMAL_ATTRIBUTE, "normal", COLOR0_ATTRIBUTE, "ambientColor", COLOR1_ATTRIBUTE,
-			"diffuseColor", COLOR2_ATTRIBUTE, "specularColor", TEXTURE0_ATTRIBUTE, "texCoords", EXTRA0_ATTRIBUTE,
-			"mtlNum", EXTRA1_ATTRIBUTE, "hasTexture", EXTRA2_ATTRIBUTE, "shininess", EXTRA3_ATTRIBUTE, "alpha");
-	boneShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
-	boneShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
-	boneShader->setUniformLocation(TEXSAMPLER_LOCATION, "endVertex");
-	boneShader->setUniformLocation(EXTRA0_LOCATION, "boneModelviewMatrix");
-	boneShader->setUniformLocation(EXTRA1_LOCATION, "selected");
-
-	skeletonShader = new Shader("skeletonShader", "shaders/skeleton_vertex_shader.vs",
-			"shaders/skeleton_fragment_shader.fs", 10, VERTEX_ATTRIBUTE, "vertex", NORMAL_ATTRIBUTE, "normal",
-			COLOR0_ATTRIBUTE, "ambientColor", COLOR1_ATTRIBUTE, "diffuseColor", COLOR2_ATTRIBUTE, "specularColor",
-			TEXTURE0_ATTRIBUTE, "texCoords", EXTRA0_ATTRIBUTE, "mtlNum", EXTRA1_ATTRIBUTE, "hasTexture",
-			EXTRA2_ATTRIBUTE, "shininess", EXTRA3_ATTRIBUTE, "alpha", EXTRA4_ATTRIBUTE, "boneId");
-	skeletonShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
-	skeletonShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
-	skeletonShader->setUniformLocation(TEXSAMPLER_LOCATION, "colorMap");
-	skeletonShader->setUniformLocation(EXTRA0_LOCATION, "jointModelviewMatrix");
-	skeletonShader->setUniformLocation(EXTRA1_LOCATION, "selectedBoneId");
-	skeletonShader->setUniformLocation(EXTRA2_LOCATION, "polygonModePoint");
-	skeletonShader->bind();
+//Moving between quad views mustn't change the tools, so unlike picking the free view this leaves bone creation on.
+//It just can't start a bone in the free view
+void loadViewCamera(viewCamera * camera) {
+	showViewOrientation(camera->orientation);
+	zoom = camera->zoom;
+	xRotation = camera->xRotation;
+	yRotation = camera->yRotation;
+	viewTranslation = camera->translation;
+}
 
-	animationShader = new Shader("animationShader", "shaders/animation_vertex_shader.vs",
-			"shaders/animation_fragment_shader.fs", 10, VERTEX_ATTRIBUTE, "vertex", NORMAL_ATTRIBUTE, "normal",
-			COLOR0_ATTRIBUTE, "ambientColor", COLOR1_ATTRIBUTE, "diffuseColor", COLOR2_ATTRIBUTE, "specularColor",
-			TEXTURE0_ATTRIBUTE, "texCoords", EXTRA0_ATTRIBUTE, "mtlNum", EXTRA1_ATTRIBUTE, "hasTexture",
-			EXTRA2_ATTRIBUTE, "shininess", EXTRA3_ATTRIBUTE, "alpha", EXTRA4_ATTRIBUTE, "boneId");
-	animationShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
-	animationShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
-	animationShader->setUniformLocation(TEXSAMPLER_LOCATION, "colorMap");
-	animationShader->setUniformLocation(EXTRA0_LOCATION, "boneModelviewMatrix");
+bool sameViewCamera(viewCamera * camera, viewCamera * otherCamera) {
+	return (camera->orientation == otherCamera->orientation) && (camera->zoom == otherCamera->zoom)
+			&& (camera->xRotation == otherCamera->xRotation) && (camera->yRotation == otherCamera->yRotation)
+			&& (camera->translation.x == otherCamera->translation.x)
+			&& (camera->translation.y == otherCamera->translation.y);
+}
 
-	arrowShader = new Shader("arrowShader", "shaders/arrow_vertex_shader.vs", "shaders/arrow_fragment_shader.fs", 1,
-			VERTEX_ATTRIBUTE, "vertex");
-	arrowShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
-	arrowShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
-	arrowShader->setUniformLocation(TEXSAMPLER_LOCATION, "color");
-	arrowShader->setUniformLocation(EXTRA0_LOCATION, "arrowLength");
+//Hands the editor's camera to the view under the mouse, unless a drag in the last one hasn't finished
+void focusQuadView() {
+	if (!quadViewEnabled || mouseLeft() || mouseRight() || mouseMiddle() || creatingBone) return;
+	unsigned view = ((mouseX()*2 >= (int)screenWidth()) ? 1 : 0)+((mouseY()*2 >= (int)screenHeight()) ? 2 : 0);
+	if (view == activeQuadView) return;
+	storeViewCamera(&quadViews[activeQuadView]);
+	activeQuadView = view;
+	loadViewCamera(&quadViews[view]);
+	redrawNeeded = true;
+}
 
-	boxShader = new Shader("boxShader", "shaders/box_vertex_shader.vs", "shaders/arrow_fragment_shader.fs", 1,
-			VERTEX_ATTRIBUTE, "vertex");
-	boxShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
-	boxShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
-	boxShader->setUniformLocation(TEXSAMPLER_LOCATION, "color");
-	boxShader->setUniformLocation(EXTRA0_LOCATION, "startPosition");
-	boxShader->setUniformLocation(EXTRA1_LOCATION, "mousePosition");
+//Time based scaling for movement, measured between glLoop frames since refreshScreen (which times compensation()) is
+//no longer called now that the render thread presents frames. Clamped so that the first frame after the editor has
+//been idle doesn't jump
+void updateFrameCompensation() {
+	static gint64 lastTime = 0;
+	gint64 time = g_get_monotonic_time();
+	if (lastTime == 0) frameCompensationValue = 1.0f;
+		else frameCompensationValue = min(float(time-lastTime)/TARGET_FRAME_TIME, MAX_COMPENSATION);
+	lastTime = time;
+}
 
-	ringShader = new Shader("ringShader", "shaders/ring_vertex_shader.vs", "shaders/arrow_fragment_shader.fs", 1,
-			VERTEX_ATTRIBUTE, "vertex");
-	ringShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
-	ringShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
-	ringShader->setUniformLocation(TEXSAMPLER_LOCATION, "color");
-	ringShader->setUniformLocation(EXTRA0_LOCATION, "scale");
+float frameCompensation() {
+	return frameCompensationValue;
+}
 
-	{
-		glGenVertexArrays(1, &arrowVao);
-		glBindVertexArray(arrowVao);
-		glGenBuffers(1, &arrowVbo);
-		glBindBuffer(GL_ARRAY_BUFFER, arrowVbo);
-		GLfloat vertexArray[24] = {0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-								0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f,
-								0.0f, 0.0f, 0.0f, 1.0f, 1.0f, -1.0f, 0.0f, 1.0f};
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexArray), vertexArray, GL_STATIC_DRAW);
-		glVertexAttribPointer(VERTEX_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, 0, 0);
-		glEnableVertexAttribArray(VERTEX_ATTRIBUTE);
-		glBindVertexArray(0);
-	}
+//Anything happening in the GTK windows may change what the viewport shows
+void handleGdkEvent(GdkEvent * event, gpointer) {
+	redrawNeeded = true;
+	gtk_main_do_event(event);
+}
 
-	{
-		glGenVertexArrays(1, &boxVao);
-		glBindVertexArray(boxVao);
+bool viewportInputActive() {
+	static int lastX = -1, lastY = -1;
+	bool active = (mouseX() != lastX) || (mouseY() != lastY) || mouseLeft() || mouseRight() || mouseMiddle()
+			|| mouseWheelUp() || mouseWheelDown();
+	lastX = mouseX();
+	lastY = mouseY();
+	for (short i = 0; (i < KEYCODE_COUNT) && !active; i++) if (keyPressed(i)) active = true;
+	return active;
+}
+
+//Single producer (glLoop) and single consumer (the render thread) ring of snapshots. Each index is only ever advanced
+//by one side, so neither needs a lock. Returns false if the render thread has fallen behind and the queue is full
+bool pushFrameSnapshot(frameSnapshot * snapshot) {
+	gint tail = g_atomic_int_get(&frameQueueTail), nextTail = (tail+1)%FRAME_QUEUE_SIZE;
+	if (nextTail == g_atomic_int_get(&frameQueueHead)) return false;
+	frameQueue[tail] = snapshot;
+	g_atomic_int_set(&frameQueueTail, nextTail);
+	if (renderThread != NULL) {
+		g_mutex_lock(&renderMutex);
+		g_cond_broadcast(&renderCondition);
+		g_mutex_unlock(&renderMutex);
+	}
+	return true;
+}
+
+bool frameQueueEmpty() {
+	return g_atomic_int_get(&frameQueueHead) == g_atomic_int_get(&frameQueueTail);
+}
+
+frameSnapshot * popFrameSnapshot() {
+	gint head = g_atomic_int_get(&frameQueueHead);
+	if (head == g_atomic_int_get(&frameQueueTail)) return NULL;
+	frameSnapshot * snapshot = frameQueue[head];
+	g_atomic_int_set(&frameQueueHead, (head+1)%FRAME_QUEUE_SIZE);
+	return snapshot;
+}
+
+//Deletes the snapshot, keeping its crowd palette for the main thread to fill again if it doesn't already have a spare
+void releaseFrameSnapshot(frameSnapshot * snapshot) {
+	if (snapshot->crowdPalette.capacity() > 0) {
+		g_mutex_lock(&crowdPaletteMutex);
+		if (spareCrowdPalette.capacity() == 0) spareCrowdPalette.swap(snapshot->crowdPalette);
+		g_mutex_unlock(&crowdPaletteMutex);
+	}
+	delete snapshot;
+}
+
+//Dropping a snapshot mustn't drop skeleton instances the newer one is relying on it to carry
+void releaseSkippedFrameSnapshot(frameSnapshot * skipped, frameSnapshot * next) {
+	if (next->skeletonInstances.empty() && (skipped->skeletonVersion == next->skeletonVersion))
+		next->skeletonInstances.swap(skipped->skeletonInstances);
+	releaseFrameSnapshot(skipped);
+}
+
+void discardFrameSnapshots() {
+	for (frameSnapshot * snapshot = popFrameSnapshot(); snapshot != NULL; snapshot = popFrameSnapshot())
+		releaseFrameSnapshot(snapshot);
+}
+
+//The render thread owns the GL context and only ever draws the newest snapshot. When the main thread asks for the
+//context it parks, dropping any queued snapshots since they may refer to a model that is about to be deleted. With
+//nothing to draw it sleeps until a snapshot is pushed or the context is asked for
+gpointer renderThreadMain(gpointer) {
+	glXMakeCurrent(glDisplay, glDrawable, glContext);
+	g_mutex_lock(&renderMutex);
+	while (!renderQuit) {
+		if (glContextRequested) {
+			glXMakeCurrent(glDisplay, None, NULL);
+			discardFrameSnapshots();
+			renderParked = true;
+			g_cond_broadcast(&renderCondition);
+			while (glContextRequested && !renderQuit) g_cond_wait(&renderCondition, &renderMutex);
+			renderParked = false;
+			glXMakeCurrent(glDisplay, glDrawable, glContext);
+			continue;
+		}
+		if (frameQueueEmpty()) {
+			g_cond_wait(&renderCondition, &renderMutex);
+			continue;
+		}
+		g_mutex_unlock(&renderMutex);
+
+		frameSnapshot * snapshot = NULL;
+		for (frameSnapshot * next = popFrameSnapshot(); next != NULL; next = popFrameSnapshot()) {
+			if (snapshot != NULL) releaseSkippedFrameSnapshot(snapshot, next);
+			snapshot = next;
+		}
+		if (snapshot != NULL) {
+			renderFrame(snapshot);
+			releaseFrameSnapshot(snapshot);
+		}
+
+		g_mutex_lock(&renderMutex);
+	}
+	glXMakeCurrent(glDisplay, None, NULL);
+	renderParked = true;
+	g_cond_broadcast(&renderCondition);
+	g_mutex_unlock(&renderMutex);
+	return NULL;
+}
+
+//Borrows the GL context from the render thread for the few things the main thread still does to GL objects directly:
+//creating and deleting the model, and editing or reading back its VBO. Calls may be nested
+void lockGlContext() {
+	glObjectsVersion++;
+	if (renderThread == NULL) return;
+	if (glContextLockDepth++ > 0) return;
+	borrowGlContext();
+}
+
+void unlockGlContext() {
+	if (renderThread == NULL) return;
+	if (--glContextLockDepth > 0) return;
+	returnGlContext();
+	redrawNeeded = true;
+}
+
+//Parks the render thread and makes the context current on the calling thread, which is the loader thread while a
+//model is being built and the main thread otherwise. The main thread leaves GL alone while a load is running
+void borrowGlContext() {
+	g_mutex_lock(&renderMutex);
+	glContextRequested = true;
+	g_cond_broadcast(&renderCondition);
+	while (!renderParked) g_cond_wait(&renderCondition, &renderMutex);
+	g_mutex_unlock(&renderMutex);
+	glXMakeCurrent(glDisplay, glDrawable, glContext);
+}
+
+void returnGlContext() {
+	glXMakeCurrent(glDisplay, None, NULL);
+	g_mutex_lock(&renderMutex);
+	glContextRequested = false;
+	g_cond_broadcast(&renderCondition);
+	g_mutex_unlock(&renderMutex);
+}
+
+void startRenderThread() {
+	glDisplay = glXGetCurrentDisplay();
+	glDrawable = glXGetCurrentDrawable();
+	glContext = glXGetCurrentContext();
+	g_mutex_init(&renderMutex);
+	g_cond_init(&renderCondition);
+	renderQuit = renderParked = glContextRequested = false;
+
+	glXMakeCurrent(glDisplay, None, NULL);
+	renderThread = g_thread_try_new("render", renderThreadMain, NULL, NULL);
+	if (renderThread == NULL) glXMakeCurrent(glDisplay, glDrawable, glContext);
+}
+
+void stopRenderThread() {
+	if (renderThread == NULL) return;
+	g_mutex_lock(&renderMutex);
+	renderQuit = true;
+	g_cond_broadcast(&renderCondition);
+	g_mutex_unlock(&renderMutex);
+	g_thread_join(renderThread);
+	renderThread = NULL;
+
+	glXMakeCurrent(glDisplay, glDrawable, glContext);
+	discardFrameSnapshots();
+	g_mutex_clear(&renderMutex);
+	g_cond_clear(&renderCondition);
+}
+
+//A framebuffer with colour and depth renderbuffers, or 0 if the driver can't render to it
+GLuint createRenderTarget(unsigned width, unsigned height, GLuint * renderbuffers) {
+	GLuint framebuffer;
+	glGenFramebuffers(1, &framebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	bool complete = (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (complete) return framebuffer;
+	glDeleteRenderbuffers(2, renderbuffers);
+	glDeleteFramebuffers(1, &framebuffer);
+	return 0;
+}
+
+void destroyQuadViewTargets() {
+	for (unsigned i = 0; i < QUAD_VIEW_COUNT; i++) {
+		quadViewTarget * target = &quadViewTargets[i];
+		if (target->framebuffer == 0) continue;
+		glDeleteRenderbuffers(2, target->renderbuffers);
+		glDeleteFramebuffers(1, &(target->framebuffer));
+		target->framebuffer = 0;
+	}
+}
+
+//Splits the viewport into top, front, side and free views. The view under the mouse takes over the editor's camera,
+//so everything that works in a single view works in it unchanged. Each view is drawn into its own framebuffer, and
+//is only redrawn when its camera or the scene changes
+void toggleQuadView(GtkWidget * button) {
+	quadViewEnabled = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(button));
+	lockGlContext();
+	destroyQuadViewTargets();
+	if (quadViewEnabled) {
+		viewOrientationEnum orientations[QUAD_VIEW_COUNT-1] = {TOP, FRONT, RIGHT};
+		for (unsigned i = 0; i+1 < QUAD_VIEW_COUNT; i++) {
+			quadViews[i].orientation = orientations[i];
+			fixedViewRotation(orientations[i], &(quadViews[i].xRotation), &(quadViews[i].yRotation));
+			quadViews[i].zoom = zoom;
+			quadViews[i].translation = (vec2){{0.0f}, {0.0f}};
+		}
+		activeQuadView = QUAD_VIEW_COUNT-1;
+		storeViewCamera(&quadViews[activeQuadView]);
+		for (unsigned i = 0; i < QUAD_VIEW_COUNT; i++) {
+			quadViewTargets[i].framebuffer = createRenderTarget(screenWidth()/2, screenHeight()/2,
+					quadViewTargets[i].renderbuffers);
+			quadViewTargets[i].drawn = false;
+			if (quadViewTargets[i].framebuffer == 0) quadViewEnabled = false;
+		}
+		if (!quadViewEnabled) destroyQuadViewTargets();
+	}
+	unlockGlContext();
+
+	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(button)) && !quadViewEnabled) {
+		cout << "Could not create framebuffers for the quad view" << endl;
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), 0);
+	}
+}
+
+//Linked programs are cached under the user's cache directory, named by a hash of the driver, the build of the editor
+//(since the attribute bindings live in the code) and both sources. If there's a binary, the Shader is made from the
+//placeholder sources, which compile almost instantly, and the binary is then loaded over them. The library's Shader
+//only takes source files, so this is the only way in
+shaderBuild beginShaderBuild(string vertexFile, string fragmentFile) {
+	shaderBuild build;
+	build.vertexFile = build.sourceVertexFile = vertexFile;
+	build.fragmentFile = build.sourceFragmentFile = fragmentFile;
+	build.cached = false;
+	GLint formatCount = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+	if (formatCount == 0) return build;
+
+	string key = string((const char *)glGetString(GL_VENDOR))+"\n"+(const char *)glGetString(GL_RENDERER)+"\n"
+			+(const char *)glGetString(GL_VERSION)+"\n"+__DATE__+" "+__TIME__+"\n";
+	gchar * contents;
+	gsize length;
+	for (short i = 0; i < 2; i++) {
+		string fileName = (i == 0) ? vertexFile : fragmentFile;
+		if (!g_file_get_contents(fileName.c_str(), &contents, &length, NULL)) return build;
+		key.append(contents, length);
+		g_free(contents);
+	}
+	gchar * hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (const guchar *)key.data(), key.size()),
+		* fileName = g_build_filename(g_get_user_cache_dir(), SHADER_CACHE_DIRECTORY, hash, NULL);
+	build.cacheFile = fileName;
+	g_free(fileName);
+	g_free(hash);
+
+	if (!g_file_get_contents(build.cacheFile.c_str(), &contents, &length, NULL)) return build;
+	if (length > sizeof(GLenum)) {
+		copy(contents, contents+sizeof(GLenum), (char *)&build.binaryFormat);
+		build.binary.assign(contents+sizeof(GLenum), length-sizeof(GLenum));
+		build.vertexFile = CACHED_VERTEX_SHADER;
+		build.fragmentFile = CACHED_FRAGMENT_SHADER;
+		build.cached = true;
+	}
+	g_free(contents);
+	return build;
+}
+
+//Loads the cached binary over a Shader made from the placeholders, or caches the binary of one made from source.
+//Returns false if the driver rejected the cached binary, in which case the Shader has been deleted and should be
+//made again, from the sources build now points to
+bool finishShaderBuild(shaderBuild * build, Shader * shader) {
+	GLuint program = shader->program();
+	if (build->cached) {
+		GLint linked = GL_FALSE;
+		glProgramBinary(program, build->binaryFormat, build->binary.data(), build->binary.size());
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (linked == GL_TRUE) return true;
+		delete shader;
+		build->vertexFile = build->sourceVertexFile;
+		build->fragmentFile = build->sourceFragmentFile;
+		build->cached = false;
+		return false;
+	}
+	if (build->cacheFile == "") return true;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return true;
+	string contents(sizeof(GLenum)+length, '\0');
+	GLenum format;
+	glGetProgramBinary(program, length, &length, &format, &contents[sizeof(GLenum)]);
+	copy((char *)&format, (char *)&format+sizeof(GLenum), contents.begin());
+	contents.resize(sizeof(GLenum)+length);
+
+	gchar * directory = g_build_filename(g_get_user_cache_dir(), SHADER_CACHE_DIRECTORY, NULL);
+	g_mkdir_with_parents(directory, 0755);
+	g_free(directory);
+	g_file_set_contents(build->cacheFile.c_str(), contents.data(), contents.size(), NULL);
+	return true;
+}
+
+void createGlWindow() {
+	PROFILE_PHASES("startup: display");
+	initSDL(SDL_INIT_EVERYTHING);
+	initDisplay(800, 600, 1000, 60, false, "SuperMaximo ModelAnimator");
+	setClearColor(0.3, 0.3, 0.3, 1.0);
+	initInput();
+
+	PROFILE_PHASE("startup: shaders");
+	shaderBuild build;
+
+	build = beginShaderBuild("shaders/bone_vertex_shader.vs", "shaders/bone_fragment_shader.fs");
+	do boneShader = new Shader("boneShader", build.vertexFile, build.fragmentFile, 10, VERTEX_ATTRIBUTE, "vertex",
+			NORMAL_ATTRIBUTE, "normal", COLOR0_ATTRIBUTE, "ambientColor", COLOR1_ATTRIBUTE, "diffuseColor",
+			COLOR2_ATTRIBUTE, "specularColor", TEXTURE0_ATTRIBUTE, "texCoords", EXTRA0_ATTRIBUTE, "mtlNum",
+			EXTRA1_ATTRIBUTE, "hasTexture", EXTRA2_ATTRIBUTE, "shininess", EXTRA3_ATTRIBUTE, "alpha");
+	while (!finishShaderBuild(&build, boneShader));
+	boneShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
+	boneShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
+	boneShader->setUniformLocation(EXTRA0_LOCATION, "boneInstances");
+
+	build = beginShaderBuild("shaders/skeleton_vertex_shader.vs", "shaders/skeleton_fragment_shader.fs");
+	do skeletonShader = new Shader("skeletonShader", build.vertexFile, build.fragmentFile, 10, VERTEX_ATTRIBUTE,
+			"vertex", NORMAL_ATTRIBUTE, "normal", COLOR0_ATTRIBUTE, "ambientColor", COLOR1_ATTRIBUTE, "diffuseColor",
+			COLOR2_ATTRIBUTE, "specularColor", TEXTURE0_ATTRIBUTE, "texCoords", EXTRA0_ATTRIBUTE, "mtlNum",
+			EXTRA1_ATTRIBUTE, "hasTexture", EXTRA2_ATTRIBUTE, "shininess", EXTRA3_ATTRIBUTE, "alpha",
+			EXTRA4_ATTRIBUTE, "boneId");
+	while (!finishShaderBuild(&build, skeletonShader));
+	skeletonShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
+	skeletonShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
+	skeletonShader->setUniformLocation(TEXSAMPLER_LOCATION, "colorMap");
+	skeletonShader->setUniformLocation(EXTRA0_LOCATION, "jointModelviewMatrix");
+	skeletonShader->setUniformLocation(EXTRA1_LOCATION, "selectedBoneId");
+	skeletonShader->setUniformLocation(EXTRA2_LOCATION, "polygonModePoint");
+	skeletonShader->bind();
+
+	build = beginShaderBuild("shaders/animation_vertex_shader.vs", "shaders/animation_fragment_shader.fs");
+	do animationShader = new Shader("animationShader", build.vertexFile, build.fragmentFile, 10, VERTEX_ATTRIBUTE,
+			"vertex", NORMAL_ATTRIBUTE, "normal", COLOR0_ATTRIBUTE, "ambientColor", COLOR1_ATTRIBUTE, "diffuseColor",
+			COLOR2_ATTRIBUTE, "specularColor", TEXTURE0_ATTRIBUTE, "texCoords", EXTRA0_ATTRIBUTE, "mtlNum",
+			EXTRA1_ATTRIBUTE, "hasTexture", EXTRA2_ATTRIBUTE, "shininess", EXTRA3_ATTRIBUTE, "alpha",
+			EXTRA4_ATTRIBUTE, "boneId");
+	while (!finishShaderBuild(&build, animationShader));
+	animationShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
+	animationShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
+	animationShader->setUniformLocation(TEXSAMPLER_LOCATION, "colorMap");
+	animationShader->setUniformLocation(EXTRA0_LOCATION, "boneModelviewMatrix");
+
+	build = beginShaderBuild("shaders/crowd_vertex_shader.vs", "shaders/animation_fragment_shader.fs");
+	do crowdShader = new Shader("crowdShader", build.vertexFile, build.fragmentFile, 10, VERTEX_ATTRIBUTE, "vertex",
+			NORMAL_ATTRIBUTE, "normal", COLOR0_ATTRIBUTE, "ambientColor", COLOR1_ATTRIBUTE, "diffuseColor",
+			COLOR2_ATTRIBUTE, "specularColor", TEXTURE0_ATTRIBUTE, "texCoords", EXTRA0_ATTRIBUTE, "mtlNum",
+			EXTRA1_ATTRIBUTE, "hasTexture", EXTRA2_ATTRIBUTE, "shininess", EXTRA3_ATTRIBUTE, "alpha",
+			EXTRA4_ATTRIBUTE, "boneId");
+	while (!finishShaderBuild(&build, crowdShader));
+	crowdShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
+	crowdShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
+	crowdShader->setUniformLocation(EXTRA0_LOCATION, "bonePalette");
+	crowdShader->setUniformLocation(EXTRA1_LOCATION, "paletteStride");
+
+	build = beginShaderBuild("shaders/arrow_vertex_shader.vs", "shaders/arrow_fragment_shader.fs");
+	do arrowShader = new Shader("arrowShader", build.vertexFile, build.fragmentFile, 1, VERTEX_ATTRIBUTE, "vertex");
+	while (!finishShaderBuild(&build, arrowShader));
+	arrowShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
+	arrowShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
+	arrowShader->setUniformLocation(TEXSAMPLER_LOCATION, "color");
+	arrowShader->setUniformLocation(EXTRA0_LOCATION, "arrowLength");
+
+	build = beginShaderBuild("shaders/box_vertex_shader.vs", "shaders/arrow_fragment_shader.fs");
+	do boxShader = new Shader("boxShader", build.vertexFile, build.fragmentFile, 1, VERTEX_ATTRIBUTE, "vertex");
+	while (!finishShaderBuild(&build, boxShader));
+	boxShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
+	boxShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
+	boxShader->setUniformLocation(TEXSAMPLER_LOCATION, "color");
+	boxShader->setUniformLocation(EXTRA0_LOCATION, "startPosition");
+	boxShader->setUniformLocation(EXTRA1_LOCATION, "mousePosition");
+
+	build = beginShaderBuild("shaders/ring_vertex_shader.vs", "shaders/arrow_fragment_shader.fs");
+	do ringShader = new Shader("ringShader", build.vertexFile, build.fragmentFile, 1, VERTEX_ATTRIBUTE, "vertex");
+	while (!finishShaderBuild(&build, ringShader));
+	ringShader->setUniformLocation(MODELVIEW_LOCATION, "modelviewMatrix");
+	ringShader->setUniformLocation(PROJECTION_LOCATION, "projectionMatrix");
+	ringShader->setUniformLocation(TEXSAMPLER_LOCATION, "color");
+	ringShader->setUniformLocation(EXTRA0_LOCATION, "scale");
+
+	{
+		glGenVertexArrays(1, &arrowVao);
+		glBindVertexArray(arrowVao);
+		glGenBuffers(1, &arrowVbo);
+		glBindBuffer(GL_ARRAY_BUFFER, arrowVbo);
+		GLfloat vertexArray[24] = {0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+								0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f,
+								0.0f, 0.0f, 0.0f, 1.0f, 1.0f, -1.0f, 0.0f, 1.0f};
+		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexArray), vertexArray, GL_STATIC_DRAW);
+		glVertexAttribPointer(VERTEX_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, 0, 0);
+		glEnableVertexAttribArray(VERTEX_ATTRIBUTE);
+		glBindVertexArray(0);
+	}
+
+	{
+		glGenVertexArrays(1, &boxVao);
+		glBindVertexArray(boxVao);
 		glGenBuffers(1, &boxVbo);
 		glBindBuffer(GL_ARRAY_BUFFER, boxVbo);
 		GLfloat vertexArray[16] = {0.0f, 0.0f, 0.0f, 1.0f,
@@ -864,16 +2475,68 @@ void createGlWindow() {
 		glBindVertexArray(0);
 	}
 
+	{
+		//A unit cube in the model's vertex layout, unskinned, for the clusters' occlusion queries
+		short faces[36] = {0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5, 0, 4, 5, 0, 5, 1,
+						2, 3, 7, 2, 7, 6, 0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3};
+		GLfloat vertexArray[36*24];
+		for (short i = 0; i < 36; i++) {
+			GLfloat * data = &vertexArray[i*24];
+			fill(data, data+24, 0.0f);
+			data[0] = faces[i] & 1;
+			data[1] = (faces[i] >> 1) & 1;
+			data[2] = (faces[i] >> 2) & 1;
+			data[3] = 1.0f;
+			data[22] = 1.0f;
+			data[23] = -1.0f;
+		}
+		glGenVertexArrays(1, &clusterBoxVao);
+		glBindVertexArray(clusterBoxVao);
+		glGenBuffers(1, &clusterBoxVbo);
+		glBindBuffer(GL_ARRAY_BUFFER, clusterBoxVbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexArray), vertexArray, GL_STATIC_DRAW);
+		setModelVertexAttributes();
+		glBindVertexArray(0);
+	}
+
+	PROFILE_PHASE("startup: bone model");
 	boneModel = new Model("boneModel", "", "bone.obj");
 	boneModel->bindShader(boneShader);
 
-	translateMatrix(screenWidth()/2.0f, screenHeight()/2.0f, -500.0f);
-	scaleMatrix(zoom, -zoom, zoom);
+	glGenVertexArrays(1, &skeletonVao);
+	glBindVertexArray(skeletonVao);
+	glBindBuffer(GL_ARRAY_BUFFER, *(boneModel->vboPointer()));
+	setModelVertexAttributes();
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	g_timeout_add(16, glLoop, NULL);
+	PROFILE_PHASE("startup: render thread");
+	glGenBuffers(1, &skeletonInstanceBuffer);
+	skeletonVersion++; //so the instances are sent for the new buffer
+	glGenTextures(1, &skeletonInstanceTexture);
+	glBindBuffer(GL_TEXTURE_BUFFER, skeletonInstanceBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, skeletonInstanceTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, skeletonInstanceBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	for (short i = 0; i < 16; i++) orthographicMatrix[i] = getMatrix(ORTHOGRAPHIC_MATRIX)[i];
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTextureBufferTexels);
+	startRenderThread();
+
+	gdk_event_handler_set(handleGdkEvent, NULL, NULL);
+	g_timeout_add(glLoopInterval, glLoop, NULL);
 }
 
 void destroyGlWindow() {
+	if (activeFileLoad != NULL) {
+		cancelFileLoad();
+		endFileLoad();
+	}
+	stopRenderThread();
+	destroyMeshLods();
+	destroyMeshClusters();
+	destroyQuadViewTargets();
 	if (loadedModel != NULL) {
 		delete loadedModel;
 		loadedModel = NULL;
@@ -888,6 +2551,18 @@ void destroyGlWindow() {
 	glDeleteBuffers(1, &ringVbo);
 	glDeleteVertexArrays(1, &ringVao);
 
+	glDeleteBuffers(1, &clusterBoxVbo);
+	glDeleteVertexArrays(1, &clusterBoxVao);
+	if (!clusterQueries.empty()) glDeleteQueries(clusterQueries.size(), &clusterQueries[0]);
+	clusterQueries.clear();
+
+	glDeleteTextures(1, &skeletonInstanceTexture);
+	glDeleteBuffers(1, &skeletonInstanceBuffer);
+	glDeleteVertexArrays(1, &skeletonVao);
+
+	destroyCrowd();
+	stopWorkerThreads();
+
 	if (root != NULL) deleteBone(root);
 	boneList.clear();
 
@@ -896,6 +2571,7 @@ void destroyGlWindow() {
 	delete arrowShader;
 	delete boneShader;
 	delete skeletonShader;
+	delete crowdShader;
 	delete boneModel;
 
 	quitInput();
@@ -903,36 +2579,6 @@ void destroyGlWindow() {
 	quitSDL();
 }
 
-void drawBone(bone * pBone) {
-	if (pBone == NULL) return;
-	pushMatrix();
-		float x = pBone->endX, y = pBone->endY, z = pBone->endZ;
-		float xRot = 0.0f, yRot = 0.0f, zRot = 0.0f;
-		xRot = radToDeg(atan(z/y));
-		zRot = radToDeg(atan(y/x));
-		if (zRot == 0.0f) {
-			if (z > 0) zRot = radToDeg(atan(z/x)); else zRot = radToDeg(atan(-z/x));
-		}
-
-		translateMatrix(pBone->x, pBone->y, pBone->z);
-		rotateMatrix(pBone->xRot, 1.0f, 0.0f, 0.0f);
-		rotateMatrix(pBone->yRot, 0.0f, 1.0f, 0.0f);
-		rotateMatrix(pBone->zRot, 0.0f, 0.0f, 1.0f);
-		translateMatrix(-pBone->x, -pBone->y, -pBone->z);
-
-		boneShader->use();
-		boneShader->setUniform4(TEXSAMPLER_LOCATION, pBone->x+pBone->endX, pBone->y+pBone->endY, pBone->z+pBone->endZ,
-				1.0f);
-		boneShader->setUniform16(EXTRA0_LOCATION, getMatrix(MODELVIEW_MATRIX));
-		if (pBone == selectedBone) boneShader->setUniform1(EXTRA1_LOCATION, 1);
-			else boneShader->setUniform1(EXTRA1_LOCATION, 0);
-
-		boneModel->draw(pBone->x, pBone->y, pBone->z, xRot, yRot, zRot-90.0f, boneScale, boneScale, boneScale);
-
-		for (unsigned i = 0; i < pBone->child.size(); i++) drawBone(pBone->child[i]);
-	popMatrix();
-}
-
 unsigned countBones(bone * startBone) {
 	if (startBone == NULL) return 0;
 	unsigned count = 1;
@@ -968,49 +2614,245 @@ void setRotationLimitValues(bone * pBone) {
 	}
 }
 
-void setBoneRotations(float frame, bone * pBone = NULL) {
-	if (pBone == NULL) pBone = root;
+//Shortest signed angle from previousRot to nextRot, so interpolation never goes the long way around
+float rotationDifference(float previousRot, float nextRot) {
+	float diff = fmod(nextRot-previousRot, 360.0f);
+	if (diff > 180.0f) diff -= 360.0f; else if (diff < -180.0f) diff += 360.0f;
+	return diff;
+}
 
-	int index = pBone->animations[currentAnimation].frameIndex(frame);
-	if (index == -1) {
-		if (frame > pBone->animations[currentAnimation].frames.back().step) {
-			pBone->xRot = pBone->animations[currentAnimation].frames.back().xRot;
-			pBone->yRot = pBone->animations[currentAnimation].frames.back().yRot;
-			pBone->zRot = pBone->animations[currentAnimation].frames.back().zRot;
-		} else {
-			bone::keyFrame previousFrame, nextFrame;
-			int i = 0;
-			while (frame > pBone->animations[currentAnimation].frames[i].step) i++;
-			previousFrame = pBone->animations[currentAnimation].frames[i-1];
-			nextFrame = pBone->animations[currentAnimation].frames[i];
+float * keyFrameRotation(bone::keyFrame * frame, short axis) {
+	return (axis == X_AXIS) ? &(frame->xRot) : ((axis == Y_AXIS) ? &(frame->yRot) : &(frame->zRot));
+}
+
+//Slopes (in degrees per frame) of the curve arriving at and leaving key i
+void keyTangents(vector<bone::keyFrame> * frames, unsigned i, map<unsigned, keyTangent> * tangents, float * inTangent,
+		float * outTangent) {
+	keyTangent tangent = (keyTangent){TANGENT_AUTO, (vec3){{0.0f}, {0.0f}, {0.0f}}};
+	map<unsigned, keyTangent>::iterator it = tangents->find((*frames)[i].step);
+	if (it != tangents->end()) tangent = it->second;
+
+	for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+		float before = 0.0f, after = 0.0f;
+		bool hasBefore = (i > 0) && ((*frames)[i].step > (*frames)[i-1].step),
+			hasAfter = (i+1 < frames->size()) && ((*frames)[i+1].step > (*frames)[i].step);
+		if (hasBefore) before = rotationDifference(*keyFrameRotation(&(*frames)[i-1], axis),
+				*keyFrameRotation(&(*frames)[i], axis))/float((*frames)[i].step-(*frames)[i-1].step);
+		if (hasAfter) after = rotationDifference(*keyFrameRotation(&(*frames)[i], axis),
+				*keyFrameRotation(&(*frames)[i+1], axis))/float((*frames)[i+1].step-(*frames)[i].step);
+		if (!hasBefore) before = after;
+		if (!hasAfter) after = before;
+
+		switch (tangent.mode) {
+		case TANGENT_AUTO:
+			if (hasBefore && hasAfter) {
+				inTangent[axis] = outTangent[axis] = ((before*((*frames)[i].step-(*frames)[i-1].step))
+						+(after*((*frames)[i+1].step-(*frames)[i].step)))
+						/float((*frames)[i+1].step-(*frames)[i-1].step);
+			} else inTangent[axis] = outTangent[axis] = before;
+			break;
+		case TANGENT_LINEAR:
+		case TANGENT_STEPPED:
+			inTangent[axis] = before;
+			outTangent[axis] = after;
+			break;
+		case TANGENT_USER:
+			inTangent[axis] = outTangent[axis] = (axis == X_AXIS) ? tangent.slope.x
+					: ((axis == Y_AXIS) ? tangent.slope.y : tangent.slope.z);
+			break;
+		}
+	}
+}
+
+//Precomputes the Hermite coefficients of every segment of the track, so sampling is a single cubic per axis
+void buildTrackCurve(bone::animation * pAnimation, trackCurve * curve) {
+	vector<bone::keyFrame> * frames = &(pAnimation->frames);
+	curve->segments.resize((frames->size() > 0) ? frames->size()-1 : 0);
+	float inTangent[3], outTangent[3], nextInTangent[3], nextOutTangent[3];
+	if (frames->size() > 0) keyTangents(frames, 0, &(curve->tangents), inTangent, outTangent);
+	for (unsigned i = 0; i < curve->segments.size(); i++) {
+		curveSegment * segment = &(curve->segments[i]);
+		bone::keyFrame * startFrame = &(*frames)[i], * endFrame = &(*frames)[i+1];
+		keyTangents(frames, i+1, &(curve->tangents), nextInTangent, nextOutTangent);
+		segment->startStep = startFrame->step;
+		segment->length = (endFrame->step > startFrame->step) ? endFrame->step-startFrame->step : 0;
+
+		map<unsigned, keyTangent>::iterator it = curve->tangents.find(startFrame->step);
+		bool stepped = (it != curve->tangents.end()) && (it->second.mode == TANGENT_STEPPED);
+		for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+			float start = *keyFrameRotation(startFrame, axis),
+				change = rotationDifference(start, *keyFrameRotation(endFrame, axis)),
+				startSlope = outTangent[axis]*segment->length, endSlope = nextInTangent[axis]*segment->length;
+			segment->coefficients[axis][0] = start;
+			if (stepped || (segment->length == 0)) {
+				segment->coefficients[axis][1] = segment->coefficients[axis][2] = segment->coefficients[axis][3] = 0.0f;
+			} else {
+				segment->coefficients[axis][1] = startSlope;
+				segment->coefficients[axis][2] = (3.0f*change)-(2.0f*startSlope)-endSlope;
+				segment->coefficients[axis][3] = (-2.0f*change)+startSlope+endSlope;
+			}
+		}
 
-			float xDiff, yDiff, zDiff,
-				xDiff1 = nextFrame.xRot-previousFrame.xRot,
-				yDiff1 = nextFrame.yRot-previousFrame.yRot,
-				zDiff1 = nextFrame.zRot-previousFrame.zRot,
+		for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+			inTangent[axis] = nextInTangent[axis];
+			outTangent[axis] = nextOutTangent[axis];
+		}
+	}
+}
 
-				xDiff2 = (360.0f-abs(previousFrame.xRot))-abs(nextFrame.xRot),
-				yDiff2 = (360.0f-abs(previousFrame.yRot))-abs(nextFrame.yRot),
-				zDiff2 = (360.0f-abs(previousFrame.zRot))-abs(nextFrame.zRot),
+float * animationColumn(animationColumns * columns, unsigned column) {
+	return &(columns->data[column*columns->keyCount]);
+}
 
-				stepDiff = nextFrame.step-previousFrame.step;
+void buildAnimationColumns(unsigned animationId, animationColumns * columns) {
+	columns->offsets.resize(boneList.size()+1);
+	columns->keyCount = 0;
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		columns->offsets[i] = columns->keyCount;
+		if (animationId < boneList[i]->animations.size())
+			columns->keyCount += boneList[i]->animations[animationId].frames.size();
+	}
+	columns->offsets.back() = columns->keyCount;
+	columns->data.assign(columns->keyCount*ANIMATION_COLUMN_COUNT, 0.0f);
+	if (columns->keyCount == 0) return;
 
-			xDiff = (abs(xDiff1) < xDiff2) ? xDiff1 : ((previousFrame.xRot < 0.0f) ? -xDiff2 : xDiff2);
-			yDiff = (abs(yDiff1) < yDiff2) ? yDiff1 : ((previousFrame.yRot < 0.0f) ? -yDiff2 : yDiff2);
-			zDiff = (abs(zDiff1) < zDiff2) ? zDiff1 : ((previousFrame.zRot < 0.0f) ? -zDiff2 : zDiff2);
+	float * steps = animationColumn(columns, ANIMATION_STEP_COLUMN),
+		* inverseLengths = animationColumn(columns, ANIMATION_LENGTH_COLUMN);
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		if (animationId >= boneList[i]->animations.size()) continue;
+		vector<bone::keyFrame> * frames = &(boneList[i]->animations[animationId].frames);
+		trackCurve * curve = &boneCurves[boneList[i]][animationId];
+		for (unsigned j = 0; j < frames->size(); j++) {
+			unsigned key = columns->offsets[i]+j;
+			steps[key] = (*frames)[j].step;
+			for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+				float * coefficients = animationColumn(columns, ANIMATION_COEFFICIENT_COLUMN+(axis*4));
+				if (j < curve->segments.size()) {
+					for (short k = 0; k < 4; k++)
+						coefficients[(k*columns->keyCount)+key] = curve->segments[j].coefficients[axis][k];
+				} else coefficients[key] = *keyFrameRotation(&(*frames)[j], axis);
+			}
+			if ((j < curve->segments.size()) && (curve->segments[j].length > 0))
+				inverseLengths[key] = 1.0f/curve->segments[j].length;
+		}
+	}
+}
 
-			float multiplier = (frame-previousFrame.step)/stepDiff;
-			pBone->xRot = previousFrame.xRot+(xDiff*multiplier);
-			pBone->yRot = previousFrame.yRot+(yDiff*multiplier);
-			pBone->zRot = previousFrame.zRot+(zDiff*multiplier);
+//Only call from the main thread. Afterwards every track of every bone has a curve, and every animation its columns,
+//so findTrackCurve and sampleAnimationColumns are safe to use from worker threads until the keys are next changed
+void updateTrackCurves() {
+	PROFILE_SCOPE("updateTrackCurves");
+	unsigned animationCount = boneList.empty() ? 0 : boneList.front()->animations.size();
+	if (!curvesDirty && (animationColumnBones == boneList) && (animationColumnCache.size() == animationCount)) return;
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		vector<trackCurve> * curves = &boneCurves[boneList[i]];
+		curves->resize(boneList[i]->animations.size());
+		for (unsigned j = 0; j < curves->size(); j++) {
+			//Tangents of keys that have since been deleted are dropped
+			map<unsigned, keyTangent> * tangents = &((*curves)[j].tangents);
+			for (map<unsigned, keyTangent>::iterator it = tangents->begin(); it != tangents->end();) {
+				if (boneList[i]->animations[j].frameIndex(it->first) == -1) tangents->erase(it++); else ++it;
+			}
+			buildTrackCurve(&(boneList[i]->animations[j]), &(*curves)[j]);
 		}
-	} else {
-		pBone->xRot = pBone->animations[currentAnimation].frames[index].xRot;
-		pBone->yRot = pBone->animations[currentAnimation].frames[index].yRot;
-		pBone->zRot = pBone->animations[currentAnimation].frames[index].zRot;
+		animationCount = max(animationCount, (unsigned)curves->size());
+	}
+	animationColumnCache.resize(animationCount);
+	for (unsigned i = 0; i < animationCount; i++) buildAnimationColumns(i, &animationColumnCache[i]);
+	animationColumnBones = boneList;
+	animationColumnsVersion++;
+	curvesDirty = false;
+}
+
+trackCurve * findTrackCurve(bone * pBone, unsigned animationId) {
+	map<bone *, vector<trackCurve> >::iterator it = boneCurves.find(pBone);
+	if ((it == boneCurves.end()) || (animationId >= it->second.size())) return NULL;
+	return &(it->second[animationId]);
+}
+
+void sampleAnimation(bone::animation * pAnimation, float frame, vec3 * rotation, trackCurve * curve = NULL) {
+	if (pAnimation->frames.size() == 0) {
+		rotation->x = rotation->y = rotation->z = 0.0f;
+		return;
+	}
+
+	bone::keyFrame * frameToUse = NULL;
+	if (frame >= pAnimation->frames.back().step) frameToUse = &pAnimation->frames.back();
+		else if (frame <= pAnimation->frames.front().step) frameToUse = &pAnimation->frames.front();
+	if (frameToUse == NULL) {
+		//Binary search for the first keyframe at or after the frame, as the keyframes are kept sorted
+		unsigned low = 1, high = pAnimation->frames.size()-1;
+		while (low < high) {
+			unsigned middle = (low+high)/2;
+			if (pAnimation->frames[middle].step < frame) low = middle+1; else high = middle;
+		}
+		if (pAnimation->frames[low].step == frame) frameToUse = &pAnimation->frames[low];
+			else if ((curve != NULL) && (curve->segments.size() == pAnimation->frames.size()-1)) {
+			curveSegment * segment = &(curve->segments[low-1]);
+			float t = (segment->length == 0) ? 0.0f : (frame-segment->startStep)/float(segment->length);
+			rotation->x = segment->coefficients[X_AXIS][0]+(t*(segment->coefficients[X_AXIS][1]
+					+(t*(segment->coefficients[X_AXIS][2]+(t*segment->coefficients[X_AXIS][3])))));
+			rotation->y = segment->coefficients[Y_AXIS][0]+(t*(segment->coefficients[Y_AXIS][1]
+					+(t*(segment->coefficients[Y_AXIS][2]+(t*segment->coefficients[Y_AXIS][3])))));
+			rotation->z = segment->coefficients[Z_AXIS][0]+(t*(segment->coefficients[Z_AXIS][1]
+					+(t*(segment->coefficients[Z_AXIS][2]+(t*segment->coefficients[Z_AXIS][3])))));
+			return;
+		} else {
+			bone::keyFrame * previousFrame = &pAnimation->frames[low-1], * nextFrame = &pAnimation->frames[low];
+			float multiplier = (frame-previousFrame->step)/float(nextFrame->step-previousFrame->step);
+			rotation->x = previousFrame->xRot+(rotationDifference(previousFrame->xRot, nextFrame->xRot)*multiplier);
+			rotation->y = previousFrame->yRot+(rotationDifference(previousFrame->yRot, nextFrame->yRot)*multiplier);
+			rotation->z = previousFrame->zRot+(rotationDifference(previousFrame->zRot, nextFrame->zRot)*multiplier);
+			return;
+		}
+	}
+	rotation->x = frameToUse->xRot;
+	rotation->y = frameToUse->yRot;
+	rotation->z = frameToUse->zRot;
+}
+
+//The same result as sampleAnimation with the bone's curve, read from the animation's columns
+void sampleAnimationColumns(animationColumns * columns, unsigned boneIndex, float frame, vec3 * rotation) {
+	unsigned begin = columns->offsets[boneIndex], end = columns->offsets[boneIndex+1];
+	if (begin == end) {
+		rotation->x = rotation->y = rotation->z = 0.0f;
+		return;
+	}
+
+	//The last key at or before the frame, or the first key if the frame is before them all
+	float * steps = animationColumn(columns, ANIMATION_STEP_COLUMN);
+	unsigned key = upper_bound(steps+begin, steps+end, frame)-steps;
+	float t = 0.0f;
+	if (key > begin) {
+		key--;
+		t = (frame-steps[key])*animationColumn(columns, ANIMATION_LENGTH_COLUMN)[key];
 	}
 
-	for (unsigned i = 0; i < pBone->child.size(); i++) setBoneRotations(frame, pBone->child[i]);
+	float values[3];
+	for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+		float * coefficients = &animationColumn(columns, ANIMATION_COEFFICIENT_COLUMN+(axis*4))[key];
+		unsigned stride = columns->keyCount;
+		values[axis] = coefficients[0]+(t*(coefficients[stride]+(t*(coefficients[2*stride]
+				+(t*coefficients[3*stride])))));
+	}
+	rotation->x = values[X_AXIS];
+	rotation->y = values[Y_AXIS];
+	rotation->z = values[Z_AXIS];
+}
+
+//Poses every bone in one pass over the current animation's columns
+void setBoneRotations(float frame) {
+	updateTrackCurves();
+	if (currentAnimation >= animationColumnCache.size()) return;
+
+	animationColumns * columns = &animationColumnCache[currentAnimation];
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		vec3 rotation;
+		sampleAnimationColumns(columns, i, frame, &rotation);
+		boneList[i]->xRot = rotation.x;
+		boneList[i]->yRot = rotation.y;
+		boneList[i]->zRot = rotation.z;
+	}
 }
 
 void resetBoneRotations(bone * pBone = NULL) {
@@ -1022,84 +2864,407 @@ void resetBoneRotations(bone * pBone = NULL) {
 	for (unsigned i = 0; i < pBone->child.size(); i++) resetBoneRotations(pBone->child[i]);
 }
 
-void initBone(bone * pBone, bone * parent = NULL) {
-	static int id = 0;
-	int idToUse;
-	if (freeBoneIds.size() > 0) {
-		idToUse = freeBoneIds.front();
-		freeBoneIds.erase(freeBoneIds.begin());
-	} else {
-		idToUse = id;
-		id++;
+//Column major, matching OpenGL. result may not alias either input
+void multiplyMatrices(const float * a, const float * b, float * result) {
+	for (short column = 0; column < 4; column++) {
+		for (short row = 0; row < 4; row++) {
+			result[(column*4)+row] = (a[row]*b[column*4])+(a[4+row]*b[(column*4)+1])+(a[8+row]*b[(column*4)+2])
+					+(a[12+row]*b[(column*4)+3]);
+		}
 	}
+}
 
-	stringstream stream(stringstream::in | stringstream::out);
-	stream.setf(ios::fixed, ios::floatfield);
-	stream << idToUse;
+//The rotation (in degrees) applied in the same order as the shaders, with no translation
+void eulerMatrix(vec3 * rotation, float * matrix) {
+	float cx = cos(degToRad(rotation->x)), sx = sin(degToRad(rotation->x)), cy = cos(degToRad(rotation->y)),
+		sy = sin(degToRad(rotation->y)), cz = cos(degToRad(rotation->z)), sz = sin(degToRad(rotation->z));
+
+	matrix[0] = cy*cz;
+	matrix[1] = (cx*sz)+(sx*sy*cz);
+	matrix[2] = (sx*sz)-(cx*sy*cz);
+	matrix[3] = 0.0f;
+	matrix[4] = -cy*sz;
+	matrix[5] = (cx*cz)-(sx*sy*sz);
+	matrix[6] = (sx*cz)+(cx*sy*sz);
+	matrix[7] = 0.0f;
+	matrix[8] = sy;
+	matrix[9] = -sx*cy;
+	matrix[10] = cx*cy;
+	matrix[11] = 0.0f;
+	matrix[12] = matrix[13] = matrix[14] = 0.0f;
+	matrix[15] = 1.0f;
+}
 
-	*pBone = (bone){idToUse, "bone"+stream.str(), 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, parent};
-	pBone->rotationUpperLimit.x = pBone->rotationUpperLimit.y = pBone->rotationUpperLimit.z = 180.0f;
-	pBone->rotationLowerLimit.x = pBone->rotationLowerLimit.y = pBone->rotationLowerLimit.z = -180.0f;
-	boneList.push_back(pBone);
+//The same transform applyBoneTransforms builds on the matrix stack, without touching the (single threaded) stack
+void boneLocalMatrix(bone * pBone, vec3 * rotation, float * matrix) {
+	eulerMatrix(rotation, matrix);
+	matrix[12] = pBone->x-((matrix[0]*pBone->x)+(matrix[4]*pBone->y)+(matrix[8]*pBone->z));
+	matrix[13] = pBone->y-((matrix[1]*pBone->x)+(matrix[5]*pBone->y)+(matrix[9]*pBone->z));
+	matrix[14] = pBone->z-((matrix[2]*pBone->x)+(matrix[6]*pBone->y)+(matrix[10]*pBone->z));
+	matrix[15] = 1.0f;
 }
 
-void deleteBone(bone * pBone) {
-	for (unsigned i = 0; i < pBone->child.size(); i++) deleteBone(pBone->child[i]);
+//Rotation of angle radians about a unit length axis
+void axisAngleMatrix(vec3 * axis, float angle, float * matrix) {
+	float c = cos(angle), s = sin(angle), t = 1.0f-c;
+	matrix[0] = (t*axis->x*axis->x)+c;
+	matrix[1] = (t*axis->x*axis->y)+(s*axis->z);
+	matrix[2] = (t*axis->x*axis->z)-(s*axis->y);
+	matrix[3] = 0.0f;
+	matrix[4] = (t*axis->x*axis->y)-(s*axis->z);
+	matrix[5] = (t*axis->y*axis->y)+c;
+	matrix[6] = (t*axis->y*axis->z)+(s*axis->x);
+	matrix[7] = 0.0f;
+	matrix[8] = (t*axis->x*axis->z)+(s*axis->y);
+	matrix[9] = (t*axis->y*axis->z)-(s*axis->x);
+	matrix[10] = (t*axis->z*axis->z)+c;
+	matrix[11] = matrix[12] = matrix[13] = matrix[14] = 0.0f;
+	matrix[15] = 1.0f;
+}
 
-	if (pBone->parent != NULL) {
-		for (unsigned i = 0; i < pBone->parent->child.size(); i++) {
-			if (pBone->parent->child[i] == pBone) {
-				pBone->parent->child.erase(pBone->parent->child.begin()+i);
-				break;
-			}
-		}
-	}
+void transformPoint(const float * matrix, float x, float y, float z, vec3 * result) {
+	result->x = (matrix[0]*x)+(matrix[4]*y)+(matrix[8]*z)+matrix[12];
+	result->y = (matrix[1]*x)+(matrix[5]*y)+(matrix[9]*z)+matrix[13];
+	result->z = (matrix[2]*x)+(matrix[6]*y)+(matrix[10]*z)+matrix[14];
+}
 
-	bool boneFound = false, parentFound;
-	if (pBone->parent == NULL) parentFound = true; else parentFound = false;
-	for (unsigned i = 0; i < boneIteratorAssociations.size(); i++) {
-		if ((boneIteratorAssociations[i].pBone == pBone) && !boneFound) {
-			gtk_tree_store_remove(boneStore, &(boneIteratorAssociations[i].iterator));
-			boneIteratorAssociations.erase(boneIteratorAssociations.begin()+i);
-			boneFound = true;
-		} else if ((boneIteratorAssociations[i].pBone == pBone->parent) && !parentFound) {
-			gtk_tree_selection_select_iter(boneSelect, &(boneIteratorAssociations[i].iterator));
-			parentFound = true;
-		}
-		if (boneFound && parentFound) break;
+//Inverse of a matrix made only of rotations and translations, which all of the bone matrices are
+void rigidInverse(const float * matrix, float * result) {
+	for (short column = 0; column < 3; column++) {
+		for (short row = 0; row < 3; row++) result[(column*4)+row] = matrix[(row*4)+column];
+		result[(column*4)+3] = 0.0f;
 	}
+	for (short row = 0; row < 3; row++)
+		result[12+row] = -((result[row]*matrix[12])+(result[4+row]*matrix[13])+(result[8+row]*matrix[14]));
+	result[15] = 1.0f;
+}
 
-	for (unsigned i = 0; i < boneList.size(); i++) {
-		if (boneList[i] == pBone) {
-			boneList.erase(boneList.begin()+i);
-			break;
-		}
+//Recovers the rotations (in degrees) that boneLocalMatrix would have used to build the rotation part of the matrix
+void eulerFromMatrix(const float * matrix, vec3 * rotation) {
+	float sy = max(-1.0f, min(1.0f, matrix[8]));
+	rotation->y = radToDeg(asin(sy));
+	if (abs(sy) < 0.9999f) {
+		rotation->x = radToDeg(atan2(-matrix[9], matrix[10]));
+		rotation->z = radToDeg(atan2(-matrix[4], matrix[0]));
+	} else {
+		rotation->x = 0.0f;
+		rotation->z = radToDeg(atan2(matrix[1], matrix[5]));
 	}
+}
 
-	unsigned i = 0;
-	for (; i < freeBoneIds.size(); i++) {
-		if (pBone->id < freeBoneIds[i]) break;
+void boneWorldMatrix(bone * pBone, float * matrix) {
+	vec3 rotation = (vec3){{pBone->xRot}, {pBone->yRot}, {pBone->zRot}};
+	if (pBone->parent == NULL) boneLocalMatrix(pBone, &rotation, matrix); else {
+		float parentMatrix[16], localMatrix[16];
+		boneWorldMatrix(pBone->parent, parentMatrix);
+		boneLocalMatrix(pBone, &rotation, localMatrix);
+		multiplyMatrices(parentMatrix, localMatrix, matrix);
 	}
-	freeBoneIds.insert(freeBoneIds.begin()+i, pBone->id);
+}
 
-	vector<GLfloat> oldIds;
-	vector<GLfloat> newIds;
-	for (unsigned i = 0; i < boneList.size(); i++) {
-		if (boneList[i]->id >= (int)boneList.size()) {
-			oldIds.push_back(boneList[i]->id);
+//The rotation that lays the bone model, which points up the y axis, along the bone
+void boneMeshRotation(bone * pBone, vec3 * rotation) {
+	float x = pBone->endX, y = pBone->endY, z = pBone->endZ;
+	rotation->x = radToDeg(atan(z/y));
+	rotation->y = 0.0f;
+	rotation->z = radToDeg(atan(y/x));
+	if (rotation->z == 0.0f) {
+		if (z > 0) rotation->z = radToDeg(atan(z/x)); else rotation->z = radToDeg(atan(-z/x));
+	}
+	rotation->z -= 90.0f;
+}
 
-			bone * tempBone = boneList[i];
-			boneList.erase(boneList.begin()+i);
+void addSkeletonInstances(bone * pBone, const float * parentMatrix) {
+	float localMatrix[16], worldMatrix[16], meshMatrix[16];
+	vec3 rotation = (vec3){{pBone->xRot}, {pBone->yRot}, {pBone->zRot}};
+	boneLocalMatrix(pBone, &rotation, localMatrix);
+	if (parentMatrix == NULL) copy(localMatrix, localMatrix+16, worldMatrix);
+		else multiplyMatrices(parentMatrix, localMatrix, worldMatrix);
+
+	//Matches the translate, rotate then scale that Model::draw applies
+	boneMeshRotation(pBone, &rotation);
+	eulerMatrix(&rotation, meshMatrix);
+	for (short i = 0; i < 12; i++) if ((i%4) != 3) meshMatrix[i] *= boneScale;
+	meshMatrix[12] = pBone->x;
+	meshMatrix[13] = pBone->y;
+	meshMatrix[14] = pBone->z;
+
+	skeletonInstances.resize(skeletonInstances.size()+20);
+	float * instance = &skeletonInstances[skeletonInstances.size()-20];
+	multiplyMatrices(worldMatrix, meshMatrix, instance);
+	vec3 endVertex;
+	transformPoint(worldMatrix, pBone->x+pBone->endX, pBone->y+pBone->endY, pBone->z+pBone->endZ, &endVertex);
+	instance[16] = endVertex.x;
+	instance[17] = endVertex.y;
+	instance[18] = endVertex.z;
+	instance[19] = (pBone == selectedBone) ? 1.0f : 0.0f;
+
+	for (unsigned i = 0; i < pBone->child.size(); i++) addSkeletonInstances(pBone->child[i], worldMatrix);
+}
 
-			tempBone->id = freeBoneIds.front();
-			freeBoneIds.erase(freeBoneIds.begin());
-			newIds.push_back(tempBone->id);
+//Rebuilds skeletonInstances, and bumps skeletonVersion so the render thread re-uploads them, only when the pose, the
+//bones themselves or the selection have changed
+void updateSkeletonInstances() {
+	PROFILE_SCOPE("updateSkeletonInstances");
+	if (root == NULL) {
+		if (!skeletonInstances.empty()) skeletonVersion++;
+		skeletonInstances.clear();
+		skeletonSnapshot.clear();
+		return;
+	}
 
-			boneList.insert(boneList.begin()+tempBone->id, tempBone);
+	unsigned snapshotSize = (boneList.size()*10)+2;
+	bool changed = (skeletonSnapshot.size() != snapshotSize);
+	skeletonSnapshot.resize(snapshotSize);
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		bone * pBone = boneList[i];
+		float boneState[10] = {(float)pBone->id, pBone->x, pBone->y, pBone->z, pBone->endX, pBone->endY, pBone->endZ,
+			pBone->xRot, pBone->yRot, pBone->zRot};
+		for (short j = 0; j < 10; j++) {
+			if (skeletonSnapshot[(i*10)+j] != boneState[j]) {
+				skeletonSnapshot[(i*10)+j] = boneState[j];
+				changed = true;
+			}
+		}
+	}
+	float extraState[2] = {boneScale, (selectedBone == NULL) ? -1.0f : (float)selectedBone->id};
+	for (short i = 0; i < 2; i++) {
+		if (skeletonSnapshot[(boneList.size()*10)+i] != extraState[i]) {
+			skeletonSnapshot[(boneList.size()*10)+i] = extraState[i];
+			changed = true;
+		}
+	}
+
+	if (changed) {
+		skeletonInstances.clear();
+		addSkeletonInstances(root, NULL);
+		skeletonVersion++;
+	}
+}
+
+//Draws every bone with one instanced call
+void drawSkeleton(frameSnapshot * snapshot) {
+	if (snapshot->skeletonInstanceCount == 0) return;
+	if ((gint)snapshot->skeletonVersion != g_atomic_int_get(&uploadedSkeletonVersion)) {
+		if (snapshot->skeletonInstances.empty()) return;
+		glBindBuffer(GL_TEXTURE_BUFFER, skeletonInstanceBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(GLfloat)*snapshot->skeletonInstances.size(),
+				&(snapshot->skeletonInstances[0]), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		g_atomic_int_set(&uploadedSkeletonVersion, snapshot->skeletonVersion);
+	}
+
+	boneShader->use();
+	boneShader->setUniform16(MODELVIEW_LOCATION, getMatrix(MODELVIEW_MATRIX));
+	boneShader->setUniform16(PROJECTION_LOCATION, getMatrix(PROJECTION_MATRIX));
+	boneShader->setUniform1(EXTRA0_LOCATION, 1);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_BUFFER, skeletonInstanceTexture);
+	glBindVertexArray(skeletonVao);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, boneModel->vertexCount(), snapshot->skeletonInstanceCount);
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void initBlendLayers() {
+	for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++) {
+		blendLayers[i].enabled = (i == 0);
+		blendLayers[i].additive = false;
+		blendLayers[i].synced = true;
+		blendLayers[i].animationId = 0;
+		blendLayers[i].frame = 1.0f;
+		blendLayers[i].speed = 1.0f;
+		blendLayers[i].weight = (i == 0) ? 1.0f : 0.0f;
+		blendLayers[i].fadeStep = 0.0f;
+		blendLayers[i].maskBoneId = -1;
+		blendLayers[i].maskDirty = true;
+	}
+}
+
+void buildBlendMask(bone * pBone, vector<float> * mask) {
+	if (pBone->id < (int)mask->size()) (*mask)[pBone->id] = 1.0f;
+	for (unsigned i = 0; i < pBone->child.size(); i++) buildBlendMask(pBone->child[i], mask);
+}
+
+//The pose buffers and masks are only reallocated when the skeleton changes, so evaluating the blend is allocation free
+void prepareBlendBuffers() {
+	if (blendPose.size() != boneList.size()) {
+		blendPose.resize(boneList.size());
+		blendLayerPose.resize(boneList.size());
+		for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++) blendLayers[i].maskDirty = true;
+	}
+
+	for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++) {
+		if (!blendLayers[i].maskDirty) continue;
+		blendLayers[i].mask.assign(boneList.size(), (blendLayers[i].maskBoneId < 0) ? 1.0f : 0.0f);
+		if (blendLayers[i].maskBoneId >= 0) {
+			for (unsigned j = 0; j < boneList.size(); j++) {
+				if (boneList[j]->id == blendLayers[i].maskBoneId) {
+					buildBlendMask(boneList[j], &(blendLayers[i].mask));
+					break;
+				}
+			}
+		}
+		blendLayers[i].maskDirty = false;
+	}
+}
+
+float blendLayerFrame(blendLayer * layer) {
+	if (!layer->synced) return layer->frame;
+	//Synced layers play at the same normalised time as the timeline so that cycles of different lengths line up
+	float progress = float(currentFrame-1)/float(max(animations[currentAnimation].length, 2u)-1);
+	return 1.0f+(progress*(max(animations[layer->animationId].length, 1u)-1));
+}
+
+void advanceBlendLayers() {
+	for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++) {
+		blendLayer * layer = &blendLayers[i];
+		if (layer->animationId >= animations.size()) continue;
+
+		if (playAnimation && !layer->synced) {
+			layer->frame += layer->speed;
+			float length = max(animations[layer->animationId].length, 1u); //an empty .sma would never wrap
+			while (layer->frame > length) layer->frame -= length;
+			while (layer->frame < 1.0f) layer->frame += length;
+		}
+
+		if (layer->fadeStep != 0.0f) {
+			layer->weight += layer->fadeStep;
+			if ((layer->weight >= 1.0f) || (layer->weight <= 0.0f)) {
+				layer->weight = (layer->weight >= 1.0f) ? 1.0f : 0.0f;
+				layer->fadeStep = 0.0f;
+			}
+			g_signal_handler_block(blendWeightSpinButton[i], blendWeightSpinHandler[i]);
+			gtk_spin_button_set_value(GTK_SPIN_BUTTON(blendWeightSpinButton[i]), layer->weight);
+			g_signal_handler_unblock(blendWeightSpinButton[i], blendWeightSpinHandler[i]);
+		}
+	}
+}
+
+void evaluateBlendTree() {
+	if (root == NULL) return;
+	prepareBlendBuffers();
+	updateTrackCurves();
+
+	for (unsigned i = 0; i < blendPose.size(); i++) blendPose[i].x = blendPose[i].y = blendPose[i].z = 0.0f;
+
+	for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++) {
+		blendLayer * layer = &blendLayers[i];
+		if (!layer->enabled || (layer->weight <= 0.0f) || (layer->animationId >= animations.size())
+				|| (layer->animationId >= animationColumnCache.size())) continue;
+
+		float frame = blendLayerFrame(layer);
+		for (unsigned j = 0; j < boneList.size(); j++) {
+			int id = boneList[j]->id;
+			float weight = layer->weight*layer->mask[id];
+			if (weight <= 0.0f) continue;
+
+			bone::animation * pAnimation = &(boneList[j]->animations[layer->animationId]);
+			sampleAnimationColumns(&animationColumnCache[layer->animationId], j, frame, &blendLayerPose[id]);
+			if (layer->additive) {
+				//Additive layers are applied relative to the first keyframe of their animation
+				if (pAnimation->frames.size() == 0) continue;
+				blendPose[id].x += weight*rotationDifference(pAnimation->frames.front().xRot, blendLayerPose[id].x);
+				blendPose[id].y += weight*rotationDifference(pAnimation->frames.front().yRot, blendLayerPose[id].y);
+				blendPose[id].z += weight*rotationDifference(pAnimation->frames.front().zRot, blendLayerPose[id].z);
+			} else {
+				blendPose[id].x += weight*rotationDifference(blendPose[id].x, blendLayerPose[id].x);
+				blendPose[id].y += weight*rotationDifference(blendPose[id].y, blendLayerPose[id].y);
+				blendPose[id].z += weight*rotationDifference(blendPose[id].z, blendLayerPose[id].z);
+			}
+		}
+	}
+
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		boneList[i]->xRot = blendPose[boneList[i]->id].x;
+		boneList[i]->yRot = blendPose[boneList[i]->id].y;
+		boneList[i]->zRot = blendPose[boneList[i]->id].z;
+	}
+}
+
+void initBone(bone * pBone, bone * parent = NULL) {
+	static int id = 0;
+	int idToUse;
+	if (freeBoneIds.size() > 0) {
+		idToUse = freeBoneIds.front();
+		freeBoneIds.erase(freeBoneIds.begin());
+	} else {
+		idToUse = id;
+		id++;
+	}
+
+	stringstream stream(stringstream::in | stringstream::out);
+	stream.setf(ios::fixed, ios::floatfield);
+	stream << idToUse;
+
+	*pBone = (bone){idToUse, "bone"+stream.str(), 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, parent};
+	pBone->rotationUpperLimit.x = pBone->rotationUpperLimit.y = pBone->rotationUpperLimit.z = 180.0f;
+	pBone->rotationLowerLimit.x = pBone->rotationLowerLimit.y = pBone->rotationLowerLimit.z = -180.0f;
+	boneList.push_back(pBone);
+}
+
+void deleteBone(bone * pBone) {
+	PROFILE_SCOPE("deleteBone");
+	resetUndoHistory();
+	timelineRows.clear();
+	for (unsigned i = 0; i < pBone->child.size(); i++) deleteBone(pBone->child[i]);
+
+	if (pBone->parent != NULL) {
+		for (unsigned i = 0; i < pBone->parent->child.size(); i++) {
+			if (pBone->parent->child[i] == pBone) {
+				pBone->parent->child.erase(pBone->parent->child.begin()+i);
+				break;
+			}
+		}
+	}
+
+	bool boneFound = false, parentFound;
+	if (pBone->parent == NULL) parentFound = true; else parentFound = false;
+	for (unsigned i = 0; i < boneIteratorAssociations.size(); i++) {
+		if ((boneIteratorAssociations[i].pBone == pBone) && !boneFound) {
+			gtk_tree_store_remove(boneStore, &(boneIteratorAssociations[i].iterator));
+			boneIteratorAssociations.erase(boneIteratorAssociations.begin()+i);
+			boneFound = true;
+		} else if ((boneIteratorAssociations[i].pBone == pBone->parent) && !parentFound) {
+			gtk_tree_selection_select_iter(boneSelect, &(boneIteratorAssociations[i].iterator));
+			parentFound = true;
+		}
+		if (boneFound && parentFound) break;
+	}
+
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		if (boneList[i] == pBone) {
+			boneList.erase(boneList.begin()+i);
+			break;
+		}
+	}
+
+	unsigned i = 0;
+	for (; i < freeBoneIds.size(); i++) {
+		if (pBone->id < freeBoneIds[i]) break;
+	}
+	freeBoneIds.insert(freeBoneIds.begin()+i, pBone->id);
+
+	vector<GLfloat> oldIds;
+	vector<GLfloat> newIds;
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		if (boneList[i]->id >= (int)boneList.size()) {
+			oldIds.push_back(boneList[i]->id);
+
+			bone * tempBone = boneList[i];
+			boneList.erase(boneList.begin()+i);
+
+			tempBone->id = freeBoneIds.front();
+			freeBoneIds.erase(freeBoneIds.begin());
+			newIds.push_back(tempBone->id);
+
+			boneList.insert(boneList.begin()+tempBone->id, tempBone);
 		}
 	}
 
 	if (loadedModel != NULL) {
+		lockGlContext();
 		glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
 		for (unsigned i = 0; i < loadedModel->triangles()->size(); i++) {
 			for (short j = 0; j < 3; j++) {
@@ -1121,13 +3286,17 @@ void deleteBone(bone * pBone) {
 			}
 		}
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		unlockGlContext();
+		pickSkinningDirty = lodSkinDirty = clusterSkinDirty = true;
 	}
 
 	if (pBone == root) {
 		gtk_entry_set_text(GTK_ENTRY(boneNameEntry), "");
 		root = NULL;
 	}
-	delete pBone;
+	boneCurves.erase(pBone);
+	curvesDirty = true;
+	freeBone(pBone);
 }
 
 void renameBone() {
@@ -1152,12 +3321,107 @@ void renameBone() {
 	}
 }
 
+void addTimelineBones(bone * pBone, vector<bone *> * bones) {
+	if (bones->size() >= TIMELINE_MAX_ROWS) return;
+	bones->push_back(pBone);
+	for (unsigned i = 0; i < pBone->child.size(); i++) addTimelineBones(pBone->child[i], bones);
+}
+
+//Brings the timeline rows up to date for pBone and its descendants. Only rows whose bone, name or key count changed
+//have their steps rebuilt, so the common case of a rotation drag moving existing keys costs a comparison per row
 void setAnimationMarks(bone * pBone) {
-	if ((mode != ANIMATION_MODE) || pBone == NULL) return;
-	gtk_scale_clear_marks(GTK_SCALE(timeline));
-	for (unsigned i = 0; i < pBone->animations[currentAnimation].frames.size(); i++)
-		gtk_scale_add_mark(GTK_SCALE(timeline), pBone->animations[currentAnimation].frames[i].step, GTK_POS_BOTTOM,
-				NULL);
+	PROFILE_SCOPE("setAnimationMarks");
+	if (mode != ANIMATION_MODE) return;
+	vector<bone *> bones;
+	if (pBone != NULL) addTimelineBones(pBone, &bones);
+	if (timelineAnimation != currentAnimation) {
+		timelineRows.clear();
+		timelineAnimation = currentAnimation;
+	}
+
+	bool changed = (timelineRows.size() != bones.size());
+	timelineRows.resize(bones.size());
+	for (unsigned i = 0; i < bones.size(); i++) {
+		timelineRow * row = &timelineRows[i];
+		vector<bone::keyFrame> * frames = &(bones[i]->animations[currentAnimation].frames);
+		if ((row->pBone == bones[i]) && (row->sourceSize == frames->size()) && (row->name == bones[i]->name)) continue;
+		row->pBone = bones[i];
+		row->name = bones[i]->name;
+		row->sourceSize = frames->size();
+		row->steps.resize(frames->size());
+		for (unsigned j = 0; j < frames->size(); j++) row->steps[j] = (*frames)[j].step;
+		sort(row->steps.begin(), row->steps.end());
+		changed = true;
+	}
+	if (changed) gtk_widget_queue_draw(timeline);
+}
+
+//For edits that can replace keys without changing how many there are, such as undo, or that change which animation
+//an index refers to
+void invalidateAnimationMarks() {
+	timelineRows.clear();
+	setAnimationMarks(selectedBone);
+}
+
+//The first frame shown and how many, always at least one so that an empty animation loaded from an .sma still has a
+//frame to draw and click on
+void timelineView(unsigned * first, unsigned * visible) {
+	unsigned length = max(animations[currentAnimation].length, 1u);
+	*visible = ((timelineVisibleFrames == 0) || (timelineVisibleFrames > length)) ? length : timelineVisibleFrames;
+	*first = max(1u, min(timelineFirstFrame, length-*visible+1));
+}
+
+//Only the visible frames are drawn, and at most one key mark per pixel column, so the cost depends on the widget's
+//width rather than the length of the animation
+gboolean drawTimeline(GtkWidget * widget, cairo_t * cr, gpointer) {
+	PROFILE_SCOPE("drawTimeline");
+	int width = gtk_widget_get_allocated_width(widget), height = gtk_widget_get_allocated_height(widget);
+	unsigned first, visible;
+	timelineView(&first, &visible);
+	unsigned last = first+visible-1;
+	float frameWidth = float(max(width-TIMELINE_NAME_WIDTH, 1))/visible;
+
+	cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
+	cairo_paint(cr);
+
+	cairo_set_source_rgb(cr, 0.5, 0.5, 0.5);
+	cairo_set_line_width(cr, 1.0);
+	unsigned tickInterval = max(1u, (unsigned)ceil(TIMELINE_TICK_SPACING/frameWidth));
+	for (unsigned frame = ((first+tickInterval-1)/tickInterval)*tickInterval; frame <= last; frame += tickInterval) {
+		float x = TIMELINE_NAME_WIDTH+((frame-first+0.5f)*frameWidth);
+		cairo_move_to(cr, x, TIMELINE_RULER_HEIGHT-((frame%(tickInterval*5) == 0) ? 8 : 4));
+		cairo_line_to(cr, x, TIMELINE_RULER_HEIGHT);
+	}
+	cairo_stroke(cr);
+
+	float rowHeight = float(height-TIMELINE_RULER_HEIGHT)/max((unsigned)timelineRows.size(), 1u);
+	for (unsigned i = 0; i < timelineRows.size(); i++) {
+		timelineRow * row = &timelineRows[i];
+		float top = TIMELINE_RULER_HEIGHT+(i*rowHeight);
+		if (i == 0) cairo_set_source_rgb(cr, 1.0, 1.0, 1.0); else cairo_set_source_rgb(cr, 0.7, 0.7, 0.7);
+		cairo_move_to(cr, 4.0, top+(rowHeight/2.0f)+4.0f);
+		cairo_show_text(cr, row->name.c_str());
+
+		if (i == 0) cairo_set_source_rgb(cr, 1.0, 0.8, 0.2); else cairo_set_source_rgb(cr, 0.8, 0.6, 0.2);
+		int lastColumn = -1;
+		for (vector<unsigned>::iterator j = lower_bound(row->steps.begin(), row->steps.end(), first);
+				(j != row->steps.end()) && (*j <= last); j++) {
+			int column = TIMELINE_NAME_WIDTH+int((*j-first+0.5f)*frameWidth);
+			if (column == lastColumn) continue;
+			cairo_rectangle(cr, column-2, top+(rowHeight*0.25f), 4, rowHeight*0.5f);
+			lastColumn = column;
+		}
+		cairo_fill(cr);
+	}
+
+	if ((currentFrame >= first) && (currentFrame <= last)) {
+		float x = TIMELINE_NAME_WIDTH+((currentFrame-first+0.5f)*frameWidth);
+		cairo_set_source_rgb(cr, 1.0, 0.2, 0.2);
+		cairo_move_to(cr, x, 0.0);
+		cairo_line_to(cr, x, height);
+		cairo_stroke(cr);
+	}
+	return true;
 }
 
 void selectBone(GtkTreeSelection * selection) {
@@ -1200,144 +3464,128 @@ void updateBoneCoords(bone * startBone) {
 	for (unsigned i = 0; i < startBone->child.size(); i++) updateBoneCoords(startBone->child[i]);
 }
 
-void updateRotations(bone * startBone, unsigned frame, bool setBoneRotation = false) {
-	if (setBoneRotation) setBoneRotations(frame);
+float * boneRotation(bone * pBone, short axis) {
+	return (axis == X_AXIS) ? &(pBone->xRot) : ((axis == Y_AXIS) ? &(pBone->yRot) : &(pBone->zRot));
+}
 
-	int frameIndex = startBone->animations[currentAnimation].frameIndex(frame);
+float rotationLimit(vec3 * limit, short axis) {
+	return (axis == X_AXIS) ? limit->x : ((axis == Y_AXIS) ? limit->y : limit->z);
+}
 
-	if ((startBone->rotationUpperLimit.x == 180.0f) && (startBone->rotationLowerLimit.x == -180.0f)) {
-		if (startBone->xRot > 180.0f) startBone->xRot -= 360.0f;
-			else if (startBone->xRot < -180.0f) startBone->xRot += 360.0f;
+//Wraps the rotation if the axis is unlimited, otherwise clamps it to the bone's limits and returns how far over it was
+float clampRotation(bone * pBone, short axis, float * rotation) {
+	float upperLimit = rotationLimit(&(pBone->rotationUpperLimit), axis),
+		lowerLimit = rotationLimit(&(pBone->rotationLowerLimit), axis), overflow = 0.0f;
+	if ((upperLimit == 180.0f) && (lowerLimit == -180.0f)) {
+		if (*rotation > 180.0f) *rotation -= 360.0f;
+			else if (*rotation < -180.0f) *rotation += 360.0f;
 	}
-	if (startBone->xRot > startBone->rotationUpperLimit.x) {
-		if (startBone->parent != NULL) {
-			startBone->parent->xRot += startBone->xRot-startBone->rotationUpperLimit.x;
-
-			if (autoKeyEnabled || (frame != currentFrame)) {
-				int frameIndex = startBone->parent->animations[currentAnimation].frameIndex(frame);
-				if (frameIndex == -1) {
-					bone::keyFrame tempFrame = (bone::keyFrame){
-						startBone->parent->xRot, startBone->parent->yRot, startBone->parent->zRot, frame};
-					startBone->parent->animations[currentAnimation].frames.push_back(tempFrame);
-				} else {
-					startBone->parent->animations[currentAnimation].frames[frameIndex].xRot = startBone->parent->xRot;
-				}
-			}
-		}
-		startBone->xRot = startBone->rotationUpperLimit.x;
-		if (autoKeyEnabled || (frame != currentFrame))
-			startBone->animations[currentAnimation].frames[frameIndex].xRot = startBone->xRot;
-
-	} else if (startBone->xRot < startBone->rotationLowerLimit.x) {
-		if (startBone->parent != NULL) {
-			startBone->parent->xRot += startBone->xRot-startBone->rotationLowerLimit.x;
-
-			if (autoKeyEnabled || (frame != currentFrame)) {
-				int frameIndex = startBone->parent->animations[currentAnimation].frameIndex(frame);
-				if (frameIndex == -1) {
-					bone::keyFrame tempFrame = (bone::keyFrame){
-						startBone->parent->xRot, startBone->parent->yRot, startBone->parent->zRot, frame};
-					startBone->parent->animations[currentAnimation].frames.push_back(tempFrame);
-				} else {
-					startBone->parent->animations[currentAnimation].frames[frameIndex].xRot = startBone->parent->xRot;
-				}
-			}
-		}
-		startBone->xRot = startBone->rotationLowerLimit.x;
-		if (autoKeyEnabled || (frame != currentFrame))
-			startBone->animations[currentAnimation].frames[frameIndex].xRot = startBone->xRot;
+	if (*rotation > upperLimit) {
+		overflow = *rotation-upperLimit;
+		*rotation = upperLimit;
+	} else if (*rotation < lowerLimit) {
+		overflow = *rotation-lowerLimit;
+		*rotation = lowerLimit;
 	}
+	return overflow;
+}
 
+void updateRotations(bone * startBone, unsigned frame, bool setBoneRotation = false) {
+	PROFILE_SCOPE("updateRotations");
+	if (setBoneRotation) setBoneRotations(frame);
 
-	if ((startBone->rotationUpperLimit.y == 180.0f) && (startBone->rotationLowerLimit.y == -180.0f)) {
-		if (startBone->yRot > 180.0f) startBone->yRot -= 360.0f;
-			else if (startBone->yRot < -180.0f) startBone->yRot += 360.0f;
-	}
-	if (startBone->yRot > startBone->rotationUpperLimit.y) {
-		if (startBone->parent != NULL) {
-			startBone->parent->yRot += startBone->yRot-startBone->rotationUpperLimit.y;
+	int frameIndex = startBone->animations[currentAnimation].frameIndex(frame);
+	bool keyFrames = autoKeyEnabled || (frame != currentFrame);
 
-			if (autoKeyEnabled || (frame != currentFrame)) {
-				int frameIndex = startBone->parent->animations[currentAnimation].frameIndex(frame);
-				if (frameIndex == -1) {
-					bone::keyFrame tempFrame = (bone::keyFrame){
-						startBone->parent->xRot, startBone->parent->yRot, startBone->parent->zRot, frame};
-					startBone->parent->animations[currentAnimation].frames.push_back(tempFrame);
-				} else {
-					startBone->parent->animations[currentAnimation].frames[frameIndex].yRot = startBone->parent->yRot;
-				}
-			}
-		}
-		startBone->yRot = startBone->rotationUpperLimit.y;
-		if (autoKeyEnabled || (frame != currentFrame))
-			startBone->animations[currentAnimation].frames[frameIndex].yRot = startBone->yRot;
+	for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+		float overflow = clampRotation(startBone, axis, boneRotation(startBone, axis));
+		if (overflow == 0.0f) continue;
 
-	} else if (startBone->yRot < startBone->rotationLowerLimit.y) {
 		if (startBone->parent != NULL) {
-			startBone->parent->yRot += startBone->yRot-startBone->rotationLowerLimit.y;
+			*boneRotation(startBone->parent, axis) += overflow;
 
-			if (autoKeyEnabled || (frame != currentFrame)) {
-				int frameIndex = startBone->parent->animations[currentAnimation].frameIndex(frame);
-				if (frameIndex == -1) {
+			if (keyFrames) {
+				int parentFrameIndex = startBone->parent->animations[currentAnimation].frameIndex(frame);
+				if (parentFrameIndex == -1) {
 					bone::keyFrame tempFrame = (bone::keyFrame){
 						startBone->parent->xRot, startBone->parent->yRot, startBone->parent->zRot, frame};
 					startBone->parent->animations[currentAnimation].frames.push_back(tempFrame);
 				} else {
-					startBone->parent->animations[currentAnimation].frames[frameIndex].yRot = startBone->parent->yRot;
+					bone::keyFrame * parentFrame =
+							&(startBone->parent->animations[currentAnimation].frames[parentFrameIndex]);
+					*keyFrameRotation(parentFrame, axis) = *boneRotation(startBone->parent, axis);
 				}
 			}
 		}
-		startBone->yRot = startBone->rotationLowerLimit.y;
-		if (autoKeyEnabled || (frame != currentFrame))
-			startBone->animations[currentAnimation].frames[frameIndex].yRot = startBone->yRot;
+		if (keyFrames && (frameIndex != -1))
+			*keyFrameRotation(&(startBone->animations[currentAnimation].frames[frameIndex]), axis) =
+					*boneRotation(startBone, axis);
 	}
+	if (startBone->parent != NULL) updateRotations(startBone->parent, frame);
+	tracksChanged();
 
+	if (setBoneRotation) setBoneRotations(currentFrame);
+}
 
-	if ((startBone->rotationUpperLimit.z == 180.0f) && (startBone->rotationLowerLimit.z == -180.0f)) {
-		if (startBone->zRot > 180.0f) startBone->zRot -= 360.0f;
-			else if (startBone->zRot < -180.0f) startBone->zRot += 360.0f;
-	}
-	if (startBone->zRot > startBone->rotationUpperLimit.z) {
-		if (startBone->parent != NULL) {
-			startBone->parent->zRot += startBone->zRot-startBone->rotationUpperLimit.z;
+//Clamps every keyframe of pBone, in every animation, to its rotation limits. Overflow is pushed into the ancestors'
+//tracks at the same steps, with each ancestor's track rebuilt in a single merge per animation rather than per key
+void clampBoneKeyframes(bone * pBone) {
+	vector<keyAdjustment> adjustments, parentAdjustments;
+	vector<bone::keyFrame> mergedFrames;
 
-			if (autoKeyEnabled || (frame != currentFrame)) {
-				int frameIndex = startBone->parent->animations[currentAnimation].frameIndex(frame);
-				if (frameIndex == -1) {
-					bone::keyFrame tempFrame = (bone::keyFrame){
-						startBone->parent->xRot, startBone->parent->yRot, startBone->parent->zRot, frame};
-					startBone->parent->animations[currentAnimation].frames.push_back(tempFrame);
-				} else {
-					startBone->parent->animations[currentAnimation].frames[frameIndex].zRot = startBone->parent->zRot;
-				}
+	for (unsigned i = 0; i < pBone->animations.size(); i++) {
+		adjustments.clear();
+		for (unsigned j = 0; j < pBone->animations[i].frames.size(); j++) {
+			keyAdjustment adjustment;
+			adjustment.step = pBone->animations[i].frames[j].step;
+			bool overflowed = false;
+			for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+				adjustment.overflow[axis] = clampRotation(pBone, axis,
+						keyFrameRotation(&(pBone->animations[i].frames[j]), axis));
+				if (adjustment.overflow[axis] != 0.0f) overflowed = true;
 			}
+			if (overflowed) adjustments.push_back(adjustment);
 		}
-		startBone->zRot = startBone->rotationUpperLimit.z;
-		if (autoKeyEnabled || (frame != currentFrame))
-			startBone->animations[currentAnimation].frames[frameIndex].zRot = startBone->zRot;
 
-	} else if (startBone->zRot < startBone->rotationLowerLimit.z) {
-		if (startBone->parent != NULL) {
-			startBone->parent->zRot += startBone->zRot-startBone->rotationLowerLimit.z;
-
-			if (autoKeyEnabled || (frame != currentFrame)) {
-				int frameIndex = startBone->parent->animations[currentAnimation].frameIndex(frame);
-				if (frameIndex == -1) {
-					bone::keyFrame tempFrame = (bone::keyFrame){
-						startBone->parent->xRot, startBone->parent->yRot, startBone->parent->zRot, frame};
-					startBone->parent->animations[currentAnimation].frames.push_back(tempFrame);
-				} else {
-					startBone->parent->animations[currentAnimation].frames[frameIndex].zRot = startBone->parent->zRot;
+		for (bone * pParent = pBone->parent; (pParent != NULL) && (adjustments.size() > 0); pParent = pParent->parent) {
+			if (i >= pParent->animations.size()) break;
+			vector<bone::keyFrame> * frames = &(pParent->animations[i].frames);
+
+			parentAdjustments.clear();
+			mergedFrames.clear();
+			mergedFrames.reserve(frames->size()+adjustments.size());
+			unsigned k = 0;
+			for (unsigned j = 0; j < adjustments.size(); j++) {
+				while ((k < frames->size()) && ((*frames)[k].step < adjustments[j].step)) {
+					mergedFrames.push_back((*frames)[k]);
+					k++;
+				}
+				if ((k < frames->size()) && ((*frames)[k].step == adjustments[j].step)) k++;
+
+				//Sampled from the parent's original track, which is only replaced once every step is merged
+				vec3 rotation;
+				sampleAnimation(&(pParent->animations[i]), adjustments[j].step, &rotation, findTrackCurve(pParent, i));
+				bone::keyFrame newFrame = (bone::keyFrame){rotation.x+adjustments[j].overflow[X_AXIS],
+					rotation.y+adjustments[j].overflow[Y_AXIS], rotation.z+adjustments[j].overflow[Z_AXIS],
+					adjustments[j].step};
+
+				keyAdjustment adjustment;
+				adjustment.step = newFrame.step;
+				bool overflowed = false;
+				for (short axis = X_AXIS; axis <= Z_AXIS; axis++) {
+					adjustment.overflow[axis] = clampRotation(pParent, axis, keyFrameRotation(&newFrame, axis));
+					if (adjustment.overflow[axis] != 0.0f) overflowed = true;
 				}
+				if (overflowed) parentAdjustments.push_back(adjustment);
+				mergedFrames.push_back(newFrame);
 			}
+			for (; k < frames->size(); k++) mergedFrames.push_back((*frames)[k]);
+
+			frames->swap(mergedFrames);
+			adjustments.swap(parentAdjustments);
 		}
-		startBone->zRot = startBone->rotationLowerLimit.z;
-		if (autoKeyEnabled || (frame != currentFrame))
-			startBone->animations[currentAnimation].frames[frameIndex].zRot = startBone->zRot;
 	}
-	if (startBone->parent != NULL) updateRotations(startBone->parent, frame);
-
-	if (setBoneRotation) setBoneRotations(currentFrame);
+	tracksChanged();
 }
 
 void updateBoneRotationLimits() {
@@ -1357,8 +3605,8 @@ void updateBoneRotationLimits() {
 	selectedBone->rotationLowerLimit.z =
 			gtk_spin_button_get_value(GTK_SPIN_BUTTON(boneRotationLimitSpinButton[Z_AXIS][LOWER_LIMIT]));
 
-	for (unsigned i = 0; i < selectedBone->animations[currentAnimation].frames.size(); i++)
-		updateRotations(selectedBone, selectedBone->animations[currentAnimation].frames[i].step, true);
+	clampBoneKeyframes(selectedBone);
+	if ((mode == ANIMATION_MODE) && (root != NULL)) setBoneRotations(currentFrame);
 }
 
 void verifyBoneAnimationCounts(bone * pBone) {
@@ -1374,9 +3622,11 @@ void verifyBoneAnimationCounts(bone * pBone) {
 
 	while (pBone->animations.size() > animations.size()) pBone->animations.pop_back();
 	for (unsigned i = 0; i < pBone->child.size(); i++) verifyBoneAnimationCounts(pBone->child[i]);
+	tracksChanged();
 }
 
 void sortBoneAnimationFrames(bone * pBone = NULL) {
+	PROFILE_SCOPE("sortBoneAnimationFrames");
 	if (pBone == NULL) pBone = root;
 	for (unsigned i = 0; i < pBone->animations.size(); i++) {
 		bone::animation tempAnimation;
@@ -1394,9 +3644,11 @@ void sortBoneAnimationFrames(bone * pBone = NULL) {
 		pBone->animations[i] = tempAnimation;
 	}
 	for (unsigned i = 0; i < pBone->child.size(); i++) sortBoneAnimationFrames(pBone->child[i]);
+	tracksChanged();
 }
 
 void setKeyframe(bone * pBone = NULL) {
+	PROFILE_SCOPE("setKeyframe");
 	if (pBone == NULL) pBone = root;
 
 	int frameIndex = pBone->animations[currentAnimation].frameIndex(currentFrame);
@@ -1425,6 +3677,7 @@ void deleteKeyframe(bone * pBone, unsigned frame) {
 	int frameIndex = pBone->animations[currentAnimation].frameIndex(frame);
 	if (frameIndex != -1) pBone->animations[currentAnimation].frames.erase(
 			pBone->animations[currentAnimation].frames.begin()+frameIndex);
+	tracksChanged();
 }
 
 void setKeyframeCallback() {
@@ -1434,6 +3687,17 @@ void setKeyframeCallback() {
 	setAnimationMarks(selectedBone);
 }
 
+//The mouse position as if the view it's over filled the window, which is how the views in the quad view are drawn
+int viewMouseX() {
+	if (!quadViewEnabled) return mouseX();
+	return (mouseX()-((activeQuadView%2)*(int)(screenWidth()/2)))*2;
+}
+
+int viewMouseY() {
+	if (!quadViewEnabled) return mouseY();
+	return (mouseY()-((activeQuadView/2)*(int)(screenHeight()/2)))*2;
+}
+
 vec2 mouseMovedAmount() {
 	if (mouseX() < MOUSE_MIDDLE_BORDER) {
 		setMousePosition(screenWidth()-MOUSE_MIDDLE_BORDER, mouseY());
@@ -1452,10 +3716,19 @@ vec2 mouseMovedAmount() {
 	return (vec2){{mouseX()-lastMousePosition.x}, {mouseY()-lastMousePosition.y}};
 }
 
-void drawArrow(float x, float y, float z, axisEnum axis) {
+//The amount moved within a quad view, which is half the size of the screen, for panning and dragging to keep up with
+//the mouse. Orbiting uses mouseMovedAmount so it turns at the same rate whatever the layout
+vec2 viewMouseMovedAmount() {
+	vec2 amount = mouseMovedAmount();
+	float scale = quadViewEnabled ? 2.0f : 1.0f;
+	return (vec2){{amount.x*scale}, {amount.y*scale}};
+}
+
+void drawArrow(float x, float y, float z, axisEnum axis, frameSnapshot * snapshot) {
+	viewOrientationEnum viewOrientation = snapshot->viewOrientation;
 	disableDepthTesting();
 	pushMatrix();
-		float length = (DEFAULT_ZOOM/zoom)*10.0f;
+		float length = (DEFAULT_ZOOM/snapshot->zoom)*10.0f;
 		translateMatrix(x, y, z);
 		rotateMatrix(180.0f, 0.0f, 1.0f, 0.0f);
 		vec4 color;
@@ -1492,7 +3765,8 @@ void drawArrow(float x, float y, float z, axisEnum axis) {
 	enableDepthTesting();
 }
 
-void drawBox(vec2 startPosition) {
+void drawBox(frameSnapshot * snapshot) {
+	vec2 startPosition = snapshot->boxStartPosition;
 	disableDepthTesting();
 	pushMatrix();
 		boxShader->use();
@@ -1500,7 +3774,7 @@ void drawBox(vec2 startPosition) {
 		boxShader->setUniform16(PROJECTION_LOCATION, getMatrix(PROJECTION_MATRIX));
 		boxShader->setUniform4(TEXSAMPLER_LOCATION, 1.0f, 1.0f, 1.0f, 1.0f);
 		boxShader->setUniform2(EXTRA0_LOCATION, startPosition.x, screenHeight()-startPosition.y);
-		boxShader->setUniform2(EXTRA1_LOCATION, (float)mouseX(), (float)mouseY());
+		boxShader->setUniform2(EXTRA1_LOCATION, snapshot->mousePosition.x, snapshot->mousePosition.y);
 
 		glBindVertexArray(boxVao);
 		glDrawArrays(GL_LINE_LOOP, 0, 4);
@@ -1509,10 +3783,10 @@ void drawBox(vec2 startPosition) {
 	enableDepthTesting();
 }
 
-void drawRing(float x, float y, float z, axisEnum axis) {
+void drawRing(float x, float y, float z, axisEnum axis, frameSnapshot * snapshot) {
 	disableDepthTesting();
 	pushMatrix();
-		float scale = (DEFAULT_ZOOM/zoom)*10.0f;
+		float scale = (DEFAULT_ZOOM/snapshot->zoom)*10.0f;
 		translateMatrix(x, y, z);
 		rotateMatrix(180.0f, 0.0f, 1.0f, 0.0f);
 		vec4 color;
@@ -1546,7 +3820,7 @@ void drawRing(float x, float y, float z, axisEnum axis) {
 void handleControlPressed(bool * showArrow, bool * showArrowParent, axisEnum * arrowAxis) {
 	static float timeSinceShortcutPressed = SHORTCUT_PRESS_DELAY;
 
-	if (timeSinceShortcutPressed < SHORTCUT_PRESS_DELAY) timeSinceShortcutPressed += compensation(); else {
+	if (timeSinceShortcutPressed < SHORTCUT_PRESS_DELAY) timeSinceShortcutPressed += frameCompensation(); else {
 		if (keyPressed('o')) {
 			flagExecuteOpenFile();
 			timeSinceShortcutPressed = 0.0f;
@@ -1578,11 +3852,9 @@ void handleControlPressed(bool * showArrow, bool * showArrowParent, axisEnum * a
 			timeSinceShortcutPressed = 0.0f;
 
 		} else if (keyPressed(UP_KEYCODE)) {
-			scaleMatrix(1.1, 1.1, 1.1);
 			zoom *= 1.1;
 			timeSinceShortcutPressed = SHORTCUT_PRESS_DELAY/2.0f;
 		} else if (keyPressed(DOWN_KEYCODE)) {
-			scaleMatrix(0.9, 0.9, 0.9);
 			zoom *= 0.9;
 			timeSinceShortcutPressed = SHORTCUT_PRESS_DELAY/2.0f;
 		} else if (keyPressed(RIGHT_KEYCODE)) {
@@ -1591,6 +3863,12 @@ void handleControlPressed(bool * showArrow, bool * showArrowParent, axisEnum * a
 		} else if (keyPressed(LEFT_KEYCODE)) {
 			setBoneScale(boneScale-0.1f);
 			timeSinceShortcutPressed = 0.0f;
+		} else if (keyPressed('z') && !keyPressed(SHIFT_KEYCODE) && !keyPressed(ALT_KEYCODE)) {
+			undoEdit();
+			timeSinceShortcutPressed = 0.0f;
+		} else if (keyPressed('y')) {
+			redoEdit();
+			timeSinceShortcutPressed = 0.0f;
 
 		} else if (mode == SKELETON_MODE) {
 			if (keyPressed('b')) {
@@ -1603,7 +3881,7 @@ void handleControlPressed(bool * showArrow, bool * showArrowParent, axisEnum * a
 				timeSinceShortcutPressed = 0.0f;
 
 			} else if (keyPressed(SHIFT_KEYCODE)) {
-				float amountMoved = -(float(mouseMovedAmount().y)/3.0f)*compensation();
+				float amountMoved = -(float(viewMouseMovedAmount().y)/3.0f)*frameCompensation();
 				if (keyPressed('z')) {
 					selectedBone->endZ += amountMoved;
 					updateBoneCoords(selectedBone);
@@ -1625,7 +3903,7 @@ void handleControlPressed(bool * showArrow, bool * showArrowParent, axisEnum * a
 				}
 
 			} else if (keyPressed(ALT_KEYCODE)) {
-				float amountMoved = -(float(mouseMovedAmount().y)/3.0f)*compensation();
+				float amountMoved = -(float(viewMouseMovedAmount().y)/3.0f)*frameCompensation();
 				if (keyPressed('z')) {
 					if (selectedBone == root) {
 						selectedBone->z += amountMoved;
@@ -1672,9 +3950,10 @@ void handleControlPressed(bool * showArrow, bool * showArrowParent, axisEnum * a
 }
 
 void handleAltPressed(bool * showRing, axisEnum * ringAxis) {
+	PROFILE_SCOPE("handleAltPressed");
 	if (playAnimation) return;
 
-	float amountMoved = -(float(mouseMovedAmount().y)/3.0f)*compensation();
+	float amountMoved = -(float(viewMouseMovedAmount().y)/3.0f)*frameCompensation();
 	if (keyPressed('z')) {
 		*showRing = true;
 		*ringAxis = Z_AXIS;
@@ -1744,36 +4023,187 @@ void handleAltPressed(bool * showRing, axisEnum * ringAxis) {
 	}
 }
 
+//Sets up the modelview matrix the scene is drawn with on the matrix stack, which only the render thread uses
+void applyViewTransform(frameSnapshot * snapshot) {
+	copyMatrix(IDENTITY_MATRIX, MODELVIEW_MATRIX);
+	translateMatrix(snapshot->viewWidth/2.0f, snapshot->viewHeight/2.0f, -500.0f);
+	scaleMatrix(snapshot->zoom, -snapshot->zoom, snapshot->zoom);
+	translateMatrix(snapshot->viewTranslation.x, snapshot->viewTranslation.y, 0.0f);
+	rotateMatrix(snapshot->xRotation, 1.0f, 0.0f, 0.0f);
+	rotateMatrix(snapshot->yRotation, 0.0f, 1.0f, 0.0f);
+}
+
+//The modelview and projection matrices the scene is drawn with, for use with gluProject and gluUnProject. Built the
+//same way as applyViewTransform but without the matrix stack, so it can be used on the main thread
+void getViewMatrices(double * mvMat, double * pMat) {
+	float viewMatrix[16], scaleTranslation[16], rotationMatrix[16];
+	for (short i = 0; i < 16; i++) scaleTranslation[i] = 0.0f;
+	scaleTranslation[0] = zoom;
+	scaleTranslation[5] = -zoom;
+	scaleTranslation[10] = zoom;
+	scaleTranslation[12] = (screenWidth()/2.0f)+(zoom*viewTranslation.x);
+	scaleTranslation[13] = (screenHeight()/2.0f)-(zoom*viewTranslation.y);
+	scaleTranslation[14] = -500.0f;
+	scaleTranslation[15] = 1.0f;
+	vec3 rotation = (vec3){{xRotation}, {yRotation}, {0.0f}};
+	eulerMatrix(&rotation, rotationMatrix);
+	multiplyMatrices(scaleTranslation, rotationMatrix, viewMatrix);
+
+	for (short i = 0; i < 16; i++) {
+		mvMat[i] = viewMatrix[i];
+		pMat[i] = orthographicMatrix[i];
+	}
+}
+
+//Keys the bone's current rotation at the frame, inserting in order so the track doesn't need re-sorting
+void setBoneKey(bone * pBone, unsigned frame) {
+	vector<bone::keyFrame> * frames = &(pBone->animations[currentAnimation].frames);
+	unsigned i = 0;
+	while ((i < frames->size()) && ((*frames)[i].step < frame)) i++;
+	if ((i < frames->size()) && ((*frames)[i].step == frame)) {
+		(*frames)[i].xRot = pBone->xRot;
+		(*frames)[i].yRot = pBone->yRot;
+		(*frames)[i].zRot = pBone->zRot;
+	} else frames->insert(frames->begin()+i, (bone::keyFrame){pBone->xRot, pBone->yRot, pBone->zRot, frame});
+	tracksChanged();
+}
+
+//Cyclic coordinate descent: each bone in the chain, working up from the effector, is turned to point the end of
+//effectorBone at the target, with the result clamped to the bone's rotation limits. Returns the chain length used
+unsigned solveIk(bone * effectorBone, vec3 * target, bone ** chain) {
+	unsigned chainLength = 0;
+	for (bone * pBone = effectorBone; (pBone != NULL) && (chainLength < ikChainLength); pBone = pBone->parent) {
+		chain[chainLength] = pBone;
+		chainLength++;
+	}
+
+	float baseMatrix[16], worldMatrices[MAX_IK_CHAIN_LENGTH][16];
+	bone * chainTop = chain[chainLength-1];
+	if (chainTop->parent == NULL) {
+		for (short i = 0; i < 16; i++) baseMatrix[i] = ((i%5) == 0) ? 1.0f : 0.0f;
+	} else boneWorldMatrix(chainTop->parent, baseMatrix);
+
+	gint64 startTime = g_get_monotonic_time();
+	for (unsigned iteration = 0; iteration < IK_MAX_ITERATIONS; iteration++) {
+		for (int i = chainLength-1; i >= 0; i--) {
+			float localMatrix[16];
+			vec3 rotation = (vec3){{chain[i]->xRot}, {chain[i]->yRot}, {chain[i]->zRot}};
+			boneLocalMatrix(chain[i], &rotation, localMatrix);
+			multiplyMatrices(((unsigned)i == chainLength-1) ? baseMatrix : worldMatrices[i+1], localMatrix,
+					worldMatrices[i]);
+		}
+
+		vec3 effector;
+		transformPoint(worldMatrices[0], effectorBone->x+effectorBone->endX, effectorBone->y+effectorBone->endY,
+				effectorBone->z+effectorBone->endZ, &effector);
+		float distance = sqrt(pow(target->x-effector.x, 2)+pow(target->y-effector.y, 2)+pow(target->z-effector.z, 2));
+		if ((distance < IK_TOLERANCE) || (g_get_monotonic_time()-startTime > IK_TIME_BUDGET)) break;
+
+		for (unsigned i = 0; i < chainLength; i++) {
+			bone * pBone = chain[i];
+			float * parentMatrix = (i == chainLength-1) ? baseMatrix : worldMatrices[i+1];
+			vec3 pivot;
+			transformPoint(parentMatrix, pBone->x, pBone->y, pBone->z, &pivot);
+
+			vec3 toEffector = (vec3){{effector.x-pivot.x}, {effector.y-pivot.y}, {effector.z-pivot.z}},
+				toTarget = (vec3){{target->x-pivot.x}, {target->y-pivot.y}, {target->z-pivot.z}};
+			float effectorLength =
+				sqrt((toEffector.x*toEffector.x)+(toEffector.y*toEffector.y)+(toEffector.z*toEffector.z)),
+				targetLength = sqrt((toTarget.x*toTarget.x)+(toTarget.y*toTarget.y)+(toTarget.z*toTarget.z));
+			if ((effectorLength < 0.0001f) || (targetLength < 0.0001f)) continue;
+
+			vec3 axis = (vec3){{(toEffector.y*toTarget.z)-(toEffector.z*toTarget.y)},
+				{(toEffector.z*toTarget.x)-(toEffector.x*toTarget.z)},
+				{(toEffector.x*toTarget.y)-(toEffector.y*toTarget.x)}};
+			float sinAngle = sqrt((axis.x*axis.x)+(axis.y*axis.y)+(axis.z*axis.z))/(effectorLength*targetLength),
+				cosAngle = ((toEffector.x*toTarget.x)+(toEffector.y*toTarget.y)+(toEffector.z*toTarget.z))
+					/(effectorLength*targetLength),
+				angle = atan2(sinAngle, cosAngle);
+			if (angle < 0.0001f) continue;
+			float axisLength = sinAngle*effectorLength*targetLength;
+			axis.x /= axisLength;
+			axis.y /= axisLength;
+			axis.z /= axisLength;
+
+			//The world space turn about the pivot, moved into the bone's local space: R' = Wp^-1*D*Wp*R
+			float turnMatrix[16], inverseParentMatrix[16], localMatrix[16], tempMatrix[16], tempMatrix2[16],
+				newLocalMatrix[16];
+			vec3 rotation = (vec3){{pBone->xRot}, {pBone->yRot}, {pBone->zRot}};
+			axisAngleMatrix(&axis, angle, turnMatrix);
+			boneLocalMatrix(pBone, &rotation, localMatrix);
+			rigidInverse(parentMatrix, inverseParentMatrix);
+			multiplyMatrices(turnMatrix, parentMatrix, tempMatrix);
+			multiplyMatrices(inverseParentMatrix, tempMatrix, tempMatrix2);
+			multiplyMatrices(tempMatrix2, localMatrix, newLocalMatrix);
+
+			eulerFromMatrix(newLocalMatrix, &rotation);
+			for (short axisIndex = X_AXIS; axisIndex <= Z_AXIS; axisIndex++) {
+				float * rotationAxis =
+					(axisIndex == X_AXIS) ? &rotation.x : ((axisIndex == Y_AXIS) ? &rotation.y : &rotation.z);
+				clampRotation(pBone, axisIndex, rotationAxis);
+			}
+			pBone->xRot = rotation.x;
+			pBone->yRot = rotation.y;
+			pBone->zRot = rotation.z;
+
+			//Move the effector by however much the bone actually turned once clamped
+			float inverseWorldMatrix[16];
+			rigidInverse(worldMatrices[i], inverseWorldMatrix);
+			boneLocalMatrix(pBone, &rotation, localMatrix);
+			multiplyMatrices(parentMatrix, localMatrix, worldMatrices[i]);
+			vec3 localEffector;
+			transformPoint(inverseWorldMatrix, effector.x, effector.y, effector.z, &localEffector);
+			transformPoint(worldMatrices[i], localEffector.x, localEffector.y, localEffector.z, &effector);
+		}
+	}
+	return chainLength;
+}
+
+void handleIkDrag(bool * showTarget, vec3 * target) {
+	PROFILE_SCOPE("handleIkDrag");
+	if (playAnimation || (selectedBone == NULL)) return;
+
+	double x, y, z, effectorX, effectorY, effectorZ, mvMat[16], pMat[16];
+	int viewport[4] = {0, 0, (int)screenWidth(), (int)screenHeight()};
+	getViewMatrices(mvMat, pMat);
+
+	//Drag the effector in the plane parallel to the screen that it currently sits in
+	float effectorMatrix[16];
+	vec3 effector;
+	boneWorldMatrix(selectedBone, effectorMatrix);
+	transformPoint(effectorMatrix, selectedBone->x+selectedBone->endX, selectedBone->y+selectedBone->endY,
+			selectedBone->z+selectedBone->endZ, &effector);
+	gluProject(effector.x, effector.y, effector.z, mvMat, pMat, viewport, &effectorX, &effectorY, &effectorZ);
+	gluUnProject(viewMouseX(), screenHeight()-viewMouseY(), effectorZ, mvMat, pMat, viewport, &x, &y, &z);
+	*target = (vec3){{(float)x}, {(float)y}, {(float)z}};
+	*showTarget = true;
+
+	bone * chain[MAX_IK_CHAIN_LENGTH];
+	unsigned chainLength = solveIk(selectedBone, target, chain);
+	if (autoKeyEnabled) {
+		for (unsigned i = 0; i < chainLength; i++) setBoneKey(chain[i], currentFrame);
+		setAnimationMarks(selectedBone);
+	}
+}
+
 void handleBoneCreation() {
 	static float timeSinceBoneCreated = BONE_CREATE_DELAY;
 	if (timeSinceBoneCreated < BONE_CREATE_DELAY) {
-		timeSinceBoneCreated += compensation();
+		timeSinceBoneCreated += frameCompensation();
 		return;
 	}
 
-	if (mouseLeft() && boneCreationEnabled) {
+	if (mouseLeft() && boneCreationEnabled && ((viewOrientation != FREE) || creatingBone)) {
 		if (!creatingBone) {
 			creatingBone = true;
 			if ((root == NULL) || (selectedBone == NULL)) {
-				root = new bone;
+				root = allocateBone();
 				initBone(root);
 				root->name = "root";
 				double x, y, z, mvMat[16], pMat[16];
 				int viewport[4] = {0, 0, screenWidth(), screenHeight()};
-				setMatrix(MODELVIEW_MATRIX);
-				pushMatrix();
-					copyMatrix(IDENTITY_MATRIX, MODELVIEW_MATRIX);
-					translateMatrix(screenWidth()/2.0f, screenHeight()/2.0f, -500.0f);
-					scaleMatrix(zoom, -zoom, zoom);
-					translateMatrix(viewTranslation.x, viewTranslation.y, 0.0f);
-					rotateMatrix(xRotation, 1.0f, 0.0f, 0.0f);
-					rotateMatrix(yRotation, 0.0f, 1.0f, 0.0f);
-					for (int i = 0; i < 16; i++) {
-						mvMat[i] = getMatrix(MODELVIEW_MATRIX)[i];
-						pMat[i] = getMatrix(PROJECTION_MATRIX)[i];
-					}
-					gluUnProject(mouseX(), screenHeight()-mouseY(), 0, mvMat, pMat, viewport, &x, &y, &z);
-				popMatrix();
+				getViewMatrices(mvMat, pMat);
+				gluUnProject(viewMouseX(), screenHeight()-viewMouseY(), 0, mvMat, pMat, viewport, &x, &y, &z);
 				switch (viewOrientation) {
 				case TOP:
 				case BOTTOM:
@@ -1801,7 +4231,7 @@ void handleBoneCreation() {
 				gtk_tree_store_append(boneStore, &(boneIteratorAssociations.back().iterator), NULL);
 			} else {
 				bone * parentBone = selectedBone;
-				selectedBone = new bone;
+				selectedBone = allocateBone();
 				parentBone->child.push_back(selectedBone);
 				initBone(selectedBone, parentBone);
 				selectedBone->x = parentBone->x+parentBone->endX;
@@ -1839,20 +4269,8 @@ void handleBoneCompletion() {
 	if (creatingBone) {
 		double x, y, z, mvMat[16], pMat[16];
 		int viewport[4] = {0, 0, screenWidth(), screenHeight()};
-		setMatrix(MODELVIEW_MATRIX);
-		pushMatrix();
-			copyMatrix(IDENTITY_MATRIX, MODELVIEW_MATRIX);
-			translateMatrix(screenWidth()/2.0f, screenHeight()/2.0f, -500.0f);
-			scaleMatrix(zoom, -zoom, zoom);
-			translateMatrix(viewTranslation.x, viewTranslation.y, 0.0f);
-			rotateMatrix(xRotation, 1.0f, 0.0f, 0.0f);
-			rotateMatrix(yRotation, 0.0f, 1.0f, 0.0f);
-			for (int i = 0; i < 16; i++) {
-				mvMat[i] = getMatrix(MODELVIEW_MATRIX)[i];
-				pMat[i] = getMatrix(PROJECTION_MATRIX)[i];
-			}
-			gluUnProject(mouseX(), screenHeight()-mouseY(), 0, mvMat, pMat, viewport, &x, &y, &z);
-		popMatrix();
+		getViewMatrices(mvMat, pMat);
+		gluUnProject(viewMouseX(), screenHeight()-viewMouseY(), 0, mvMat, pMat, viewport, &x, &y, &z);
 		switch (viewOrientation) {
 		case TOP:
 		case BOTTOM:
@@ -1885,44 +4303,204 @@ void handleBoneCompletion() {
 	}
 }
 
-void selectVertices(vec2 boxStartPosition) {
-	if ((loadedModel == NULL) || (selectedBone == NULL)) return;
+bool trackHeadsMatchBones() {
+	if ((trackHeads.size() != boneList.size()) || (rootMotionHeads.size() != animations.size())) return false;
+	for (unsigned i = 0; i < boneList.size(); i++)
+		if (trackHeads[i].size() != boneList[i]->animations.size()) return false;
+	return true;
+}
 
-	double mvMat[16], pMat[16];
-	setMatrix(MODELVIEW_MATRIX);
-	pushMatrix();
-		copyMatrix(IDENTITY_MATRIX, MODELVIEW_MATRIX);
-		translateMatrix(screenWidth()/2.0f, screenHeight()/2.0f, -500.0f);
-		scaleMatrix(zoom, -zoom, zoom);
-		translateMatrix(viewTranslation.x, viewTranslation.y, 0.0f);
-		rotateMatrix(xRotation, 1.0f, 0.0f, 0.0f);
-		rotateMatrix(yRotation, 0.0f, 1.0f, 0.0f);
-		for (short i = 0; i < 16; i++) {
-			mvMat[i] = getMatrix(MODELVIEW_MATRIX)[i];
-			pMat[i] = getMatrix(PROJECTION_MATRIX)[i];
-		}
-	popMatrix();
+bool sameKeyFrames(vector<bone::keyFrame> * a, vector<bone::keyFrame> * b) {
+	if (a->size() != b->size()) return false;
+	for (unsigned i = 0; i < a->size(); i++) {
+		if (((*a)[i].step != (*b)[i].step) || ((*a)[i].xRot != (*b)[i].xRot) || ((*a)[i].yRot != (*b)[i].yRot)
+				|| ((*a)[i].zRot != (*b)[i].zRot)) return false;
+	}
+	return true;
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
-	for (unsigned i = 0; i < loadedModel->triangles()->size(); i++) {
-		for (short j = 0; j < 3; j++) {
-			double x, y, z;
-			int viewport[4] = {0, 0, screenWidth(), screenHeight()};
+//Makes the edits since the last step into a new one. Only tracks that differ from their head are copied, and only
+//the skin pages touched through setSkinId, so unchanged data stays shared with the earlier steps
+void commitUndoStep() {
+	PROFILE_SCOPE("commitUndoStep");
+	undoStepPending = false;
+	if (!trackHeadsMatchBones()) {
+		//Bones or animations were added or removed, which can't be undone, so start again from here. Skinning edits
+		//refer to vertices rather than bones, so any still pending become the first step of the new history
+		resetTrackHistory();
+		trackHeads.resize(boneList.size());
+		for (unsigned i = 0; i < boneList.size(); i++) {
+			for (unsigned j = 0; j < boneList[i]->animations.size(); j++)
+				trackHeads[i].push_back(newTrackVersion(&(boneList[i]->animations[j].frames)));
+		}
+		rootMotionHeads.resize(animations.size());
+		for (unsigned i = 0; i < animations.size(); i++) rootMotionHeads[i] = animations[i].rootMotion;
+	}
+
+	undoStep step;
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		for (unsigned j = 0; j < boneList[i]->animations.size(); j++) {
+			vector<bone::keyFrame> * frames = &(boneList[i]->animations[j].frames);
+			if (sameKeyFrames(&(trackHeads[i][j]->frames), frames)) continue;
+			//The head's reference passes to the step as its before version
+			trackVersion * after = newTrackVersion(frames);
+			after->references++;
+			step.tracks.push_back((trackChange){i, j, trackHeads[i][j], after});
+			trackHeads[i][j] = after;
+		}
+	}
+	for (map<unsigned, skinPage *>::iterator i = openSkinChanges.begin(); i != openSkinChanges.end(); i++) {
+		skinPageHeads[i->first]->references++;
+		step.skin.push_back((skinChange){i->first, i->second, skinPageHeads[i->first]});
+	}
+	openSkinChanges.clear();
+	for (unsigned i = 0; i < animations.size(); i++) {
+		if (animations[i].rootMotion == rootMotionHeads[i]) continue;
+		step.rootMotion.push_back((rootMotionChange){i, rootMotionHeads[i], animations[i].rootMotion});
+		rootMotionHeads[i] = animations[i].rootMotion;
+	}
+	if (step.tracks.empty() && step.skin.empty() && step.rootMotion.empty()) return;
+
+	while (undoHistory.size() > undoPosition) {
+		releaseUndoStep(&undoHistory.back());
+		undoHistory.pop_back();
+	}
+	undoHistory.push_back(step);
+	if (undoHistory.size() > UNDO_HISTORY_LIMIT) {
+		releaseUndoStep(&undoHistory.front());
+		undoHistory.pop_front();
+	}
+	undoPosition = undoHistory.size();
+}
+
+//Sets a vertex's bone id in the model VBO, which must be bound with the GL context held, copying its skin page first
+//if the history still shares it
+void setSkinId(unsigned vertex, GLfloat id) {
+	unsigned pageCount = (loadedModel->vertexCount()+SKIN_PAGE_VERTICES-1)/SKIN_PAGE_VERTICES;
+	if ((skinPageModel != loadedModel) || (skinPageHeads.size() != pageCount)) {
+		resetSkinPages();
+		skinPageHeads.assign(pageCount, NULL);
+		skinPageModel = loadedModel;
+	}
+
+	unsigned page = vertex/SKIN_PAGE_VERTICES, first = page*SKIN_PAGE_VERTICES;
+	if (skinPageHeads[page] == NULL) {
+		//First edit since the model was loaded, so the page is read back from the VBO
+		unsigned count = min((unsigned)SKIN_PAGE_VERTICES, loadedModel->vertexCount()-first);
+		vector<GLfloat> block(count*24);
+		glGetBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*first*24, sizeof(GLfloat)*count*24, &block[0]);
+		skinPageHeads[page] = new skinPage;
+		skinPageHeads[page]->references = 1;
+		skinPageHeads[page]->ids.resize(count);
+		for (unsigned i = 0; i < count; i++) skinPageHeads[page]->ids[i] = block[(i*24)+23];
+	}
+	if (openSkinChanges.find(page) == openSkinChanges.end()) {
+		skinPage * copy = new skinPage(*(skinPageHeads[page]));
+		copy->references = 1;
+		openSkinChanges[page] = skinPageHeads[page];
+		skinPageHeads[page] = copy;
+	}
+
+	skinPageHeads[page]->ids[vertex-first] = id;
+	glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*((vertex*24)+23), sizeof(GLfloat), &id);
+	undoStepPending = true;
+}
+
+void applyUndoStep(undoStep * step, bool backwards) {
+	PROFILE_SCOPE("applyUndoStep");
+	for (unsigned i = 0; i < step->tracks.size(); i++) {
+		trackChange * change = &(step->tracks[i]);
+		trackVersion * version = backwards ? change->before : change->after;
+		boneList[change->boneId]->animations[change->animationId].frames = version->frames;
+		releaseTrackVersion(trackHeads[change->boneId][change->animationId]);
+		version->references++;
+		trackHeads[change->boneId][change->animationId] = version;
+	}
+	for (unsigned i = 0; i < step->rootMotion.size(); i++) {
+		rootMotionChange * change = &(step->rootMotion[i]);
+		animations[change->animationId].rootMotion = backwards ? change->before : change->after;
+		rootMotionHeads[change->animationId] = animations[change->animationId].rootMotion;
+	}
+
+	if (!step->skin.empty()) {
+		lockGlContext();
+		glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
+		for (unsigned i = 0; i < step->skin.size(); i++) {
+			skinChange * change = &(step->skin[i]);
+			skinPage * version = backwards ? change->before : change->after, * current = skinPageHeads[change->page];
+			unsigned first = change->page*SKIN_PAGE_VERTICES;
+			for (unsigned j = 0; j < version->ids.size(); j++) {
+				if (version->ids[j] != current->ids[j])
+					glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*(((first+j)*24)+23), sizeof(GLfloat),
+							&(version->ids[j]));
+			}
+			releaseSkinPage(current);
+			version->references++;
+			skinPageHeads[change->page] = version;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		unlockGlContext();
+		pickSkinningDirty = lodSkinDirty = clusterSkinDirty = true;
+	}
+
+	curvesDirty = true;
+	if ((mode == ANIMATION_MODE) && (root != NULL)) setBoneRotations(currentFrame);
+	invalidateAnimationMarks();
+	redrawNeeded = true;
+}
+
+void undoEdit() {
+	if (undoStepPending) commitUndoStep();
+	if (undoPosition == 0) return;
+	undoPosition--;
+	applyUndoStep(&undoHistory[undoPosition], true);
+}
+
+void redoEdit() {
+	if (undoStepPending) commitUndoStep();
+	if (undoPosition >= undoHistory.size()) return;
+	applyUndoStep(&undoHistory[undoPosition], false);
+	undoPosition++;
+}
+
+void selectVertices(vec2 boxStartPosition) {
+	PROFILE_SCOPE("selectVertices");
+	if ((loadedModel == NULL) || (selectedBone == NULL)) return;
+
+	double mvMat[16], pMat[16];
+	getViewMatrices(mvMat, pMat);
+	if (clusterModel != loadedModel) buildMeshClusters();
+	float boxRect[4];
+	selectionRect(boxStartPosition, boxRect);
+
+	//Only clusters whose rest bounds reach the box can have vertices in it
+	lockGlContext();
+	glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
+	for (unsigned c = 0; c < meshClusters.size(); c++) {
+		int viewport[4] = {0, 0, screenWidth(), screenHeight()};
+		float rect[4], nearest;
+		projectBounds(meshClusters[c].bounds, mvMat, pMat, viewport, rect, &nearest);
+		if (!rectsOverlap(rect, boxRect)) continue;
+
+		for (unsigned k = meshClusters[c].firstIndex; k < meshClusters[c].firstIndex+meshClusters[c].indexCount; k++) {
+			unsigned i = clusterIndices[k]/3;
+			short j = clusterIndices[k]%3;
+			double x, y, z;
 
 			int loX, hiX, loY, hiY;
-			if (boxStartPosition.x > mouseX()) {
-				loX = mouseX();
+			if (boxStartPosition.x > viewMouseX()) {
+				loX = viewMouseX();
 				hiX = boxStartPosition.x;
 			} else {
 				loX = boxStartPosition.x;
-				hiX = mouseX();
+				hiX = viewMouseX();
 			}
-			if (screenHeight()-boxStartPosition.y > mouseY()) {
-				hiY = screenHeight()-mouseY();
+			if (screenHeight()-boxStartPosition.y > viewMouseY()) {
+				hiY = screenHeight()-viewMouseY();
 				loY = boxStartPosition.y;
 			} else {
 				hiY = boxStartPosition.y;
-				loY = screenHeight()-mouseY();
+				loY = screenHeight()-viewMouseY();
 			}
 
 			gluProject((*(loadedModel->triangles()))[i].coords[j].x, (*(loadedModel->triangles()))[i].coords[j].y,
@@ -1930,8 +4508,7 @@ void selectVertices(vec2 boxStartPosition) {
 
 			if ((x <= hiX) && (x >= loX) && (y <= hiY) && (y >= loY)) {
 				if (keyPressed(SHIFT_KEYCODE)) {
-					GLfloat data = -1.0f;
-					glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*((i*24*3)+(j*24)+23), sizeof(GLfloat), &data);
+					setSkinId((i*3)+j, -1.0f);
 					/*for (unsigned k = 0; k < selectedBone->vertices.size(); k++) {
 						if (selectedBone->vertices[k] == &((*(loadedModel->triangles()))[i].coords[j])) {
 							selectedBone->vertices.erase(selectedBone->vertices.begin()+k);
@@ -1939,16 +4516,14 @@ void selectVertices(vec2 boxStartPosition) {
 						}
 					}*/
 				} else {
-					GLfloat data = selectedBone->id;
-					glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*((i*24*3)+(j*24)+23), sizeof(GLfloat), &data);
+					setSkinId((i*3)+j, selectedBone->id);
 					//selectedBone->vertices.push_back(&((*(loadedModel->triangles()))[i].coords[j]));
 				}
 			} else {
-				if ((mouseX() <= x+3.0f) && (mouseX() >= x-3.0f) && ((screenHeight()-mouseY()) <= y+3.0f)
-						&& ((screenHeight()-mouseY()) >= y-3.0f)) {
+				if ((viewMouseX() <= x+3.0f) && (viewMouseX() >= x-3.0f) && ((screenHeight()-viewMouseY()) <= y+3.0f)
+						&& ((screenHeight()-viewMouseY()) >= y-3.0f)) {
 					if (keyPressed(SHIFT_KEYCODE)) {
-						GLfloat data = -1.0f;
-						glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*((i*24*3)+(j*24)+23), sizeof(GLfloat), &data);
+						setSkinId((i*3)+j, -1.0f);
 						/*for (unsigned k = 0; k < selectedBone->vertices.size(); k++) {
 							if (selectedBone->vertices[k] == &((*(loadedModel->triangles()))[i].coords[j])) {
 								selectedBone->vertices.erase(selectedBone->vertices.begin()+k);
@@ -1956,8 +4531,7 @@ void selectVertices(vec2 boxStartPosition) {
 							}
 						}*/
 					} else {
-						GLfloat data = selectedBone->id;
-						glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*((i*24*3)+(j*24)+23), sizeof(GLfloat), &data);
+						setSkinId((i*3)+j, selectedBone->id);
 						//selectedBone->vertices.push_back(&((*(loadedModel->triangles()))[i].coords[j]));
 					}
 				}
@@ -1965,6 +4539,8 @@ void selectVertices(vec2 boxStartPosition) {
 		}
 	}
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	unlockGlContext();
+	pickSkinningDirty = lodSkinDirty = clusterSkinDirty = true;
 }
 
 void handleSkinning(bool * showBox, vec2 * returnBoxStartPosition) {
@@ -1973,8 +4549,8 @@ void handleSkinning(bool * showBox, vec2 * returnBoxStartPosition) {
 
 	if (mouseLeft()) {
 		if (!selecting) {
-			boxStartPosition.x = mouseX();
-			boxStartPosition.y = screenHeight()-mouseY();
+			boxStartPosition.x = viewMouseX();
+			boxStartPosition.y = screenHeight()-viewMouseY();
 			selecting = true;
 		}
 	} else {
@@ -1988,36 +4564,1561 @@ void handleSkinning(bool * showBox, vec2 * returnBoxStartPosition) {
 	*returnBoxStartPosition = boxStartPosition;
 }
 
-void applyBoneTransforms(bone * startBone) {
-	if (startBone->parent != NULL) applyBoneTransforms(startBone->parent);
+void applyBoneTransforms(vector<boneTransform> * chain) {
+	for (unsigned i = 0; i < chain->size(); i++) {
+		boneTransform * transform = &(*chain)[i];
+		translateMatrix(transform->x, transform->y, transform->z);
+		rotateMatrix(transform->xRot, 1.0f, 0.0f, 0.0f);
+		rotateMatrix(transform->yRot, 0.0f, 1.0f, 0.0f);
+		rotateMatrix(transform->zRot, 0.0f, 0.0f, 1.0f);
+		translateMatrix(-transform->x, -transform->y, -transform->z);
+	}
+}
+
+void sendBoneModelviewMatrixUniform(frameSnapshot * snapshot) {
+	unsigned boneCount = snapshot->bonePalette.size()/16;
+	if (boneCount == 0) return;
+	vector<float> matrices(boneCount*16);
+	for (unsigned i = 0; i < boneCount; i++)
+		multiplyMatrices(getMatrix(MODELVIEW_MATRIX), &(snapshot->bonePalette[i*16]), &matrices[i*16]);
+	animationShader->use();
+	animationShader->setUniform16(EXTRA0_LOCATION, &matrices[0], boneCount);
+}
 
-	translateMatrix(startBone->x, startBone->y, startBone->z);
-	rotateMatrix(startBone->xRot, 1.0f, 0.0f, 0.0f);
-	rotateMatrix(startBone->yRot, 0.0f, 1.0f, 0.0f);
-	rotateMatrix(startBone->zRot, 0.0f, 0.0f, 1.0f);
-	translateMatrix(-startBone->x, -startBone->y, -startBone->z);
+void addCrowdBones(bone * pBone) {
+	crowdBoneOrder.push_back(pBone);
+	for (unsigned i = 0; i < pBone->child.size(); i++) addCrowdBones(pBone->child[i]);
 }
 
-void getBoneModelviewMatrices(mat4 * matrixArray, bone * pBone = NULL) {
-	if (pBone == NULL) pBone = root;
+unsigned maxCrowdSize() {
+	return min((unsigned)maxTextureBufferTexels/(4*((unsigned)boneList.size()+1)), (unsigned)MAX_CROWD_SIZE);
+}
+
+void prepareCrowd() {
+	//The count alone isn't enough: a bone deleted and another added leaves it the same, and the new bone may even be
+	//given the deleted one's memory
+	if (skeletonStructureChanged(&crowdBones, &crowdBoneParents)) {
+		//Parents come before their children, so each bone's parent matrix is ready by the time it is needed
+		crowdBoneOrder.clear();
+		addCrowdBones(root);
+		crowdBoneColumns.clear();
+	}
+
+	if (crowdSpacingModel != loadedModel) {
+		crowdSpacingModel = loadedModel;
+		float minX = 0.0f, maxX = 0.0f, minZ = 0.0f, maxZ = 0.0f;
+		for (unsigned i = 0; i < loadedModel->triangles()->size(); i++) {
+			for (short j = 0; j < 3; j++) {
+				minX = min(minX, (*(loadedModel->triangles()))[i].coords[j].x);
+				maxX = max(maxX, (*(loadedModel->triangles()))[i].coords[j].x);
+				minZ = min(minZ, (*(loadedModel->triangles()))[i].coords[j].z);
+				maxZ = max(maxZ, (*(loadedModel->triangles()))[i].coords[j].z);
+			}
+		}
+		crowdSpacing = max(max(maxX-minX, maxZ-minZ)*1.5f, 1.0f);
+	}
+
+	if (crowdSize > maxCrowdSize()) {
+		//The spin button's handler reads the clamped size straight back
+		crowdSize = maxCrowdSize();
+		gtk_spin_button_set_value(GTK_SPIN_BUTTON(crowdSizeSpinButton), crowdSize);
+	}
+	unsigned paletteSize = crowdSize*(boneList.size()+1)*16;
+	if (crowdPalette.size() != paletteSize) crowdPalette.resize(paletteSize);
+}
+
+//Call after updateTrackCurves. The columns are matched to crowdBoneOrder again whenever either has been rebuilt
+void updateCrowdBoneColumns() {
+	static unsigned matchedColumnsVersion = 0;
+	if (!crowdBoneColumns.empty() && (matchedColumnsVersion == animationColumnsVersion)) return;
+	map<bone *, unsigned> boneIndices;
+	for (unsigned i = 0; i < animationColumnBones.size(); i++) boneIndices[animationColumnBones[i]] = i;
+	crowdBoneColumns.resize(crowdBoneOrder.size());
+	for (unsigned i = 0; i < crowdBoneOrder.size(); i++) crowdBoneColumns[i] = boneIndices[crowdBoneOrder[i]];
+	matchedColumnsVersion = animationColumnsVersion;
+}
+
+void evaluateCrowdInstances(unsigned begin, unsigned end, void *) {
+	unsigned stride = (boneList.size()+1)*16, gridWidth = ceil(sqrt(float(crowdSize)));
+	for (unsigned i = begin; i < end; i++) {
+		float * palette = &crowdPalette[i*stride];
+		for (short j = 0; j < 16; j++) palette[j] = ((j%5) == 0) ? 1.0f : 0.0f;
+		palette[12] = (float(i%gridWidth)-((gridWidth-1)/2.0f))*crowdSpacing;
+		palette[14] = (float(i/gridWidth)-((gridWidth-1)/2.0f))*crowdSpacing;
+
+		unsigned animationId = crowdVaryAnimations ? i%animations.size() : currentAnimation;
+		float length = animations[animationId].length;
+		//An empty animation loaded from an .sma holds its first frame rather than spreading NaNs through the palette
+		float frame = (length > 0.0f) ? 1.0f+fmod(crowdTime+(i*CROWD_FRAME_STAGGER), length) : 1.0f;
+
+		for (unsigned j = 0; j < crowdBoneOrder.size(); j++) {
+			bone * pBone = crowdBoneOrder[j];
+			vec3 rotation;
+			float localMatrix[16];
+			sampleAnimationColumns(&animationColumnCache[animationId], crowdBoneColumns[j], frame, &rotation);
+			boneLocalMatrix(pBone, &rotation, localMatrix);
+			float * parentMatrix = (pBone->parent == NULL) ? palette : &palette[(pBone->parent->id+1)*16];
+			multiplyMatrices(parentMatrix, localMatrix, &palette[(pBone->id+1)*16]);
+		}
+	}
+}
+
+//The CPU half of the crowd preview, run on the main thread. The palette it leaves in crowdPalette is handed to the
+//render thread with the frame snapshot, and the upload and draw times come back from drawCrowd
+void evaluateCrowd() {
+	PROFILE_SCOPE("evaluateCrowd");
+	prepareCrowd();
+	crowdTime += 1.0f;
+
+	gint64 startTime = g_get_monotonic_time();
+	updateTrackCurves();
+	updateCrowdBoneColumns();
+	parallelFor(crowdSize, 8, evaluateCrowdInstances, NULL);
+	gint64 evaluateEndTime = g_get_monotonic_time();
+
+	gint drawMicroseconds = g_atomic_int_get(&crowdDrawMicroseconds);
+	crowdEvaluateTime = (crowdEvaluateTime*0.9f)+(((evaluateEndTime-startTime)/1000.0f)*0.1f);
+	crowdUploadTime = (crowdUploadTime*0.9f)+((g_atomic_int_get(&crowdUploadMicroseconds)/1000.0f)*0.1f);
+	if (drawMicroseconds >= 0) crowdDrawTime = (crowdDrawTime*0.9f)+((drawMicroseconds/1000.0f)*0.1f);
+
+	crowdFramesSinceReport++;
+	if (crowdFramesSinceReport >= CROWD_TIMING_REPORT_INTERVAL) {
+		stringstream stream(stringstream::in | stringstream::out);
+		stream.setf(ios::fixed, ios::floatfield);
+		stream.precision(2);
+		stream << crowdSize << " instances\nEvaluate: " << crowdEvaluateTime << " ms\nUpload: " << crowdUploadTime
+				<< " ms\nDraw: " << crowdDrawTime << " ms";
+		gtk_label_set_text(GTK_LABEL(crowdTimingLabel), stream.str().c_str());
+		crowdFramesSinceReport = 0;
+	}
+}
+
+void drawCrowd(frameSnapshot * snapshot) {
+	if (snapshot->crowdSize == 0) return;
+	if ((crowdVao == 0) || (crowdVaoVbo != *modelVbo)) {
+		if (crowdVao == 0) glGenVertexArrays(1, &crowdVao);
+		glBindVertexArray(crowdVao);
+		glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
+		setModelVertexAttributes();
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		crowdVaoVbo = *modelVbo;
+	}
+
+	if (crowdPaletteBuffer == 0) {
+		glGenBuffers(1, &crowdPaletteBuffer);
+		glGenTextures(1, &crowdPaletteTexture);
+		glBindBuffer(GL_TEXTURE_BUFFER, crowdPaletteBuffer);
+		glBindTexture(GL_TEXTURE_BUFFER, crowdPaletteTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, crowdPaletteBuffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		if (GLEW_ARB_timer_query) glGenQueries(1, &crowdTimerQuery);
+	}
+
+	gint64 startTime = g_get_monotonic_time();
+	glBindBuffer(GL_TEXTURE_BUFFER, crowdPaletteBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(GLfloat)*snapshot->crowdPalette.size(), &(snapshot->crowdPalette[0]),
+			GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	gint64 uploadEndTime = g_get_monotonic_time();
+
+	//The query result is read a frame late so that we never wait on the GPU
+	gint drawMicroseconds = -1;
+	if (crowdTimerQuery != 0) {
+		GLint available = 0;
+		glGetQueryObjectiv(crowdTimerQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 elapsed;
+			glGetQueryObjectui64v(crowdTimerQuery, GL_QUERY_RESULT, &elapsed);
+			drawMicroseconds = elapsed/1000;
+		}
+		glBeginQuery(GL_TIME_ELAPSED, crowdTimerQuery);
+	}
+
+	crowdShader->use();
+	crowdShader->setUniform16(MODELVIEW_LOCATION, getMatrix(MODELVIEW_MATRIX));
+	crowdShader->setUniform16(PROJECTION_LOCATION, getMatrix(PROJECTION_MATRIX));
+	crowdShader->setUniform1(EXTRA0_LOCATION, 1);
+	crowdShader->setUniform1(EXTRA1_LOCATION, float(snapshot->crowdPalette.size()/(snapshot->crowdSize*16)));
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_BUFFER, crowdPaletteTexture);
+	if (snapshot->lodVao != 0) {
+		glBindVertexArray(snapshot->lodVao);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, snapshot->lodVertexCount, snapshot->crowdSize);
+	} else {
+		glBindVertexArray(crowdVao);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, snapshot->model->vertexCount(), snapshot->crowdSize);
+	}
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	if (crowdTimerQuery != 0) glEndQuery(GL_TIME_ELAPSED); else drawMicroseconds = g_get_monotonic_time()-uploadEndTime;
+
+	g_atomic_int_set(&crowdUploadMicroseconds, uploadEndTime-startTime);
+	if (drawMicroseconds >= 0) g_atomic_int_set(&crowdDrawMicroseconds, drawMicroseconds);
+}
+
+void destroyCrowd() {
+	if (crowdVao != 0) glDeleteVertexArrays(1, &crowdVao);
+	if (crowdPaletteTexture != 0) glDeleteTextures(1, &crowdPaletteTexture);
+	if (crowdPaletteBuffer != 0) glDeleteBuffers(1, &crowdPaletteBuffer);
+	if (crowdTimerQuery != 0) glDeleteQueries(1, &crowdTimerQuery);
+	crowdVao = crowdVaoVbo = crowdPaletteTexture = crowdPaletteBuffer = crowdTimerQuery = 0;
+}
+
+void emptyBounds(float * bounds) {
+	for (short i = 0; i < 3; i++) {
+		bounds[i] = FLT_MAX;
+		bounds[i+3] = -FLT_MAX;
+	}
+}
+
+void unionBounds(float * bounds, const float * otherBounds) {
+	for (short i = 0; i < 3; i++) {
+		bounds[i] = min(bounds[i], otherBounds[i]);
+		bounds[i+3] = max(bounds[i+3], otherBounds[i+3]);
+	}
+}
+
+struct bvhCentroidLess {
+	const float * itemBounds;
+	short axis;
+
+	bool operator()(unsigned a, unsigned b) const {
+		return (itemBounds[(a*6)+axis]+itemBounds[(a*6)+axis+3]) < (itemBounds[(b*6)+axis]+itemBounds[(b*6)+axis+3]);
+	}
+};
+
+//Splits the items at the median centroid along the axis the centroids are most spread out on
+unsigned buildBvhNode(pickBvh * bvh, unsigned first, unsigned count) {
+	unsigned nodeIndex = bvh->nodes.size();
+	bvh->nodes.push_back(bvhNode());
+
+	float bounds[6], centroidBounds[6];
+	emptyBounds(bounds);
+	emptyBounds(centroidBounds);
+	for (unsigned i = first; i < first+count; i++) {
+		const float * itemBounds = &(bvh->itemBounds[bvh->items[i]*6]);
+		float centroid[6];
+		for (short j = 0; j < 3; j++) centroid[j] = centroid[j+3] = (itemBounds[j]+itemBounds[j+3])*0.5f;
+		unionBounds(bounds, itemBounds);
+		unionBounds(centroidBounds, centroid);
+	}
+	copy(bounds, bounds+6, bvh->nodes[nodeIndex].bounds);
+	bvh->nodes[nodeIndex].first = first;
+
+	if (count <= BVH_LEAF_SIZE) {
+		bvh->nodes[nodeIndex].count = count;
+		bvh->nodes[nodeIndex].rightChild = 0;
+		for (unsigned i = first; i < first+count; i++) bvh->itemLeaf[bvh->items[i]] = nodeIndex;
+		return nodeIndex;
+	}
+
+	short axis = 0;
+	for (short i = 1; i < 3; i++) {
+		if ((centroidBounds[i+3]-centroidBounds[i]) > (centroidBounds[axis+3]-centroidBounds[axis])) axis = i;
+	}
+	unsigned half = count/2;
+	bvhCentroidLess less = {&(bvh->itemBounds[0]), axis};
+	nth_element(bvh->items.begin()+first, bvh->items.begin()+first+half, bvh->items.begin()+first+count, less);
+
+	bvh->nodes[nodeIndex].count = 0;
+	buildBvhNode(bvh, first, half);
+	unsigned rightChild = buildBvhNode(bvh, first+half, count-half);
+	bvh->nodes[nodeIndex].rightChild = rightChild;
+	return nodeIndex;
+}
+
+//itemBounds must already be filled in for every item
+void buildBvh(pickBvh * bvh, unsigned itemCount) {
+	bvh->nodes.clear();
+	bvh->nodes.reserve(((itemCount/BVH_LEAF_SIZE)+1)*2);
+	bvh->items.resize(itemCount);
+	bvh->itemLeaf.resize(itemCount);
+	for (unsigned i = 0; i < itemCount; i++) bvh->items[i] = i;
+	if (itemCount > 0) buildBvhNode(bvh, 0, itemCount);
+	bvh->nodeDirty.assign(bvh->nodes.size(), 0);
+}
+
+//Recomputes the bounds of the leaves holding items marked with markBvhItem and of the nodes above them, leaving the
+//rest of the tree alone. Children always come after their parent, so walking backwards visits them first
+void refitBvh(pickBvh * bvh) {
+	for (unsigned i = bvh->nodes.size(); i-- > 0;) {
+		bvhNode * node = &(bvh->nodes[i]);
+		if (node->count > 0) {
+			if (!bvh->nodeDirty[i]) continue;
+			emptyBounds(node->bounds);
+			for (unsigned j = node->first; j < node->first+node->count; j++)
+				unionBounds(node->bounds, &(bvh->itemBounds[bvh->items[j]*6]));
+		} else if (bvh->nodeDirty[i+1] || bvh->nodeDirty[node->rightChild]) {
+			copy(bvh->nodes[i+1].bounds, bvh->nodes[i+1].bounds+6, node->bounds);
+			unionBounds(node->bounds, bvh->nodes[node->rightChild].bounds);
+			bvh->nodeDirty[i] = 1;
+		}
+	}
+	fill(bvh->nodeDirty.begin(), bvh->nodeDirty.end(), 0);
+}
+
+void markBvhItem(pickBvh * bvh, unsigned item) {
+	bvh->nodeDirty[bvh->itemLeaf[item]] = 1;
+}
+
+bool rayHitsBounds(pickRay * ray, const float * bounds, float maxDistance) {
+	float nearDistance = 0.0f, farDistance = maxDistance;
+	for (short i = 0; i < 3; i++) {
+		float a = (bounds[i]-ray->origin[i])*ray->inverseDirection[i];
+		float b = (bounds[i+3]-ray->origin[i])*ray->inverseDirection[i];
+		if (a > b) swap(a, b);
+		nearDistance = max(nearDistance, a);
+		farDistance = min(farDistance, b);
+		if (nearDistance > farDistance) return false;
+	}
+	return true;
+}
+
+//Returns the nearest item hit closer than *distance, or -1, updating *distance to the hit. hitItem returns the
+//distance to an item along the ray, or a negative number if it misses
+int traceBvh(pickBvh * bvh, pickRay * ray, float (*hitItem)(pickRay *, unsigned, void *), void * data,
+		float * distance) {
+	if (bvh->nodes.empty()) return -1;
+
+	int nearestItem = -1;
+	unsigned stack[BVH_MAX_DEPTH], stackSize = 1;
+	stack[0] = 0;
+	while (stackSize > 0) {
+		unsigned nodeIndex = stack[--stackSize];
+		bvhNode * node = &(bvh->nodes[nodeIndex]);
+		if (!rayHitsBounds(ray, node->bounds, *distance)) continue;
+		if (node->count > 0) {
+			for (unsigned i = node->first; i < node->first+node->count; i++) {
+				float itemDistance = hitItem(ray, bvh->items[i], data);
+				if ((itemDistance >= 0.0f) && (itemDistance < *distance)) {
+					*distance = itemDistance;
+					nearestItem = bvh->items[i];
+				}
+			}
+		} else {
+			stack[stackSize++] = node->rightChild;
+			stack[stackSize++] = nodeIndex+1;
+		}
+	}
+	return nearestItem;
+}
+
+//Moller-Trumbore, against the posed copy of the triangle
+float rayHitsTriangle(pickRay * ray, unsigned triangle, void *) {
+	const float * a = &pickPosedVertices[triangle*9], * b = a+3, * c = a+6;
+	float edge1[3], edge2[3], p[3], q[3], t[3];
+	for (short i = 0; i < 3; i++) {
+		edge1[i] = b[i]-a[i];
+		edge2[i] = c[i]-a[i];
+		t[i] = ray->origin[i]-a[i];
+	}
+	p[0] = (ray->direction[1]*edge2[2])-(ray->direction[2]*edge2[1]);
+	p[1] = (ray->direction[2]*edge2[0])-(ray->direction[0]*edge2[2]);
+	p[2] = (ray->direction[0]*edge2[1])-(ray->direction[1]*edge2[0]);
+	float determinant = (edge1[0]*p[0])+(edge1[1]*p[1])+(edge1[2]*p[2]);
+	if (abs(determinant) < 1e-12f) return -1.0f;
+	float inverseDeterminant = 1.0f/determinant;
+
+	float u = ((t[0]*p[0])+(t[1]*p[1])+(t[2]*p[2]))*inverseDeterminant;
+	if ((u < 0.0f) || (u > 1.0f)) return -1.0f;
+	q[0] = (t[1]*edge1[2])-(t[2]*edge1[1]);
+	q[1] = (t[2]*edge1[0])-(t[0]*edge1[2]);
+	q[2] = (t[0]*edge1[1])-(t[1]*edge1[0]);
+	float v = ((ray->direction[0]*q[0])+(ray->direction[1]*q[1])+(ray->direction[2]*q[2]))*inverseDeterminant;
+	if ((v < 0.0f) || (u+v > 1.0f)) return -1.0f;
+	return ((edge2[0]*q[0])+(edge2[1]*q[1])+(edge2[2]*q[2]))*inverseDeterminant;
+}
+
+//Treats the bone as a capsule of radius pickBoneRadius around its posed segment. The ray direction is unit length, so
+//the parameter of the closest approach is a distance
+float rayHitsBone(pickRay * ray, unsigned boneIndex, void *) {
+	const float * start = &pickBoneSegments[boneIndex*6], * end = start+3;
+	float segment[3], offset[3];
+	for (short i = 0; i < 3; i++) {
+		segment[i] = end[i]-start[i];
+		offset[i] = ray->origin[i]-start[i];
+	}
+	float dirDotSegment = 0.0f, segmentLength = 0.0f, dirDotOffset = 0.0f, segmentDotOffset = 0.0f;
+	for (short i = 0; i < 3; i++) {
+		dirDotSegment += ray->direction[i]*segment[i];
+		segmentLength += segment[i]*segment[i];
+		dirDotOffset += ray->direction[i]*offset[i];
+		segmentDotOffset += segment[i]*offset[i];
+	}
+
+	float rayT = 0.0f, segmentT = 0.0f, denominator = segmentLength-(dirDotSegment*dirDotSegment);
+	if (denominator > 1e-8f) rayT = ((dirDotSegment*segmentDotOffset)-(segmentLength*dirDotOffset))/denominator;
+	if (segmentLength > 1e-8f) segmentT = max(0.0f, min(1.0f, ((dirDotSegment*rayT)+segmentDotOffset)/segmentLength));
+	rayT = max(0.0f, (segmentT*dirDotSegment)-dirDotOffset);
+
+	float distanceSquared = 0.0f;
+	for (short i = 0; i < 3; i++) {
+		float difference = (ray->origin[i]+(ray->direction[i]*rayT))-(start[i]+(segment[i]*segmentT));
+		distanceSquared += difference*difference;
+	}
+	if (distanceSquared > pickBoneRadius*pickBoneRadius) return -1.0f;
+	return max(0.0f, rayT-sqrt((pickBoneRadius*pickBoneRadius)-distanceSquared));
+}
+
+//The mouse ray in the same space the model and bones are drawn in
+void mousePickRay(pickRay * ray) {
+	double nearX, nearY, nearZ, farX, farY, farZ, mvMat[16], pMat[16];
+	int viewport[4] = {0, 0, (int)screenWidth(), (int)screenHeight()};
+	getViewMatrices(mvMat, pMat);
+	gluUnProject(viewMouseX(), screenHeight()-viewMouseY(), 0, mvMat, pMat, viewport, &nearX, &nearY, &nearZ);
+	gluUnProject(viewMouseX(), screenHeight()-viewMouseY(), 1, mvMat, pMat, viewport, &farX, &farY, &farZ);
+
+	float direction[3] = {float(farX-nearX), float(farY-nearY), float(farZ-nearZ)};
+	float length = sqrt((direction[0]*direction[0])+(direction[1]*direction[1])+(direction[2]*direction[2]));
+	ray->origin[0] = nearX;
+	ray->origin[1] = nearY;
+	ray->origin[2] = nearZ;
+	for (short i = 0; i < 3; i++) {
+		ray->direction[i] = direction[i]/length;
+		ray->inverseDirection[i] = 1.0f/ray->direction[i];
+	}
+}
+
+//Fills in 16 floats per bone id with each bone's posed matrix relative to the model, as the stack based drawing used to
+void addBoneMatrices(vector<float> * matrices, bone * pBone, const float * parentMatrix) {
+	float localMatrix[16], * matrix = &(*matrices)[pBone->id*16];
+	vec3 rotation = (vec3){{pBone->xRot}, {pBone->yRot}, {pBone->zRot}};
+	boneLocalMatrix(pBone, &rotation, localMatrix);
+	if (parentMatrix == NULL) copy(localMatrix, localMatrix+16, matrix);
+		else multiplyMatrices(parentMatrix, localMatrix, matrix);
+	for (unsigned i = 0; i < pBone->child.size(); i++) addBoneMatrices(matrices, pBone->child[i], matrix);
+}
+
+//Bone ids are only kept in the VBO, so they are read back a block of vertices at a time
+void readPickBoneIds() {
+	unsigned vertexCount = loadedModel->triangles()->size()*3;
+	vector<GLfloat> block(PICK_READBACK_VERTICES*24);
+	pickBoneIds.resize(vertexCount);
+	lockGlContext();
+	glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
+	for (unsigned first = 0; first < vertexCount; first += PICK_READBACK_VERTICES) {
+		unsigned count = min((unsigned)PICK_READBACK_VERTICES, vertexCount-first);
+		glGetBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat)*first*24, sizeof(GLfloat)*count*24, &block[0]);
+		for (unsigned i = 0; i < count; i++) pickBoneIds[first+i] = block[(i*24)+23];
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	unlockGlContext();
+}
+
+//Re-poses the triangles with a vertex on a bone whose matrix has changed, as the animation shader would draw them
+void poseMeshTriangles(unsigned begin, unsigned end, void * data) {
+	bool poseAll = *((bool *)data);
+	unsigned boneCount = pickBoneChanged.size();
+	for (unsigned i = begin; i < end; i++) {
+		bool changed = poseAll;
+		for (short j = 0; (j < 3) && !changed; j++) {
+			int boneId = pickBoneIds[(i*3)+j];
+			if ((boneId >= 0) && ((unsigned)boneId < boneCount)) changed = pickBoneChanged[boneId];
+		}
+		if (!changed) continue;
+
+		float * bounds = &(meshPickBvh.itemBounds[i*6]);
+		emptyBounds(bounds);
+		for (short j = 0; j < 3; j++) {
+			const float * rest = &pickRestVertices[((i*3)+j)*3];
+			float * posed = &pickPosedVertices[((i*3)+j)*3];
+			int boneId = pickBoneIds[(i*3)+j];
+			if (pickMeshPosed && (boneId >= 0) && ((unsigned)boneId < boneCount)) {
+				vec3 point;
+				transformPoint(&pickBoneMatrices[boneId*16], rest[0], rest[1], rest[2], &point);
+				posed[0] = point.x;
+				posed[1] = point.y;
+				posed[2] = point.z;
+			} else copy(rest, rest+3, posed);
+			float pointBounds[6] = {posed[0], posed[1], posed[2], posed[0], posed[1], posed[2]};
+			unionBounds(bounds, pointBounds);
+		}
+		if (!pickMeshDirty) meshPickBvh.nodeDirty[meshPickBvh.itemLeaf[i]] = 1;
+	}
+}
+
+//Brings both BVHs up to date with the current pose. They are only rebuilt when the bones or the mesh themselves
+//change; otherwise just the parts touched by bones that have moved or been reshaped are refitted
+void updatePickBvhs() {
+	PROFILE_SCOPE("updatePickBvhs");
+	int maxId = -1;
+	for (unsigned i = 0; i < boneList.size(); i++) maxId = max(maxId, boneList[i]->id);
+	unsigned boneCount = maxId+1;
+
+	vector<float> previousMatrices;
+	previousMatrices.swap(pickBoneMatrices);
+	pickBoneMatrices.assign(boneCount*16, 0.0f);
+	if (root != NULL) addBoneMatrices(&pickBoneMatrices, root, NULL);
+	bool bonesResized = (previousMatrices.size() != pickBoneMatrices.size());
+	pickBoneChanged.resize(boneCount);
+	for (unsigned i = 0; i < boneCount; i++) {
+		pickBoneChanged[i] = bonesResized
+				|| !equal(&pickBoneMatrices[i*16], &pickBoneMatrices[i*16]+16, &previousMatrices[i*16]);
+	}
+
+	float radius = (BONE_PICK_RADIUS*boneScale)+(BONE_PICK_PIXELS/zoom);
+	bool rebuildBones = skeletonStructureChanged(&pickBones, &pickBoneParents)
+			|| (bonePickBvh.items.size() != boneList.size()), refitAllBones = (radius != pickBoneRadius);
+	pickBoneRadius = radius;
+	pickBoneSegments.resize(boneList.size()*6);
+	pickBoneGeometry.resize(boneList.size()*6);
+	bonePickBvh.itemBounds.resize(boneList.size()*6);
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		bone * pBone = boneList[i];
+		//Moving a bone's start or end in skeleton mode leaves its matrix alone
+		float geometry[6] = {pBone->x, pBone->y, pBone->z, pBone->endX, pBone->endY, pBone->endZ};
+		bool reshaped = !equal(geometry, geometry+6, &pickBoneGeometry[i*6]);
+		if (!rebuildBones && !refitAllBones && !reshaped && !pickBoneChanged[pBone->id]) continue;
+		copy(geometry, geometry+6, &pickBoneGeometry[i*6]);
+		float * segment = &pickBoneSegments[i*6], * bounds = &(bonePickBvh.itemBounds[i*6]);
+		vec3 start, end;
+		transformPoint(&pickBoneMatrices[pBone->id*16], pBone->x, pBone->y, pBone->z, &start);
+		transformPoint(&pickBoneMatrices[pBone->id*16], pBone->x+pBone->endX, pBone->y+pBone->endY,
+				pBone->z+pBone->endZ, &end);
+		segment[0] = start.x;
+		segment[1] = start.y;
+		segment[2] = start.z;
+		segment[3] = end.x;
+		segment[4] = end.y;
+		segment[5] = end.z;
+		for (short j = 0; j < 3; j++) {
+			bounds[j] = min(segment[j], segment[j+3])-radius;
+			bounds[j+3] = max(segment[j], segment[j+3])+radius;
+		}
+		if (!rebuildBones) markBvhItem(&bonePickBvh, i);
+	}
+	if (rebuildBones) buildBvh(&bonePickBvh, boneList.size()); else refitBvh(&bonePickBvh);
+
+	if (loadedModel == NULL) {
+		meshPickBvh.nodes.clear();
+		return;
+	}
+	bool poseAll = pickMeshDirty || pickSkinningDirty || (pickMeshPosed != (mode == ANIMATION_MODE));
+	pickMeshPosed = (mode == ANIMATION_MODE);
+	unsigned triangleCount = loadedModel->triangles()->size();
+	if (pickMeshDirty) {
+		pickRestVertices.resize(triangleCount*9);
+		for (unsigned i = 0; i < triangleCount; i++) {
+			for (short j = 0; j < 3; j++) {
+				pickRestVertices[(i*9)+(j*3)] = (*(loadedModel->triangles()))[i].coords[j].x;
+				pickRestVertices[(i*9)+(j*3)+1] = (*(loadedModel->triangles()))[i].coords[j].y;
+				pickRestVertices[(i*9)+(j*3)+2] = (*(loadedModel->triangles()))[i].coords[j].z;
+			}
+		}
+		pickPosedVertices.resize(triangleCount*9);
+		meshPickBvh.itemBounds.resize(triangleCount*6);
+	}
+	if (pickMeshDirty || pickSkinningDirty) readPickBoneIds();
+
+	parallelFor(triangleCount, 4096, poseMeshTriangles, &poseAll);
+	if (pickMeshDirty) buildBvh(&meshPickBvh, triangleCount); else refitBvh(&meshPickBvh);
+	pickMeshDirty = pickSkinningDirty = false;
+}
+
+void selectBoneInTree(bone * pBone) {
+	for (unsigned i = 0; i < boneIteratorAssociations.size(); i++) {
+		if (boneIteratorAssociations[i].pBone == pBone) {
+			gtk_tree_selection_select_iter(boneSelect, &(boneIteratorAssociations[i].iterator));
+			break;
+		}
+	}
+}
+
+//Selects the bone under the mouse, or failing that the bone the mesh under the mouse is skinned to
+void pickBone() {
+	PROFILE_SCOPE("pickBone");
+	if (root == NULL) return;
+	updatePickBvhs();
+
+	pickRay ray;
+	mousePickRay(&ray);
+	float distance = FLT_MAX;
+	int boneIndex = traceBvh(&bonePickBvh, &ray, rayHitsBone, NULL, &distance);
+	if (boneIndex >= 0) {
+		selectBoneInTree(boneList[boneIndex]);
+		return;
+	}
+
+	int triangle = traceBvh(&meshPickBvh, &ray, rayHitsTriangle, NULL, &distance);
+	if (triangle < 0) return;
+	int nearestBoneId = -1;
+	float nearestDistance = FLT_MAX;
+	for (short i = 0; i < 3; i++) {
+		const float * vertex = &pickPosedVertices[((triangle*3)+i)*3];
+		float vertexDistance = 0.0f;
+		for (short j = 0; j < 3; j++) {
+			float difference = vertex[j]-(ray.origin[j]+(ray.direction[j]*distance));
+			vertexDistance += difference*difference;
+		}
+		if ((pickBoneIds[(triangle*3)+i] >= 0.0f) && (vertexDistance < nearestDistance)) {
+			nearestDistance = vertexDistance;
+			nearestBoneId = pickBoneIds[(triangle*3)+i];
+		}
+	}
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		if (boneList[i]->id == nearestBoneId) {
+			selectBoneInTree(boneList[i]);
+			break;
+		}
+	}
+}
+
+struct clusterCentroidLess {
+	const float * centroids;
+	short axis;
+
+	bool operator()(unsigned a, unsigned b) const {
+		return centroids[(a*3)+axis] < centroids[(b*3)+axis];
+	}
+};
+
+struct clusterMaterialLess {
+	vector<triangle> * triangles;
+
+	bool operator()(unsigned a, unsigned b) const {
+		return (*triangles)[a].mtlNum < (*triangles)[b].mtlNum;
+	}
+};
+
+//Splits the triangles at the median centroid along their widest axis until each part fits in a cluster
+void splitMeshCluster(vector<unsigned> * order, unsigned first, unsigned count, vector<float> * centroids) {
+	if (count <= CLUSTER_TRIANGLES) {
+		meshCluster cluster;
+		cluster.firstIndex = clusterIndices.size();
+		cluster.indexCount = count*3;
+		emptyBounds(cluster.bounds);
+		for (unsigned i = first; i < first+count; i++) {
+			unsigned triangleIndex = (*order)[i];
+			for (short j = 0; j < 3; j++) {
+				vertex * coords = &((*(loadedModel->triangles()))[triangleIndex].coords[j]);
+				float pointBounds[6] = {coords->x, coords->y, coords->z, coords->x, coords->y, coords->z};
+				unionBounds(cluster.bounds, pointBounds);
+				clusterIndices.push_back((triangleIndex*3)+j);
+			}
+		}
+		meshClusters.push_back(cluster);
+		return;
+	}
+
+	float bounds[6];
+	emptyBounds(bounds);
+	for (unsigned i = first; i < first+count; i++) {
+		const float * centroid = &(*centroids)[(*order)[i]*3];
+		float pointBounds[6] = {centroid[0], centroid[1], centroid[2], centroid[0], centroid[1], centroid[2]};
+		unionBounds(bounds, pointBounds);
+	}
+	clusterCentroidLess less = {&(*centroids)[0], 0};
+	for (short i = 1; i < 3; i++) if ((bounds[i+3]-bounds[i]) > (bounds[less.axis+3]-bounds[less.axis])) less.axis = i;
+
+	unsigned half = count/2;
+	nth_element(order->begin()+first, order->begin()+first+half, order->begin()+first+count, less);
+	splitMeshCluster(order, first, half, centroids);
+	splitMeshCluster(order, first+half, count-half, centroids);
+}
+
+//Groups the model's triangles by material, then splits each material into spatially compact clusters. The clusters
+//are drawn through an index buffer over the model's own VBO, so vertex indices everywhere else stay the same
+void buildMeshClusters() {
+	PROFILE_SCOPE("buildMeshClusters");
+	lockGlContext();
+	destroyMeshClusters();
+
+	unsigned triangleCount = loadedModel->triangles()->size();
+	vector<unsigned> order(triangleCount);
+	vector<float> centroids(triangleCount*3);
+	clusterModelTextured = false;
+	for (unsigned i = 0; i < triangleCount; i++) {
+		triangle * pTriangle = &(*(loadedModel->triangles()))[i];
+		order[i] = i;
+		centroids[i*3] = (pTriangle->coords[0].x+pTriangle->coords[1].x+pTriangle->coords[2].x)/3.0f;
+		centroids[(i*3)+1] = (pTriangle->coords[0].y+pTriangle->coords[1].y+pTriangle->coords[2].y)/3.0f;
+		centroids[(i*3)+2] = (pTriangle->coords[0].z+pTriangle->coords[1].z+pTriangle->coords[2].z)/3.0f;
+		if ((*(loadedModel->materials()))[pTriangle->mtlNum].hasTexture) clusterModelTextured = true;
+	}
+	clusterMaterialLess byMaterial = {loadedModel->triangles()};
+	stable_sort(order.begin(), order.end(), byMaterial);
+	for (unsigned first = 0, last; first < triangleCount; first = last) {
+		for (last = first+1; (last < triangleCount) && !byMaterial(order[first], order[last]); last++);
+		splitMeshCluster(&order, first, last-first, &centroids);
+	}
+
+	if (!clusterIndices.empty()) {
+		glGenVertexArrays(1, &clusterVao);
+		glBindVertexArray(clusterVao);
+		glBindBuffer(GL_ARRAY_BUFFER, *modelVbo);
+		setModelVertexAttributes();
+		glGenBuffers(1, &clusterIndexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, clusterIndexBuffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*clusterIndices.size(), &clusterIndices[0],
+				GL_STATIC_DRAW);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+	clusterModel = loadedModel;
+	clusterSkinDirty = true;
+	unlockGlContext();
+}
+
+void updateClusterSkinJob(unsigned begin, unsigned end, void *) {
+	for (unsigned i = begin; i < end; i++) {
+		meshCluster * cluster = &meshClusters[i];
+		cluster->boneIds.clear();
+		cluster->boneBounds.clear();
+		for (unsigned j = cluster->firstIndex; j < cluster->firstIndex+cluster->indexCount; j++) {
+			int boneId = pickBoneIds[clusterIndices[j]];
+			unsigned slot = find(cluster->boneIds.begin(), cluster->boneIds.end(), boneId)-cluster->boneIds.begin();
+			if (slot == cluster->boneIds.size()) {
+				cluster->boneIds.push_back(boneId);
+				cluster->boneBounds.resize(cluster->boneBounds.size()+6);
+				emptyBounds(&(cluster->boneBounds[slot*6]));
+			}
+			vertex * coords = &((*(loadedModel->triangles()))[clusterIndices[j]/3].coords[clusterIndices[j]%3]);
+			float pointBounds[6] = {coords->x, coords->y, coords->z, coords->x, coords->y, coords->z};
+			unionBounds(&(cluster->boneBounds[slot*6]), pointBounds);
+		}
+	}
+}
+
+//Splits each cluster's rest bounds by the bone its vertices are skinned to, so they can be posed with the palette
+void updateClusterSkin() {
+	PROFILE_SCOPE("updateClusterSkin");
+	readPickBoneIds();
+	parallelFor(meshClusters.size(), 16, updateClusterSkinJob, NULL);
+	clusterSkinDirty = false;
+}
+
+//The cluster's bounds once each bone's share of its vertices has been moved by that bone's matrix. With no palette,
+//or skinning that hasn't been split up yet, they are the rest bounds
+void poseClusterBounds(meshCluster * cluster, vector<float> * palette, float * bounds) {
+	if (palette->empty() || clusterSkinDirty) {
+		copy(cluster->bounds, cluster->bounds+6, bounds);
+		return;
+	}
+
+	emptyBounds(bounds);
+	for (unsigned i = 0; i < cluster->boneIds.size(); i++) {
+		const float * rest = &(cluster->boneBounds[i*6]);
+		int boneId = cluster->boneIds[i];
+		if ((boneId < 0) || ((unsigned)boneId*16 >= palette->size())) {
+			unionBounds(bounds, rest);
+			continue;
+		}
+		for (short j = 0; j < 8; j++) {
+			vec3 point;
+			transformPoint(&(*palette)[boneId*16], rest[(j & 1) ? 3 : 0], rest[(j & 2) ? 4 : 1], rest[(j & 4) ? 5 : 2],
+					&point);
+			float pointBounds[6] = {point.x, point.y, point.z, point.x, point.y, point.z};
+			unionBounds(bounds, pointBounds);
+		}
+	}
+}
+
+//The window rectangle (left, bottom, right, top) the box covers, and the depth of its nearest corner
+void projectBounds(const float * bounds, double * mvMat, double * pMat, int * viewport, float * rect, float * nearest) {
+	rect[0] = rect[1] = FLT_MAX;
+	rect[2] = rect[3] = -FLT_MAX;
+	*nearest = FLT_MAX;
+	for (short i = 0; i < 8; i++) {
+		double x, y, z;
+		gluProject(bounds[(i & 1) ? 3 : 0], bounds[(i & 2) ? 4 : 1], bounds[(i & 4) ? 5 : 2], mvMat, pMat, viewport,
+				&x, &y, &z);
+		rect[0] = min(rect[0], (float)x);
+		rect[1] = min(rect[1], (float)y);
+		rect[2] = max(rect[2], (float)x);
+		rect[3] = max(rect[3], (float)y);
+		*nearest = min(*nearest, (float)z);
+	}
+}
+
+bool rectsOverlap(const float * a, const float * b) {
+	return (a[0] <= b[2]) && (a[2] >= b[0]) && (a[1] <= b[3]) && (a[3] >= b[1]);
+}
+
+//The selection box in window coordinates, grown by CLUSTER_BOX_MARGIN to take in the vertices a click snaps to
+void selectionRect(vec2 boxStartPosition, float * rect) {
+	float mouseWindowY = screenHeight()-viewMouseY();
+	rect[0] = min(boxStartPosition.x, (float)viewMouseX())-CLUSTER_BOX_MARGIN;
+	rect[1] = min(boxStartPosition.y, mouseWindowY)-CLUSTER_BOX_MARGIN;
+	rect[2] = max(boxStartPosition.x, (float)viewMouseX())+CLUSTER_BOX_MARGIN;
+	rect[3] = max(boxStartPosition.y, mouseWindowY)+CLUSTER_BOX_MARGIN;
+}
+
+//Picks out the clusters the frame needs, nearest first so that the ones in front can hide those behind them. The
+//point overlay only gets the clusters near the selection box while one is being dragged
+void cullMeshClusters(frameSnapshot * snapshot) {
+	PROFILE_SCOPE("cullMeshClusters");
+	snapshot->clustered = false;
+	if ((snapshot->model == NULL) || snapshot->crowd || (snapshot->lodVao != 0)) return;
+	//The view matrices below are the screen's, so views of other sizes draw the whole model
+	if ((snapshot->viewWidth != screenWidth()) || (snapshot->viewHeight != screenHeight())) return;
+	if (clusterModel != loadedModel) buildMeshClusters();
+	if (meshClusters.empty()) return;
+	if (clusterSkinDirty && !snapshot->bonePalette.empty()) updateClusterSkin();
+
+	double mvMat[16], pMat[16];
+	getViewMatrices(mvMat, pMat);
+	int viewport[4] = {0, 0, (int)screenWidth(), (int)screenHeight()};
+	float screenRect[4] = {0.0f, 0.0f, (float)viewport[2], (float)viewport[3]}, boxRect[4];
+	if (snapshot->showBox) selectionRect(snapshot->boxStartPosition, boxRect);
+
+	vector<pair<float, unsigned> > visible;
+	vector<float> posedBounds(meshClusters.size()*6);
+	for (unsigned i = 0; i < meshClusters.size(); i++) {
+		meshCluster * cluster = &meshClusters[i];
+		float rect[4], nearest;
+		poseClusterBounds(cluster, &(snapshot->bonePalette), &posedBounds[i*6]);
+		projectBounds(&posedBounds[i*6], mvMat, pMat, viewport, rect, &nearest);
+		if (!rectsOverlap(rect, screenRect)) continue;
+		visible.push_back(make_pair(nearest, i));
+		if (snapshot->skinning && (!snapshot->showBox || rectsOverlap(rect, boxRect))) {
+			snapshot->pointDraws.push_back(cluster->firstIndex);
+			snapshot->pointDraws.push_back(cluster->indexCount);
+		}
+	}
+	sort(visible.begin(), visible.end());
+
+	for (unsigned i = 0; i < visible.size(); i++) {
+		meshCluster * cluster = &meshClusters[visible[i].second];
+		snapshot->clusterDraws.push_back(cluster->firstIndex);
+		snapshot->clusterDraws.push_back(cluster->indexCount);
+		snapshot->clusterBounds.insert(snapshot->clusterBounds.end(), &posedBounds[visible[i].second*6],
+				&posedBounds[visible[i].second*6]+6);
+	}
+	snapshot->clustered = true;
+}
+
+//Called on the render thread straight after the model has drawn itself, to find the texture array it binds so that
+//the clusters and LODs can be drawn with it too
+void captureModelTexture(Model * model) {
+	GLint texture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D_ARRAY, &texture);
+	modelTexture = texture;
+	modelTextureModel = model;
+}
+
+//Sets up the shader the model would draw with, for drawing parts of it straight from a VAO
+Shader * useModelShader(frameSnapshot * snapshot) {
+	Shader * shader = (snapshot->mode == ANIMATION_MODE) ? animationShader : skeletonShader;
+	shader->use();
+	shader->setUniform16(MODELVIEW_LOCATION, getMatrix(MODELVIEW_MATRIX));
+	shader->setUniform16(PROJECTION_LOCATION, getMatrix(PROJECTION_MATRIX));
+	if ((modelTextureModel == snapshot->model) && (modelTexture != 0)) glBindTexture(GL_TEXTURE_2D_ARRAY, modelTexture);
+	return shader;
+}
+
+bool canDrawMeshClusters(frameSnapshot * snapshot) {
+	return snapshot->clustered && (modelTextureModel == snapshot->model)
+			&& ((modelTexture != 0) || !clusterModelTextured);
+}
+
+//Each solid cluster is preceded by an occlusion query on its bounding box, drawn without writing colour or depth, and
+//is only drawn if some of the box passed the depth test. The GPU does this without waiting on the CPU, and drawing
+//nearest first means the depth buffer is as full as it can be by the time the further clusters are tested
+void drawMeshClusters(frameSnapshot * snapshot, bool points) {
+	Shader * shader = useModelShader(snapshot);
+	vector<unsigned> * draws = points ? &(snapshot->pointDraws) : &(snapshot->clusterDraws);
+	unsigned drawCount = draws->size()/2;
+	if (drawCount == 0) return;
+
+	if (points || snapshot->wireframe) {
+		vector<GLsizei> counts(drawCount);
+		vector<const GLvoid *> offsets(drawCount);
+		for (unsigned i = 0; i < drawCount; i++) {
+			offsets[i] = (const GLvoid *)(sizeof(GLuint)*(*draws)[i*2]);
+			counts[i] = (*draws)[(i*2)+1];
+		}
+		glBindVertexArray(clusterVao);
+		glMultiDrawElements(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT, &offsets[0], drawCount);
+		glBindVertexArray(0);
+		return;
+	}
+
+	if (clusterQueries.size() < drawCount) {
+		unsigned oldSize = clusterQueries.size();
+		clusterQueries.resize(drawCount);
+		glGenQueries(drawCount-oldSize, &clusterQueries[oldSize]);
+	}
+	float viewMatrix[16];
+	copy(getMatrix(MODELVIEW_MATRIX), getMatrix(MODELVIEW_MATRIX)+16, viewMatrix);
+	GLboolean culling = glIsEnabled(GL_CULL_FACE);
+	for (unsigned i = 0; i < drawCount; i++) {
+		const float * bounds = &(snapshot->clusterBounds[i*6]);
+		float boxMatrix[16] = {bounds[3]-bounds[0], 0.0f, 0.0f, 0.0f, 0.0f, bounds[4]-bounds[1], 0.0f, 0.0f,
+			0.0f, 0.0f, bounds[5]-bounds[2], 0.0f, bounds[0], bounds[1], bounds[2], 1.0f}, matrix[16];
+		multiplyMatrices(viewMatrix, boxMatrix, matrix);
+		shader->setUniform16(MODELVIEW_LOCATION, matrix);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthMask(GL_FALSE);
+		if (culling) glDisable(GL_CULL_FACE);
+		glBindVertexArray(clusterBoxVao);
+		glBeginQuery(GL_SAMPLES_PASSED, clusterQueries[i]);
+		glDrawArrays(GL_TRIANGLES, 0, 36);
+		glEndQuery(GL_SAMPLES_PASSED);
+		if (culling) glEnable(GL_CULL_FACE);
+		glDepthMask(GL_TRUE);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		shader->setUniform16(MODELVIEW_LOCATION, viewMatrix);
+		glBindVertexArray(clusterVao);
+		glBeginConditionalRender(clusterQueries[i], GL_QUERY_NO_WAIT);
+		glDrawElements(GL_TRIANGLES, (*draws)[(i*2)+1], GL_UNSIGNED_INT,
+				(const GLvoid *)(sizeof(GLuint)*(*draws)[i*2]));
+		glEndConditionalRender();
+	}
+	glBindVertexArray(0);
+}
+
+struct lodPositionLess {
+	const float * positions;
+
+	bool operator()(unsigned a, unsigned b) const {
+		return lexicographical_compare(positions+(a*3), positions+(a*3)+3, positions+(b*3), positions+(b*3)+3);
+	}
+};
+
+struct lodCostLess {
+	const float * costs;
+
+	bool operator()(unsigned a, unsigned b) const {
+		return costs[a] < costs[b];
+	}
+};
+
+//Welds the corners that share a position, so that the simplifier sees a connected surface rather than loose triangles
+void weldLodMesh(lodMesh * mesh) {
+	unsigned cornerCount = loadedModel->triangles()->size()*3;
+	vector<float> cornerPositions(cornerCount*3);
+	vector<unsigned> order(cornerCount);
+	for (unsigned i = 0; i < cornerCount; i++) {
+		cornerPositions[i*3] = (*(loadedModel->triangles()))[i/3].coords[i%3].x;
+		cornerPositions[(i*3)+1] = (*(loadedModel->triangles()))[i/3].coords[i%3].y;
+		cornerPositions[(i*3)+2] = (*(loadedModel->triangles()))[i/3].coords[i%3].z;
+		order[i] = i;
+	}
+	lodPositionLess less = {&cornerPositions[0]};
+	sort(order.begin(), order.end(), less);
+
+	float bounds[6];
+	emptyBounds(bounds);
+	mesh->triangles.resize(cornerCount);
+	mesh->corners.resize(cornerCount);
+	for (unsigned i = 0; i < cornerCount; i++) {
+		if ((i == 0) || less(order[i-1], order[i])) {
+			const float * position = &cornerPositions[order[i]*3];
+			float pointBounds[6] = {position[0], position[1], position[2], position[0], position[1], position[2]};
+			unionBounds(bounds, pointBounds);
+			mesh->positions.insert(mesh->positions.end(), position, position+3);
+			mesh->skinSources.push_back(order[i]);
+		}
+		mesh->triangles[order[i]] = mesh->skinSources.size()-1;
+		mesh->corners[i] = i;
+	}
+	lodModelRadius = (cornerCount == 0) ? 0.0f : sqrt(((bounds[3]-bounds[0])*(bounds[3]-bounds[0]))
+			+((bounds[4]-bounds[1])*(bounds[4]-bounds[1]))+((bounds[5]-bounds[2])*(bounds[5]-bounds[2])))/2.0f;
+}
+
+void buildLodAdjacency(lodMesh * mesh) {
+	unsigned vertexCount = mesh->positions.size()/3;
+	mesh->adjacencyStart.assign(vertexCount+1, 0);
+	for (unsigned i = 0; i < mesh->triangles.size(); i++) mesh->adjacencyStart[mesh->triangles[i]+1]++;
+	for (unsigned i = 0; i < vertexCount; i++) mesh->adjacencyStart[i+1] += mesh->adjacencyStart[i];
+	vector<unsigned> next(mesh->adjacencyStart.begin(), mesh->adjacencyStart.end()-1);
+	mesh->adjacency.resize(mesh->triangles.size());
+	for (unsigned i = 0; i < mesh->triangles.size(); i++) mesh->adjacency[next[mesh->triangles[i]]++] = i/3;
+}
+
+//Twice the triangle's area in length
+void lodFaceNormal(const float * a, const float * b, const float * c, double * normal) {
+	double u[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]}, v[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+	normal[0] = (u[1]*v[2])-(u[2]*v[1]);
+	normal[1] = (u[2]*v[0])-(u[0]*v[2]);
+	normal[2] = (u[0]*v[1])-(u[1]*v[0]);
+}
+
+//Adds the squared distance to the triangle's plane, weighted by its area so that slivers count for little
+void addLodFaceQuadric(const float * a, const float * b, const float * c, double * quadric) {
+	double normal[3];
+	lodFaceNormal(a, b, c, normal);
+	double length = sqrt((normal[0]*normal[0])+(normal[1]*normal[1])+(normal[2]*normal[2]));
+	if (length == 0.0) return;
+	double plane[4] = {normal[0]/length, normal[1]/length, normal[2]/length, 0.0}, area = length/2.0;
+	plane[3] = -((plane[0]*a[0])+(plane[1]*a[1])+(plane[2]*a[2]));
+	for (short i = 0, k = 0; i < 4; i++) {
+		for (short j = i; j < 4; j++, k++) quadric[k] += area*plane[i]*plane[j];
+	}
+}
+
+double lodQuadricError(const double * quadric, const float * position) {
+	double x = position[0], y = position[1], z = position[2];
+	return (quadric[0]*x*x)+(2.0*quadric[1]*x*y)+(2.0*quadric[2]*x*z)+(2.0*quadric[3]*x)+(quadric[4]*y*y)
+			+(2.0*quadric[5]*y*z)+(2.0*quadric[6]*y)+(quadric[7]*z*z)+(2.0*quadric[8]*z)+quadric[9];
+}
+
+void lodVertexQuadrics(unsigned begin, unsigned end, void * data) {
+	lodMesh * mesh = (lodMesh *)data;
+	for (unsigned i = begin; i < end; i++) {
+		double * quadric = &(mesh->quadrics[i*10]);
+		fill(quadric, quadric+10, 0.0);
+		for (unsigned j = mesh->adjacencyStart[i]; j < mesh->adjacencyStart[i+1]; j++) {
+			const unsigned * face = &(mesh->triangles[mesh->adjacency[j]*3]);
+			addLodFaceQuadric(&(mesh->positions[face[0]*3]), &(mesh->positions[face[1]*3]),
+					&(mesh->positions[face[2]*3]), quadric);
+		}
+	}
+}
+
+//Whether moving the vertex onto the target would turn over any of its triangles that survive the collapse
+bool lodCollapseFlips(lodMesh * mesh, unsigned source, unsigned target) {
+	for (unsigned i = mesh->adjacencyStart[source]; i < mesh->adjacencyStart[source+1]; i++) {
+		const unsigned * face = &(mesh->triangles[mesh->adjacency[i]*3]);
+		if ((face[0] == target) || (face[1] == target) || (face[2] == target)) continue;
+		const float * points[3], * moved[3];
+		for (short j = 0; j < 3; j++) {
+			points[j] = &(mesh->positions[face[j]*3]);
+			moved[j] = (face[j] == source) ? &(mesh->positions[target*3]) : points[j];
+		}
+		double before[3], after[3];
+		lodFaceNormal(points[0], points[1], points[2], before);
+		lodFaceNormal(moved[0], moved[1], moved[2], after);
+		if (((before[0]*after[0])+(before[1]*after[1])+(before[2]*after[2])) <= 0.0) return true;
+	}
+	return false;
+}
+
+//The sorted vertices that share a triangle with the given one
+void lodVertexRing(lodMesh * mesh, unsigned vertex, vector<unsigned> * ring) {
+	ring->clear();
+	for (unsigned i = mesh->adjacencyStart[vertex]; i < mesh->adjacencyStart[vertex+1]; i++) {
+		const unsigned * face = &(mesh->triangles[mesh->adjacency[i]*3]);
+		for (short j = 0; j < 3; j++) if (face[j] != vertex) ring->push_back(face[j]);
+	}
+	sort(ring->begin(), ring->end());
+	ring->erase(unique(ring->begin(), ring->end()), ring->end());
+}
+
+//The link condition: the ends of an edge may only share the two vertices opposite it, otherwise collapsing it would
+//fold the surface onto itself and leave edges with more than two triangles
+bool lodCollapseBreaksLink(lodMesh * mesh, const vector<unsigned> * sourceRing, unsigned target,
+		vector<unsigned> * targetRing) {
+	lodVertexRing(mesh, target, targetRing);
+	unsigned shared = 0;
+	vector<unsigned>::const_iterator source = sourceRing->begin();
+	vector<unsigned>::const_iterator other = targetRing->begin();
+	while ((source != sourceRing->end()) && (other != targetRing->end())) {
+		if (*source < *other) {
+			source++;
+		} else if (*other < *source) {
+			other++;
+		} else {
+			if (++shared > 2) return true;
+			source++;
+			other++;
+		}
+	}
+	return false;
+}
+
+//Finds the cheapest neighbour each vertex could be collapsed onto. Vertices on an open edge are left where they are so
+//that holes and the outline of open meshes survive
+void lodCollapseCandidates(unsigned begin, unsigned end, void * data) {
+	lodMesh * mesh = (lodMesh *)data;
+	vector<unsigned> ring, neighbourRing;
+	for (unsigned i = begin; i < end; i++) {
+		unsigned first = mesh->adjacencyStart[i], last = mesh->adjacencyStart[i+1], bestTarget = LOD_NO_COLLAPSE;
+		double bestCost = DBL_MAX;
+		bool open = (first == last);
+		if (!open) lodVertexRing(mesh, i, &ring);
+		for (unsigned j = first; (j < last) && !open; j++) {
+			const unsigned * face = &(mesh->triangles[mesh->adjacency[j]*3]);
+			for (short k = 0; (k < 3) && !open; k++) {
+				unsigned neighbour = face[k];
+				if ((neighbour == i) || (neighbour == bestTarget)) continue;
+
+				//Every edge of a closed surface is shared by exactly two triangles
+				unsigned sharing = 0;
+				for (unsigned l = first; l < last; l++) {
+					const unsigned * other = &(mesh->triangles[mesh->adjacency[l]*3]);
+					if ((other[0] == neighbour) || (other[1] == neighbour) || (other[2] == neighbour)) sharing++;
+				}
+				if (sharing != 2) {
+					open = true;
+					break;
+				}
 
+				double quadric[10];
+				for (short l = 0; l < 10; l++) quadric[l] = mesh->quadrics[(i*10)+l]+mesh->quadrics[(neighbour*10)+l];
+				double cost = lodQuadricError(quadric, &(mesh->positions[neighbour*3]));
+				if ((cost < bestCost) && !lodCollapseFlips(mesh, i, neighbour)
+						&& !lodCollapseBreaksLink(mesh, &ring, neighbour, &neighbourRing)) {
+					bestCost = cost;
+					bestTarget = neighbour;
+				}
+			}
+		}
+		mesh->collapseTargets[i] = open ? LOD_NO_COLLAPSE : bestTarget;
+		mesh->collapseCosts[i] = bestCost;
+	}
+}
+
+//One round of collapses: every vertex proposes its cheapest collapse in parallel, then the cheapest proposals that
+//don't share any triangles are applied together. Each vertex moves onto an existing one, so the surviving corners keep
+//their own attributes and bone ids rather than blends that would need re-skinning. Returns how many were applied
+unsigned simplifyLodPass(lodMesh * mesh, unsigned targetTriangles) {
+	unsigned vertexCount = mesh->positions.size()/3, triangleCount = mesh->triangles.size()/3;
+	buildLodAdjacency(mesh);
+	mesh->collapseTargets.resize(vertexCount);
+	mesh->collapseCosts.resize(vertexCount);
+	parallelFor(vertexCount, 1024, lodCollapseCandidates, mesh);
+
+	vector<unsigned> candidates;
+	for (unsigned i = 0; i < vertexCount; i++) if (mesh->collapseTargets[i] != LOD_NO_COLLAPSE) candidates.push_back(i);
+	lodCostLess less = {&(mesh->collapseCosts[0])};
+	unsigned considered = (candidates.size()+LOD_PASS_FRACTION-1)/LOD_PASS_FRACTION;
+	nth_element(candidates.begin(), candidates.begin()+considered, candidates.end(), less);
+	sort(candidates.begin(), candidates.begin()+considered, less);
+
+	//Each collapse takes out the two triangles on its edge
+	unsigned wanted = (triangleCount-targetTriangles+1)/2, applied = 0;
+	mesh->locked.assign(vertexCount, 0);
+	mesh->remap.resize(vertexCount);
+	for (unsigned i = 0; i < vertexCount; i++) mesh->remap[i] = i;
+	for (unsigned i = 0; (i < considered) && (applied < wanted); i++) {
+		unsigned source = candidates[i], target = mesh->collapseTargets[source];
+		if (mesh->locked[source] || mesh->locked[target]) continue;
+		for (unsigned j = mesh->adjacencyStart[source]; j < mesh->adjacencyStart[source+1]; j++) {
+			const unsigned * face = &(mesh->triangles[mesh->adjacency[j]*3]);
+			for (short k = 0; k < 3; k++) mesh->locked[face[k]] = 1;
+		}
+		mesh->remap[source] = target;
+		for (short j = 0; j < 10; j++) mesh->quadrics[(target*10)+j] += mesh->quadrics[(source*10)+j];
+		applied++;
+	}
+
+	unsigned kept = 0;
+	for (unsigned i = 0; i < triangleCount; i++) {
+		unsigned face[3] = {mesh->remap[mesh->triangles[i*3]], mesh->remap[mesh->triangles[(i*3)+1]],
+			mesh->remap[mesh->triangles[(i*3)+2]]};
+		if ((face[0] == face[1]) || (face[1] == face[2]) || (face[0] == face[2])) continue;
+		copy(face, face+3, &(mesh->triangles[kept*3]));
+		copy(&(mesh->corners[i*3]), &(mesh->corners[i*3])+3, &(mesh->corners[kept*3]));
+		kept++;
+	}
+	mesh->triangles.resize(kept*3);
+	mesh->corners.resize(kept*3);
+	return applied;
+}
+
+//Copies the simplified mesh out in the VBO's layout. Bone ids come from pickBoneIds, so it must be current
+void buildMeshLod(lodMesh * mesh, meshLod * lod) {
+	unsigned cornerCount = mesh->triangles.size();
+	lod->vertices.resize(cornerCount*24);
+	lod->skinSources.resize(cornerCount);
+	for (unsigned i = 0; i < cornerCount; i++) {
+		GLfloat * data = &(lod->vertices[i*24]);
+		const float * position = &(mesh->positions[mesh->triangles[i]*3]);
+		fillModelVertex(loadedModel, mesh->corners[i]/3, mesh->corners[i]%3, data);
+		copy(position, position+3, data);
+		lod->skinSources[i] = mesh->skinSources[mesh->triangles[i]];
+		data[23] = pickBoneIds[lod->skinSources[i]];
+	}
+	lod->triangleCount = cornerCount/3;
+	lod->vao = lod->vbo = 0;
+}
+
+//Gives the LOD its own VBO, with a VAO set up like the model's. The caller must hold the GL context
+void uploadMeshLod(meshLod * lod) {
+	glGenVertexArrays(1, &lod->vao);
+	glGenBuffers(1, &lod->vbo);
+	glBindVertexArray(lod->vao);
+	glBindBuffer(GL_ARRAY_BUFFER, lod->vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*lod->vertices.size(), &(lod->vertices[0]), GL_DYNAMIC_DRAW);
+	setModelVertexAttributes();
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//Simplifies the model into LOD_LEVELS meshes, each continuing from the last. The GL context is only borrowed at the
+//start, to read the bone ids, and at the end, to upload the results
+void generateMeshLods() {
+	PROFILE_SCOPE("generateMeshLods");
+	if (loadedModel == NULL) return;
+	readPickBoneIds();
+
+	lodMesh mesh;
+	weldLodMesh(&mesh);
+	mesh.quadrics.resize(mesh.positions.size()/3*10);
+	buildLodAdjacency(&mesh);
+	parallelFor(mesh.positions.size()/3, 1024, lodVertexQuadrics, &mesh);
+
+	vector<meshLod> lods;
+	for (unsigned i = 0; i < LOD_LEVELS; i++) {
+		unsigned previousCount = mesh.triangles.size()/3, targetCount = previousCount/2;
+		while ((mesh.triangles.size()/3 > targetCount) && (simplifyLodPass(&mesh, targetCount) > 0));
+		if ((mesh.triangles.size() == 0) || (mesh.triangles.size()/3 == previousCount)) break;
+		lods.push_back(meshLod());
+		buildMeshLod(&mesh, &lods.back());
+	}
+
+	lockGlContext();
+	destroyMeshLods();
+	meshLods.swap(lods);
+	for (unsigned i = 0; i < meshLods.size(); i++) uploadMeshLod(&meshLods[i]);
+	lodModel = loadedModel;
+	lodSkinDirty = false;
+	unlockGlContext();
+
+	stringstream stream(stringstream::in | stringstream::out);
+	stream << " Triangles: " << loadedModel->triangles()->size();
+	for (unsigned i = 0; i < meshLods.size(); i++) stream << ", LOD " << i+1 << ": " << meshLods[i].triangleCount;
+	gtk_label_set_text(GTK_LABEL(lodInfoLabel), stream.str().c_str());
+}
+
+//Brings the LODs' bone ids back in line with the model's after skinning edits
+void refreshMeshLodSkin() {
+	readPickBoneIds();
+	lockGlContext();
+	for (unsigned i = 0; i < meshLods.size(); i++) {
+		meshLod * lod = &meshLods[i];
+		for (unsigned j = 0; j < lod->skinSources.size(); j++)
+			lod->vertices[(j*24)+23] = pickBoneIds[lod->skinSources[j]];
+		glBindBuffer(GL_ARRAY_BUFFER, lod->vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*lod->vertices.size(), &(lod->vertices[0]));
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	unlockGlContext();
+	lodSkinDirty = false;
+}
+
+//0 for the model itself, otherwise the LOD to draw in its place. Each LOD takes over once the model's bounding sphere
+//covers half as much of the screen as for the one before. Skinning always works on the full model
+unsigned meshLodLevel() {
+	if ((loadedModel == NULL) || (lodModel != loadedModel) || meshLods.empty() || skinningEnabled) return 0;
+	if (lodPreview > 0) return min((unsigned)lodPreview-1, (unsigned)meshLods.size());
+
+	float size = lodModelRadius*2.0f*zoom, threshold = screenHeight()*LOD_SWITCH_SCREEN_FRACTION;
+	unsigned level = 0;
+	while ((level < meshLods.size()) && (size < threshold)) {
+		level++;
+		threshold /= 2.0f;
+	}
+	return level;
+}
+
+//Draws the LOD in place of the model, textured once the model has shown which texture array it uses
+void drawMeshLod(frameSnapshot * snapshot) {
+	useModelShader(snapshot);
+	glBindVertexArray(snapshot->lodVao);
+	glDrawArrays(GL_TRIANGLES, 0, snapshot->lodVertexCount);
+	glBindVertexArray(0);
+}
+
+//Writes each LOD as <name>_lod<level>.smm, alongside wherever the model itself is saved
+void exportMeshLods() {
+	if ((loadedModel == NULL) || (lodModel != loadedModel) || meshLods.empty()) return;
+	string fileName = getFileNameSave("Saving SuperMaximo Model LODs");
+	if (fileName == "") return;
+	if (lowerCase(rightStr(fileName, 4)) == ".smm") fileName = leftStr(fileName, fileName.size()-4);
+
+	if (lodSkinDirty) refreshMeshLodSkin();
+	for (unsigned i = 0; i < meshLods.size(); i++) {
+		stringstream lodFileName(stringstream::in | stringstream::out);
+		lodFileName << fileName << "_lod" << i+1 << ".smm";
+		writeSmm(lodFileName.str(), &(meshLods[i].vertices));
+	}
+}
+
+void updateLodPreview() {
+	lodPreview = gtk_combo_box_get_active(GTK_COMBO_BOX(lodPreviewComboBox));
+	redrawNeeded = true;
+}
+
+#ifdef FRAME_PROFILING
+float profilePercentile(vector<float> samples, float fraction) {
+	unsigned index = min(samples.size()-1, (size_t)(fraction*samples.size()));
+	nth_element(samples.begin(), samples.begin()+index, samples.end());
+	return samples[index];
+}
+
+void reportProfile() {
+	profileFramesSinceReport++;
+	if (profileFramesSinceReport < PROFILE_REPORT_INTERVAL) return;
+	profileFramesSinceReport = 0;
+
+	stringstream stream(stringstream::in | stringstream::out);
+	stream.setf(ios::fixed, ios::floatfield);
+	stream.precision(2);
+	stream << "p50 / p95 / p99 (ms)";
+	for (unsigned i = 0; i < profileCounters.size(); i++) {
+		if (profileCounters[i].samples.empty()) continue;
+		stream << "\n" << profileCounters[i].name << ": " << profilePercentile(profileCounters[i].samples, 0.5f)
+				<< " / " << profilePercentile(profileCounters[i].samples, 0.95f) << " / "
+				<< profilePercentile(profileCounters[i].samples, 0.99f);
+	}
+	if (profileRecording) stream << "\nRecording: " << profileTrace.size() << " events";
+	gtk_label_set_text(GTK_LABEL(profileLabel), stream.str().c_str());
+}
+
+//Writes the recorded session in the Chrome trace event format, for chrome://tracing or Perfetto
+void toggleProfileRecording() {
+	profileRecording = !profileRecording;
+	if (profileRecording) {
+		profileTrace.clear();
+		return;
+	}
+	if (profileTrace.empty()) return;
+
+	string fileName = getFileNameSave("Saving Chrome trace");
+	if (fileName == "") return;
+	if (lowerCase(rightStr(fileName, 5)) != ".json") fileName += ".json";
+	ofstream file;
+	file.open(fileName.c_str());
+
+	gint64 startTime = profileTrace.front().start;
+	for (unsigned i = 0; i < profileTrace.size(); i++) startTime = min(startTime, profileTrace[i].start);
+	file << "{\"traceEvents\":[\n";
+	for (unsigned i = 0; i < profileTrace.size(); i++) {
+		file << "{\"name\":\"" << profileCounters[profileTrace[i].counter].name
+				<< "\",\"cat\":\"editor\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << profileTrace[i].start-startTime
+				<< ",\"dur\":" << profileTrace[i].duration << "}";
+		if (i+1 < profileTrace.size()) file << ",";
+		file << "\n";
+	}
+	file << "]}\n";
+	file.close();
+	profileTrace.clear();
+}
+#endif
+
+//Draws a frame from a snapshot. Only ever called on the thread that owns the GL context
+void drawFrame(frameSnapshot * snapshot) {
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	setMatrix(MODELVIEW_MATRIX);
+	if ((snapshot->viewWidth == screenWidth()) && (snapshot->viewHeight == screenHeight())) {
+		copyMatrix(ORTHOGRAPHIC_MATRIX, PROJECTION_MATRIX);
+	} else {
+		//The screen's projection stretched so that a pixel of the view is still a unit across
+		float projection[16];
+		copy(orthographicMatrix, orthographicMatrix+16, projection);
+		projection[0] *= float(screenWidth())/snapshot->viewWidth;
+		projection[5] *= float(screenHeight())/snapshot->viewHeight;
+		copyMatrix(projection, PROJECTION_MATRIX);
+	}
 	pushMatrix();
-		translateMatrix(pBone->x, pBone->y, pBone->z);
-		rotateMatrix(pBone->xRot, 1.0f, 0.0f, 0.0f);
-		rotateMatrix(pBone->yRot, 0.0f, 1.0f, 0.0f);
-		rotateMatrix(pBone->zRot, 0.0f, 0.0f, 1.0f);
-		translateMatrix(-pBone->x, -pBone->y, -pBone->z);
-		matrixArray[pBone->id] = getMatrix(MODELVIEW_MATRIX);
-
-		for (unsigned i = 0; i < pBone->child.size(); i++) getBoneModelviewMatrices(matrixArray, pBone->child[i]);
+		applyViewTransform(snapshot);
+		if (snapshot->mode == ANIMATION_MODE) animationShader->bind(); else skeletonShader->bind();
+
+		if ((snapshot->selectedBoneId >= 0) && (snapshot->mode == SKELETON_MODE)) {
+			skeletonShader->use();
+			skeletonShader->setUniform1(EXTRA1_LOCATION, (float)snapshot->selectedBoneId);
+		}
+
+		if (snapshot->wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+			else glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		if (snapshot->crowd) {
+			drawCrowd(snapshot);
+		} else if (snapshot->model != NULL) {
+			if (snapshot->mode == ANIMATION_MODE) sendBoneModelviewMatrixUniform(snapshot);
+			bool clustered = canDrawMeshClusters(snapshot);
+			if (snapshot->lodVao != 0) {
+				drawMeshLod(snapshot);
+			} else if (clustered) {
+				drawMeshClusters(snapshot, false);
+			} else {
+				snapshot->model->draw(0.0f, 0.0f, 0.0f);
+				captureModelTexture(snapshot->model);
+			}
+
+			if (snapshot->skinning) {
+				glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
+				glPointSize(5);
+				skeletonShader->setUniform1(EXTRA2_LOCATION, 1.0f);
+				if (clustered) drawMeshClusters(snapshot, true); else snapshot->model->draw(0.0f, 0.0f, 0.0f);
+				skeletonShader->setUniform1(EXTRA2_LOCATION, 0.0f);
+			}
+		}
+		if (snapshot->wireframe || snapshot->skinning) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+		if (snapshot->showSkeleton) drawSkeleton(snapshot);
+
+		vec3 * position = &(snapshot->overlayPosition);
+		if (snapshot->showArrow) {
+			pushMatrix();
+				applyBoneTransforms(&(snapshot->selectedChain));
+				drawArrow(position->x, position->y, position->z, snapshot->axis, snapshot);
+			popMatrix();
+		} else if (snapshot->showRing) {
+			pushMatrix();
+				applyBoneTransforms(&(snapshot->selectedChain));
+				drawRing(position->x, position->y, position->z, snapshot->axis, snapshot);
+			popMatrix();
+		}
+		if (snapshot->showIkTarget)
+			drawRing(snapshot->ikTarget.x, snapshot->ikTarget.y, snapshot->ikTarget.z, Z_AXIS, snapshot);
 	popMatrix();
+
+	if (snapshot->showBox) {
+		pushMatrix();
+			copyMatrix(IDENTITY_MATRIX, MODELVIEW_MATRIX);
+			drawBox(snapshot);
+		popMatrix();
+	}
 }
 
-void sendBoneModelviewMatrixUniform() {
-	mat4 matrixArray[boneList.size()];
-	getBoneModelviewMatrices(matrixArray);
-	animationShader->use();
-	animationShader->setUniform16(EXTRA0_LOCATION, (float*)matrixArray, boneList.size());
+//Redraws the views that need it into their framebuffers, then puts all four on screen. The view under the mouse is
+//redrawn every frame, with the overlays. The others are redrawn when their camera changes, but when only the scene
+//does they are held to one redraw every QUAD_VIEW_IDLE_INTERVAL. Every view shares the snapshot's bone palette and the
+//model's buffers, so an extra view only costs its draw calls
+void drawQuadViews(frameSnapshot * snapshot) {
+	gint64 time = g_get_monotonic_time();
+	int width = screenWidth()/2, height = screenHeight()/2;
+	bool showArrow = snapshot->showArrow, showRing = snapshot->showRing, showIkTarget = snapshot->showIkTarget,
+		showBox = snapshot->showBox, clustered = snapshot->clustered; //culled for the active view only
+	glViewport(0, 0, width, height);
+	for (unsigned i = 0; i < QUAD_VIEW_COUNT; i++) {
+		quadViewTarget * target = &quadViewTargets[i];
+		viewCamera * camera = &(snapshot->views[i]);
+		bool active = (i == snapshot->activeView),
+			moved = !target->drawn || !sameViewCamera(camera, &(target->camera)),
+			due = (target->sceneVersion != snapshot->sceneVersion)
+				&& (time-target->drawTime >= QUAD_VIEW_IDLE_INTERVAL);
+		if (!active && !moved && !due) continue;
+
+		snapshot->viewOrientation = camera->orientation;
+		snapshot->zoom = camera->zoom;
+		snapshot->xRotation = camera->xRotation;
+		snapshot->yRotation = camera->yRotation;
+		snapshot->viewTranslation = camera->translation;
+		snapshot->showArrow = active && showArrow;
+		snapshot->showRing = active && showRing;
+		snapshot->showIkTarget = active && showIkTarget;
+		snapshot->showBox = active && showBox;
+		snapshot->clustered = active && clustered;
+		glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+		drawFrame(snapshot);
+		target->drawn = true;
+		target->camera = *camera;
+		target->sceneVersion = snapshot->sceneVersion;
+		target->drawTime = time;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, screenWidth(), screenHeight());
+
+	for (unsigned i = 0; i < QUAD_VIEW_COUNT; i++) {
+		int x = (i%2)*width, y = (i/2 == 0) ? height : 0;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, quadViewTargets[i].framebuffer);
+		glBlitFramebuffer(0, 0, width, height, x, y, x+width, y+height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+	//A frame around the view the mouse is over
+	int x = (snapshot->activeView%2)*width, y = (snapshot->activeView/2 == 0) ? height : 0,
+		edges[4][4] = {{x, y, width, QUAD_VIEW_BORDER}, {x, y+height-QUAD_VIEW_BORDER, width, QUAD_VIEW_BORDER},
+			{x, y, QUAD_VIEW_BORDER, height}, {x+width-QUAD_VIEW_BORDER, y, QUAD_VIEW_BORDER, height}};
+	glEnable(GL_SCISSOR_TEST);
+	setClearColor(1.0, 0.8, 0.0, 1.0);
+	for (short i = 0; i < 4; i++) {
+		glScissor(edges[i][0], edges[i][1], edges[i][2], edges[i][3]);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	setClearColor(0.3, 0.3, 0.3, 1.0);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+void renderFrame(frameSnapshot * snapshot) {
+#ifdef FRAME_PROFILING
+	gint64 startTime = g_get_monotonic_time();
+#endif
+	if (snapshot->quadView) drawQuadViews(snapshot); else drawFrame(snapshot);
+#ifdef FRAME_PROFILING
+	gint64 drawEndTime = g_get_monotonic_time();
+#endif
+	glXSwapBuffers(glDisplay, glDrawable);
+#ifdef FRAME_PROFILING
+	g_atomic_int_set(&renderDrawMicroseconds, drawEndTime-startTime);
+	g_atomic_int_set(&renderSwapMicroseconds, g_get_monotonic_time()-drawEndTime);
+#endif
+}
+
+//Starts a snapshot of the view as it is now, with every overlay turned off
+frameSnapshot * newFrameSnapshot() {
+	frameSnapshot * snapshot = new frameSnapshot;
+	snapshot->mode = mode;
+	snapshot->viewOrientation = viewOrientation;
+	snapshot->zoom = zoom;
+	snapshot->xRotation = xRotation;
+	snapshot->yRotation = yRotation;
+	snapshot->viewTranslation = viewTranslation;
+	snapshot->viewWidth = screenWidth();
+	snapshot->viewHeight = screenHeight();
+	snapshot->wireframe = wireframeModeEnabled;
+	snapshot->skinning = skinningEnabled;
+	snapshot->showSkeleton = true;
+	snapshot->showArrow = snapshot->showRing = snapshot->showIkTarget = snapshot->showBox = false;
+	snapshot->mousePosition = (vec2){{viewMouseX()}, {viewMouseY()}};
+	snapshot->selectedBoneId = (selectedBone == NULL) ? -1 : selectedBone->id;
+	snapshot->quadView = quadViewEnabled;
+	if (quadViewEnabled) {
+		storeViewCamera(&quadViews[activeQuadView]);
+		snapshot->views.assign(quadViews, quadViews+QUAD_VIEW_COUNT);
+		snapshot->activeView = activeQuadView;
+	}
+	return snapshot;
+}
+
+//Moves the quad view's scene version on if anything the views show, other than their cameras, is different from the
+//last snapshot. The overlays are left out since only the view under the mouse draws them, and the crowd is always
+//moving so its palette isn't worth comparing
+void updateQuadSceneVersion(frameSnapshot * snapshot) {
+	static vector<float> lastBonePalette;
+	static unsigned lastValues[9];
+	unsigned values[9] = {snapshot->mode, (unsigned)snapshot->selectedBoneId, snapshot->wireframe, snapshot->skinning,
+		snapshot->crowd, snapshot->crowdSize, snapshot->skeletonVersion, snapshot->lodVao, glObjectsVersion};
+	bool changed = snapshot->crowd;
+	for (short i = 0; i < 9; i++) if (values[i] != lastValues[i]) changed = true;
+	if (changed || (snapshot->bonePalette != lastBonePalette)) {
+		for (short i = 0; i < 9; i++) lastValues[i] = values[i];
+		lastBonePalette = snapshot->bonePalette;
+		quadSceneVersion++;
+		quadSceneChangeTime = g_get_monotonic_time();
+	}
+	snapshot->sceneVersion = quadSceneVersion;
+}
+
+//Adds the model and the posed bones. Called once the overlays are set, since culling the point overlay depends on the
+//selection box
+void addSceneToSnapshot(frameSnapshot * snapshot) {
+	updateSkeletonInstances();
+	unsigned lodLevel = meshLodLevel();
+	if ((lodLevel > 0) && lodSkinDirty) refreshMeshLodSkin();
+
+	snapshot->model = loadedModel;
+	snapshot->crowd = (loadedModel != NULL) && crowdEnabled && (mode == ANIMATION_MODE) && (root != NULL);
+	snapshot->crowdSize = 0;
+	if (snapshot->crowd) {
+		evaluateCrowd();
+		snapshot->crowdSize = crowdSize;
+		snapshot->crowdPalette.swap(crowdPalette);
+		g_mutex_lock(&crowdPaletteMutex);
+		crowdPalette.swap(spareCrowdPalette);
+		g_mutex_unlock(&crowdPaletteMutex);
+	} else if ((loadedModel != NULL) && (mode == ANIMATION_MODE) && (root != NULL)) {
+		snapshot->bonePalette.assign(boneList.size()*16, 0.0f);
+		addBoneMatrices(&(snapshot->bonePalette), root, NULL);
+	}
+	//The instances are only copied until the drawing thread has them, not every frame
+	snapshot->skeletonVersion = skeletonVersion;
+	snapshot->skeletonInstanceCount = skeletonInstances.size()/20;
+	if ((gint)skeletonVersion != g_atomic_int_get(&uploadedSkeletonVersion))
+		snapshot->skeletonInstances = skeletonInstances;
+	snapshot->lodVao = (lodLevel > 0) ? meshLods[lodLevel-1].vao : 0;
+	snapshot->lodVertexCount = (lodLevel > 0) ? meshLods[lodLevel-1].triangleCount*3 : 0;
+	cullMeshClusters(snapshot);
+	if (snapshot->quadView) updateQuadSceneVersion(snapshot);
 }
 
 gboolean glLoop(void*) {
@@ -2025,33 +6126,77 @@ gboolean glLoop(void*) {
 		gtk_main_quit();
 		return false;
 	}
+	//Nothing can be edited until the file being loaded has been swapped in
+	if (activeFileLoad != NULL) {
+		SDL_PumpEvents();
+		return true;
+	}
+
+	//Edits made by dragging only become an undo step once the drag has finished
+	if (undoStepPending && !mouseLeft() && !keyPressed(CONTROL_KEYCODE) && !keyPressed(ALT_KEYCODE))
+		commitUndoStep();
+
+	//Only redraw when something could have changed, polling for input less often once the editor has been idle a while
+	bool animating = playAnimation || ((mode == ANIMATION_MODE) && (blendPreviewEnabled || crowdEnabled));
+	if (viewportInputActive() || animating) redrawNeeded = true;
+	//Keep going until the views that aren't redrawn every frame have caught up with the scene
+	if (quadViewEnabled && (g_get_monotonic_time()-quadSceneChangeTime < QUAD_VIEW_IDLE_INTERVAL*2))
+		redrawNeeded = true;
+	if (!redrawNeeded) {
+		SDL_PumpEvents();
+		if (idleTicks < IDLE_TICKS_BEFORE_SLOWDOWN) idleTicks++;
+			else if (glLoopInterval != IDLE_POLL_INTERVAL) {
+			glLoopInterval = IDLE_POLL_INTERVAL;
+			g_timeout_add(glLoopInterval, glLoop, NULL);
+			return false;
+		}
+		return true;
+	}
+	redrawNeeded = false;
+	idleTicks = 0;
+	gboolean keepTimeout = true;
+	PROFILE_SCOPE("frame");
+	updateFrameCompensation();
+	SDL_PumpEvents(); //refreshScreen used to do this, but the render thread now swaps the buffers itself
+	if (glLoopInterval != ACTIVE_FRAME_INTERVAL) {
+		glLoopInterval = ACTIVE_FRAME_INTERVAL;
+		g_timeout_add(glLoopInterval, glLoop, NULL);
+		keepTimeout = false;
+	}
 
 	//for (unsigned i = 0; i < 320; i++) if (keyPressed(i)) cout << i << endl;
 
-	bool showArrow = false, showArrowParent, showRing = false;
+	focusQuadView();
+
+	bool showArrow = false, showArrowParent, showRing = false, showIkTarget = false;
 	axisEnum axis;
+	vec3 ikTarget;
+	PROFILE_PHASES("input");
 	if (keyPressed(CONTROL_KEYCODE)) handleControlPressed(&showArrow, &showArrowParent, &axis); else
-		if (keyPressed(ALT_KEYCODE) && (mode == ANIMATION_MODE)) handleAltPressed(&showRing, &axis);
+		if (keyPressed(ALT_KEYCODE) && (mode == ANIMATION_MODE) && !blendPreviewEnabled)
+			handleAltPressed(&showRing, &axis); else
+			if (ikEnabled && mouseLeft() && (mode == ANIMATION_MODE) && !blendPreviewEnabled)
+				handleIkDrag(&showIkTarget, &ikTarget);
 
-	if (mouseWheelUp()) {
-		scaleMatrix(0.9, 0.9, 0.9);
-		zoom *= 0.9;
-	} else if (mouseWheelDown()) {
-		scaleMatrix(1.1, 1.1, 1.1);
-		zoom *= 1.1;
-	}
+	static bool mouseLeftWasDown = false;
+	if (mouseLeft() && !mouseLeftWasDown && !keyPressed(CONTROL_KEYCODE) && !keyPressed(ALT_KEYCODE)
+			&& !keyPressed(SHIFT_KEYCODE) && !boneCreationEnabled && !skinningEnabled
+			&& !(ikEnabled && (mode == ANIMATION_MODE))) pickBone();
+	mouseLeftWasDown = mouseLeft();
+
+	if (mouseWheelUp()) zoom *= 0.9; else if (mouseWheelDown()) zoom *= 1.1;
 
 	if (((mouseMiddle() || (keyPressed(CONTROL_KEYCODE) && mouseLeft())) && !keyPressed(ALT_KEYCODE)
 			&& !keyPressed(SHIFT_KEYCODE)) && (viewOrientation == FREE)) {
 		vec2 amountMoved = mouseMovedAmount();
-		xRotation += (float(amountMoved.y)/3.0f)*compensation();
-		yRotation += (float(amountMoved.x)/3.0f)*compensation();
+		xRotation += (float(amountMoved.y)/3.0f)*frameCompensation();
+		yRotation += (float(amountMoved.x)/3.0f)*frameCompensation();
 	} else handleBoneCreation();
 
 	handleBoneCompletion();
 
 	if (mouseRight()) {
-		vec2 amountMoved = mouseMovedAmount();
+		vec2 amountMoved = viewMouseMovedAmount();
 		viewTranslation.x += amountMoved.x/zoom;
 		viewTranslation.y -= amountMoved.y/zoom;
 	} else if (keyPressed(SPACEBAR_KEYCODE)) {
@@ -2065,7 +6210,7 @@ gboolean glLoop(void*) {
 			setBoneRotations(currentFrame);
 		} else if ((root != NULL) && (selectedBone != NULL) && (mode == SKELETON_MODE)) {
 			static float timeSinceBoneDeleted = BONE_DELETE_DELAY;
-			if (timeSinceBoneDeleted < BONE_DELETE_DELAY) timeSinceBoneDeleted += compensation(); else {
+			if (timeSinceBoneDeleted < BONE_DELETE_DELAY) timeSinceBoneDeleted += frameCompensation(); else {
 				bone * tempBone = selectedBone;
 				selectedBone = selectedBone->parent;
 				deleteBone(tempBone);
@@ -2078,88 +6223,514 @@ gboolean glLoop(void*) {
 	vec2 boxStartPosition;
 	if (skinningEnabled) handleSkinning(&showBox, &boxStartPosition);
 
-	if (playAnimation) {
-		currentFrame++;
-		if (currentFrame > animations[currentAnimation].length) currentFrame = 1;
-		gtk_range_set_value(GTK_RANGE(timeline), currentFrame);
-		setCurrentFrameFromScale();
+	PROFILE_PHASE("playback");
+	if (playAnimation) setTimelineFrame((currentFrame >= animations[currentAnimation].length) ? 1 : currentFrame+1);
+
+	if (blendPreviewEnabled && (mode == ANIMATION_MODE)) {
+		advanceBlendLayers();
+		evaluateBlendTree();
 	}
 
-	copyMatrix(ORTHOGRAPHIC_MATRIX, PROJECTION_MATRIX);
-	pushMatrix();
-		translateMatrix(viewTranslation.x, viewTranslation.y, 0.0f);
-		rotateMatrix(xRotation, 1.0f, 0.0f, 0.0f);
-		rotateMatrix(yRotation, 0.0f, 1.0f, 0.0f);
+	PROFILE_PHASE("snapshot");
+	frameSnapshot * snapshot = newFrameSnapshot();
+	snapshot->showArrow = showArrow && (selectedBone != NULL);
+	snapshot->showRing = showRing && (selectedBone != NULL);
+	snapshot->showIkTarget = showIkTarget;
+	snapshot->showBox = showBox;
+	snapshot->axis = axis;
+	snapshot->ikTarget = ikTarget;
+	snapshot->boxStartPosition = boxStartPosition;
+	if (snapshot->showArrow || snapshot->showRing) {
+		for (bone * pBone = selectedBone; pBone != NULL; pBone = pBone->parent)
+			snapshot->selectedChain.insert(snapshot->selectedChain.begin(),
+					(boneTransform){pBone->x, pBone->y, pBone->z, pBone->xRot, pBone->yRot, pBone->zRot});
+		snapshot->overlayPosition = (vec3){{selectedBone->x}, {selectedBone->y}, {selectedBone->z}};
+		if (snapshot->showArrow && !showArrowParent) {
+			snapshot->overlayPosition.x += selectedBone->endX;
+			snapshot->overlayPosition.y += selectedBone->endY;
+			snapshot->overlayPosition.z += selectedBone->endZ;
+		}
+	}
 
-		if ((selectedBone != NULL) && (mode == SKELETON_MODE)) {
-			skeletonShader->use();
-			skeletonShader->setUniform1(EXTRA1_LOCATION, (float)selectedBone->id);
+	addSceneToSnapshot(snapshot);
+
+	if (renderThread == NULL) {
+		renderFrame(snapshot);
+		releaseFrameSnapshot(snapshot);
+	} else if (!pushFrameSnapshot(snapshot)) {
+		releaseFrameSnapshot(snapshot);
+		redrawNeeded = true;
+	}
+
+	lastMousePosition = (vec2){{mouseX()}, {mouseY()}};
+
+#ifdef FRAME_PROFILING
+	static unsigned drawCounter = profileCounterId("draw"), swapCounter = profileCounterId("refreshScreen");
+	takeRenderTiming(&renderDrawMicroseconds, drawCounter);
+	takeRenderTiming(&renderSwapMicroseconds, swapCounter);
+	reportProfile();
+#endif
+
+	if (executeOpenFile) {
+		PROFILE_PHASE("openFile");
+		openFile();
+		executeOpenFile = false;
+		redrawNeeded = true;
+	}
+
+	return keepTimeout;
+}
+
+void removeExcessKeyframes(bone * pBone = NULL) {
+	if (pBone == NULL) pBone = root;
+
+	for (unsigned i = 0; i < pBone->animations[currentAnimation].frames.size(); i++)
+		if (pBone->animations[currentAnimation].frames[i].step > animations[currentAnimation].length)
+			pBone->animations[currentAnimation].frames.erase(pBone->animations[currentAnimation].frames.begin()+i);
+
+	for (unsigned i = 0; i < pBone->child.size(); i++) removeExcessKeyframes(pBone->child[i]);
+	tracksChanged();
+}
+
+//Angle (in degrees) between where the bone's end points under two world space rotations (matrices with no
+//translation), as seen from its pivot. Bones with no length use their local axes instead so that twisting them still
+//counts
+float keyframeError(bone * pBone, const float * rotationA, const float * rotationB) {
+	vec3 directions[3] = {(vec3){{pBone->endX}, {pBone->endY}, {pBone->endZ}}, (vec3){{0.0f}, {1.0f}, {0.0f}},
+		(vec3){{0.0f}, {0.0f}, {1.0f}}};
+	unsigned directionCount = 1;
+	float worstError = 0.0f;
+	if ((abs(pBone->endX)+abs(pBone->endY)+abs(pBone->endZ)) < 0.0001f) {
+		directions[0] = (vec3){{1.0f}, {0.0f}, {0.0f}};
+		directionCount = 3;
+	}
+
+	for (unsigned i = 0; i < directionCount; i++) {
+		vec3 a, b;
+		transformPoint(rotationA, directions[i].x, directions[i].y, directions[i].z, &a);
+		transformPoint(rotationB, directions[i].x, directions[i].y, directions[i].z, &b);
+		float cosAngle = ((a.x*b.x)+(a.y*b.y)+(a.z*b.z))
+				/sqrt(((a.x*a.x)+(a.y*a.y)+(a.z*a.z))*((b.x*b.x)+(b.y*b.y)+(b.z*b.z)));
+		worstError = max(worstError, (float)radToDeg(acos(max(-1.0f, min(1.0f, cosAngle)))));
+	}
+	return worstError;
+}
+
+//The rotation part of a bone's world matrix, given its parent's (NULL for the root)
+void worldRotation(const float * parentRotation, vec3 * rotation, float * matrix) {
+	if (parentRotation == NULL) eulerMatrix(rotation, matrix); else {
+		float localMatrix[16];
+		eulerMatrix(rotation, localMatrix);
+		multiplyMatrices(parentRotation, localMatrix, matrix);
+	}
+}
+
+//Each work item is one track, i.e. one bone in one animation, of the bones at the depth being reduced. Keys are
+//dropped greedily from the start of the track whenever the curve through the remaining keys, under the parents' tracks
+//as already reduced, still puts the bone's end within the tolerance of the original pose at every frame
+void reduceKeyframeTracks(unsigned begin, unsigned end, void * data) {
+	keyReduction * reduction = (keyReduction*)data;
+	unsigned animationCount = animations.size();
+	bone::animation original, window;
+	trackCurve originalCurve, windowCurve;
+	vector<bone::keyFrame> keptFrames;
+
+	for (unsigned index = begin; index < end; index++) {
+		unsigned item = reduction->tracks[index], boneIndex = item/animationCount, animationId = item%animationCount,
+			length = max(animations[animationId].length, 1u);
+		bone * pBone = boneList[boneIndex];
+		bone::animation * pAnimation = &(pBone->animations[animationId]);
+		float * originalWorld = &(reduction->originalWorld[reduction->worldStart[item]*16]),
+			* reducedWorld = &(reduction->reducedWorld[reduction->worldStart[item]*16]);
+		const float * originalParent = NULL, * reducedParent = NULL;
+		if (reduction->parents[boneIndex] >= 0) {
+			unsigned parentItem = (reduction->parents[boneIndex]*animationCount)+animationId;
+			originalParent = &(reduction->originalWorld[reduction->worldStart[parentItem]*16]);
+			reducedParent = &(reduction->reducedWorld[reduction->worldStart[parentItem]*16]);
 		}
+		reduction->removed[item] = 0;
+		reduction->error[item] = 0.0f;
 
-		if (wireframeModeEnabled) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-			else glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-		if (loadedModel != NULL) {
-			if (mode == ANIMATION_MODE) sendBoneModelviewMatrixUniform();
-			loadedModel->draw(0.0f, 0.0f, 0.0f);
+		trackCurve * curve = findTrackCurve(pBone, animationId);
+		if (curve != NULL) originalCurve.tangents = windowCurve.tangents = curve->tangents; else {
+			originalCurve.tangents.clear();
+			windowCurve.tangents.clear();
+		}
+		original.frames = pAnimation->frames;
+		buildTrackCurve(&original, &originalCurve);
+		//The world rotations are kept for every frame from 1, so that the children can be measured against them
+		for (unsigned step = 1; step <= length; step++) {
+			vec3 rotation;
+			sampleAnimation(&original, step, &rotation, &originalCurve);
+			worldRotation((originalParent == NULL) ? NULL : originalParent+(step*16), &rotation,
+					originalWorld+(step*16));
+		}
 
-			if (skinningEnabled) {
-				glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
-				glPointSize(5);
-				skeletonShader->setUniform1(EXTRA2_LOCATION, 1.0f);
-				loadedModel->draw(0.0f, 0.0f, 0.0f);
-				skeletonShader->setUniform1(EXTRA2_LOCATION, 0.0f);
+		unsigned frameCount = original.frames.size();
+		if (frameCount >= 3) {
+			keptFrames.clear();
+			keptFrames.push_back(original.frames.front());
+			for (unsigned i = 1; i < frameCount-1; i++) {
+				//Dropping key i changes the tangents of the keys either side of it, so the frames from the key before
+				//the last kept key up to the key after next are checked, with one more key either side for their
+				//tangents
+				unsigned keptStart = (keptFrames.size() > 3) ? keptFrames.size()-3 : 0,
+					checkEndStep = min(original.frames[min(i+2, frameCount-1)].step, length+1);
+				window.frames.assign(keptFrames.begin()+keptStart, keptFrames.end());
+				unsigned checkStartStep = window.frames[(window.frames.size() > 1) ? window.frames.size()-2 : 0].step;
+				window.frames.insert(window.frames.end(), original.frames.begin()+i+1,
+						original.frames.begin()+min(i+4, frameCount));
+				buildTrackCurve(&window, &windowCurve);
+
+				float worstError = 0.0f;
+				for (unsigned step = checkStartStep+1; step < checkEndStep; step++) {
+					vec3 rotation;
+					float reduced[16];
+					sampleAnimation(&window, step, &rotation, &windowCurve);
+					worldRotation((reducedParent == NULL) ? NULL : reducedParent+(step*16), &rotation, reduced);
+					worstError = max(worstError, keyframeError(pBone, originalWorld+(step*16), reduced));
+					if (worstError > reduction->tolerance) break;
+				}
+
+				if (worstError > reduction->tolerance) keptFrames.push_back(original.frames[i]);
+					else reduction->removed[item]++;
+			}
+			keptFrames.push_back(original.frames.back());
+			pAnimation->frames.swap(keptFrames);
+		}
+
+		//The error achieved is measured over the whole of the final track, including what the parents contribute
+		window.frames = pAnimation->frames;
+		buildTrackCurve(&window, &windowCurve);
+		for (unsigned step = 1; step <= length; step++) {
+			vec3 rotation;
+			sampleAnimation(&window, step, &rotation, &windowCurve);
+			worldRotation((reducedParent == NULL) ? NULL : reducedParent+(step*16), &rotation, reducedWorld+(step*16));
+			reduction->error[item] = max(reduction->error[item],
+					keyframeError(pBone, originalWorld+(step*16), reducedWorld+(step*16)));
+		}
+	}
+}
+
+//The tolerance is on where each bone's end points in world space, so a parent's error counts against its children's.
+//Bones are reduced a depth at a time, parents first, so that each child is measured under its parent's reduced track
+void reduceKeyframes() {
+	PROFILE_SCOPE("reduceKeyframes");
+	if (root == NULL) return;
+
+	keyReduction reduction;
+	reduction.tolerance = gtk_spin_button_get_value(GTK_SPIN_BUTTON(keyReductionToleranceSpinButton));
+	unsigned animationCount = animations.size(), trackCount = boneList.size()*animationCount, worldSize = 0;
+	reduction.removed.resize(trackCount);
+	reduction.error.resize(trackCount);
+	reduction.worldStart.resize(trackCount);
+	for (unsigned i = 0; i < trackCount; i++) {
+		reduction.worldStart[i] = worldSize;
+		worldSize += max(animations[i%animationCount].length, 1u)+1;
+	}
+	reduction.originalWorld.resize(worldSize*16);
+	reduction.reducedWorld.resize(worldSize*16);
+
+	map<bone *, int> boneIndices;
+	for (unsigned i = 0; i < boneList.size(); i++) boneIndices[boneList[i]] = i;
+	vector<unsigned> depths(boneList.size(), 0);
+	unsigned maxDepth = 0;
+	reduction.parents.resize(boneList.size());
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		reduction.parents[i] = (boneList[i]->parent == NULL) ? -1 : boneIndices[boneList[i]->parent];
+		for (bone * pBone = boneList[i]->parent; pBone != NULL; pBone = pBone->parent) depths[i]++;
+		maxDepth = max(maxDepth, depths[i]);
+	}
+
+	updateTrackCurves();
+	for (unsigned depth = 0; depth <= maxDepth; depth++) {
+		reduction.tracks.clear();
+		for (unsigned i = 0; i < trackCount; i++) if (depths[i/animationCount] == depth) reduction.tracks.push_back(i);
+		parallelFor(reduction.tracks.size(), 4, reduceKeyframeTracks, &reduction);
+	}
+	tracksChanged();
+
+	unsigned removed = 0;
+	float worstError = 0.0f;
+	for (unsigned i = 0; i < trackCount; i++) {
+		removed += reduction.removed[i];
+		worstError = max(worstError, reduction.error[i]);
+	}
+
+	stringstream stream(stringstream::in | stringstream::out);
+	stream.setf(ios::fixed, ios::floatfield);
+	stream.precision(3);
+	stream << " " << removed << " keys removed, max error " << worstError << " deg";
+	gtk_label_set_text(GTK_LABEL(keyReductionLabel), stream.str().c_str());
+
+	setAnimationMarks(selectedBone);
+	if (mode == ANIMATION_MODE) setBoneRotations(currentFrame);
+}
+
+void setKeyTangent() {
+	if ((selectedBone == NULL) || (selectedBone->animations[currentAnimation].frameIndex(currentFrame) == -1)) return;
+
+	updateTrackCurves();
+	trackCurve * curve = findTrackCurve(selectedBone, currentAnimation);
+	if (curve == NULL) return;
+	keyTangent tangent;
+	tangent.mode = (tangentModeEnum)gtk_combo_box_get_active(GTK_COMBO_BOX(tangentModeComboBox));
+	tangent.slope.x = gtk_spin_button_get_value(GTK_SPIN_BUTTON(tangentSlopeSpinButton[X_AXIS]));
+	tangent.slope.y = gtk_spin_button_get_value(GTK_SPIN_BUTTON(tangentSlopeSpinButton[Y_AXIS]));
+	tangent.slope.z = gtk_spin_button_get_value(GTK_SPIN_BUTTON(tangentSlopeSpinButton[Z_AXIS]));
+	if (tangent.mode == TANGENT_AUTO) curve->tangents.erase(currentFrame); else curve->tangents[currentFrame] = tangent;
+
+	tracksChanged();
+	setBoneRotations(currentFrame);
+}
+
+//Rotation taking the target bone's rest direction onto the source bone's, so that a source rotation R can be replayed
+//on the target as C^-1*R*C. Only the directions matter; bones of different lengths turn through the same angles
+void restCorrection(bone * sourceBone, bone * targetBone, float * correction, float * inverseCorrection) {
+	vec3 source = (vec3){{sourceBone->endX}, {sourceBone->endY}, {sourceBone->endZ}},
+		target = (vec3){{targetBone->endX}, {targetBone->endY}, {targetBone->endZ}};
+	float sourceLength = sqrt((source.x*source.x)+(source.y*source.y)+(source.z*source.z)),
+		targetLength = sqrt((target.x*target.x)+(target.y*target.y)+(target.z*target.z));
+
+	vec3 axis = (vec3){{0.0f}, {0.0f}, {1.0f}};
+	float angle = 0.0f;
+	if ((sourceLength > 0.0001f) && (targetLength > 0.0001f)) {
+		axis = (vec3){{(target.y*source.z)-(target.z*source.y)}, {(target.z*source.x)-(target.x*source.z)},
+			{(target.x*source.y)-(target.y*source.x)}};
+		float axisLength = sqrt((axis.x*axis.x)+(axis.y*axis.y)+(axis.z*axis.z));
+		angle = atan2(axisLength, (target.x*source.x)+(target.y*source.y)+(target.z*source.z));
+		if (axisLength > 0.0001f) {
+			axis.x /= axisLength;
+			axis.y /= axisLength;
+			axis.z /= axisLength;
+		} else if (angle > 0.0001f) {
+			//Pointing in opposite directions, so any perpendicular axis will do
+			axis = (abs(target.x) < 0.9f*targetLength) ? (vec3){{0.0f}, {-target.z}, {target.y}}
+				: (vec3){{-target.z}, {0.0f}, {target.x}};
+			axisLength = sqrt((axis.x*axis.x)+(axis.y*axis.y)+(axis.z*axis.z));
+			axis.x /= axisLength;
+			axis.y /= axisLength;
+			axis.z /= axisLength;
+		} else angle = 0.0f;
+	}
+	axisAngleMatrix(&axis, angle, correction);
+	axisAngleMatrix(&axis, -angle, inverseCorrection);
+}
+
+//Replays a source bone's rotation (in degrees) on the target bone, clamped to the target's limits
+void retargetRotation(bone * targetBone, const float * correction, const float * inverseCorrection, vec3 * rotation) {
+	float sourceMatrix[16], tempMatrix[16], targetMatrix[16];
+	eulerMatrix(rotation, sourceMatrix);
+	multiplyMatrices(sourceMatrix, correction, tempMatrix);
+	multiplyMatrices(inverseCorrection, tempMatrix, targetMatrix);
+	eulerFromMatrix(targetMatrix, rotation);
+	clampRotation(targetBone, X_AXIS, &rotation->x);
+	clampRotation(targetBone, Y_AXIS, &rotation->y);
+	clampRotation(targetBone, Z_AXIS, &rotation->z);
+}
+
+//Each work item is one SMA file, converted from the source skeleton onto the current one and written to the output
+//folder under the same name
+void retargetFiles(unsigned begin, unsigned end, void * data) {
+	retargetBatch * batch = (retargetBatch*)data;
+	vector<smaTrack> sourceTracks, targetTracks;
+	vector<smaTangent> sourceTangents, targetTangents;
+	vector<float> rootMotion;
+	vector<int> sourceTrackForTarget;
+
+	for (unsigned item = begin; item < end; item++) {
+		batch->converted[item] = false;
+		if (!readSmaTracks(batch->fileNames[item], &sourceTracks, &sourceTangents, &rootMotion)
+				|| (sourceTracks.size() == 0)) continue;
+
+		sourceTrackForTarget.assign(boneList.size(), -1);
+		for (unsigned i = 0; i < sourceTracks.size(); i++) {
+			unsigned sourceId = sourceTracks[i].boneId;
+			if ((sourceId >= batch->targetIds.size()) || (batch->targetIds[sourceId] < 0)) continue;
+			unsigned targetId = batch->targetIds[sourceId];
+			if (sourceTrackForTarget[targetId] == -1) sourceTrackForTarget[targetId] = i;
+		}
+
+		targetTracks.resize(boneList.size());
+		targetTangents.clear();
+		for (unsigned i = 0; i < boneList.size(); i++) {
+			bone * targetBone = boneList[i];
+			smaTrack * track = &targetTracks[i];
+			track->boneId = targetBone->id;
+			track->animation.name = sourceTracks.front().animation.name;
+			track->animation.length = sourceTracks.front().animation.length;
+			track->animation.frames.clear();
+
+			int sourceTrack = sourceTrackForTarget[targetBone->id];
+			if (sourceTrack == -1) {
+				//Target bones with nothing mapped onto them stay at rest
+				track->animation.frames.push_back((bone::keyFrame){0.0f, 0.0f, 0.0f, 1});
+				continue;
+			}
+
+			unsigned sourceId = sourceTracks[sourceTrack].boneId;
+			float * correction = &(batch->corrections[sourceId*16]),
+				* inverseCorrection = &(batch->inverseCorrections[sourceId*16]);
+			vector<bone::keyFrame> * sourceFrames = &(sourceTracks[sourceTrack].animation.frames);
+			for (unsigned j = 0; j < sourceFrames->size(); j++) {
+				vec3 rotation = (vec3){{(*sourceFrames)[j].xRot}, {(*sourceFrames)[j].yRot}, {(*sourceFrames)[j].zRot}};
+				retargetRotation(targetBone, correction, inverseCorrection, &rotation);
+				track->animation.frames.push_back((bone::keyFrame){rotation.x, rotation.y, rotation.z,
+					(*sourceFrames)[j].step});
+			}
+
+			//Only the tangents of the track used for the keys are kept. Their slopes are in the source's Euler angles,
+			//so each is converted by replaying its key nudged a hundredth of a frame along the slope
+			for (unsigned j = 0; j < sourceTangents.size(); j++) {
+				smaTangent tangent = sourceTangents[j];
+				if (tangent.boneId != sourceId) continue;
+				tangent.boneId = targetBone->id;
+				if (tangent.tangent.mode == TANGENT_USER) {
+					int key = sourceTracks[sourceTrack].animation.frameIndex(tangent.step);
+					if (key == -1) continue;
+					vec3 rotation = (vec3){{(*sourceFrames)[key].xRot}, {(*sourceFrames)[key].yRot},
+						{(*sourceFrames)[key].zRot}};
+					vec3 nudged = (vec3){{rotation.x+(tangent.tangent.slope.x*0.01f)},
+						{rotation.y+(tangent.tangent.slope.y*0.01f)}, {rotation.z+(tangent.tangent.slope.z*0.01f)}};
+					retargetRotation(targetBone, correction, inverseCorrection, &rotation);
+					retargetRotation(targetBone, correction, inverseCorrection, &nudged);
+					tangent.tangent.slope.x = rotationDifference(rotation.x, nudged.x)*100.0f;
+					tangent.tangent.slope.y = rotationDifference(rotation.y, nudged.y)*100.0f;
+					tangent.tangent.slope.z = rotationDifference(rotation.z, nudged.z)*100.0f;
+				}
+				targetTangents.push_back(tangent);
 			}
 		}
-		if (wireframeModeEnabled || skinningEnabled) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-		drawBone(root);
+		string fileName = batch->fileNames[item];
+		fileName = batch->outputDirectory+"/"+rightStr(fileName, fileName.size()-(fileName.find_last_of("/")+1));
+		batch->converted[item] = writeSmaTracks(fileName, &targetTracks, &targetTangents, &rootMotion);
+	}
+}
 
-		if (showArrow) {
-			pushMatrix();
-				applyBoneTransforms(selectedBone);
-				if (showArrowParent) drawArrow(selectedBone->x, selectedBone->y, selectedBone->z, axis);
-					else drawArrow(selectedBone->x+selectedBone->endX, selectedBone->y+selectedBone->endY,
-							selectedBone->z+selectedBone->endZ, axis);
-			popMatrix();
-		} else if (showRing) {
-			pushMatrix();
-				applyBoneTransforms(selectedBone);
-				drawRing(selectedBone->x, selectedBone->y, selectedBone->z, axis);
-			popMatrix();
-		}
-	popMatrix();
+//Converts a batch of SMA files authored on another skeleton so that they play on the current one. Bones are matched
+//by name, with an optional mapping file of "source=target" lines for bones whose names differ
+void retargetAnimations() {
+	PROFILE_SCOPE("retargetAnimations");
+	if (root == NULL) return;
 
-	if (showBox) {
-		pushMatrix();
-			copyMatrix(IDENTITY_MATRIX, MODELVIEW_MATRIX);
-			drawBox(boxStartPosition);
-		popMatrix();
+	vector<string> fileNames = getFileNamesOpen("Source skeleton", "*.sms");
+	if (fileNames.size() == 0) return;
+	retargetBatch batch;
+	if (!readSmsBones(fileNames.front(), &batch.sourceBones)) return;
+
+	map<string, string> nameMapping;
+	fileNames = getFileNamesOpen("Bone name mapping (cancel to match by name)", "*.txt");
+	if (fileNames.size() > 0) {
+		vector<string> text;
+		if (readTextFile(fileNames.front(), &text)) {
+			for (unsigned i = 0; i < text.size(); i++) {
+				size_t pos = text[i].find('=');
+				if (pos == string::npos) continue;
+				nameMapping[lowerCase(text[i].substr(0, pos))] = lowerCase(text[i].substr(pos+1));
+			}
+		}
 	}
 
-	lastMousePosition = (vec2){{mouseX()}, {mouseY()}};
-	refreshScreen();
+	batch.fileNames = getFileNamesOpen("Animations to retarget", "*.sma");
+	if (batch.fileNames.size() > 0) batch.outputDirectory = getFolderName("Folder for the retargeted animations");
+	if ((batch.fileNames.size() == 0) || (batch.outputDirectory == "")) {
+		freeBones(&batch.sourceBones);
+		return;
+	}
 
-	if (executeOpenFile) {
-		openFile();
-		executeOpenFile = false;
+	map<string, bone *> targetBones;
+	for (unsigned i = 0; i < boneList.size(); i++) targetBones[lowerCase(boneList[i]->name)] = boneList[i];
+
+	unsigned sourceIdCount = 0;
+	for (unsigned i = 0; i < batch.sourceBones.size(); i++)
+		sourceIdCount = max(sourceIdCount, (unsigned)batch.sourceBones[i]->id+1);
+	batch.targetIds.assign(sourceIdCount, -1);
+	batch.corrections.resize(sourceIdCount*16);
+	batch.inverseCorrections.resize(sourceIdCount*16);
+	vector<unsigned char> targetMapped(boneList.size(), false);
+	for (unsigned i = 0; i < batch.sourceBones.size(); i++) {
+		bone * sourceBone = batch.sourceBones[i];
+		string name = lowerCase(sourceBone->name);
+		if (nameMapping.find(name) != nameMapping.end()) name = nameMapping[name];
+		map<string, bone *>::iterator it = targetBones.find(name);
+		if (it == targetBones.end()) continue;
+
+		batch.targetIds[sourceBone->id] = it->second->id;
+		targetMapped[it->second->id] = true;
+		restCorrection(sourceBone, it->second, &batch.corrections[sourceBone->id*16],
+				&batch.inverseCorrections[sourceBone->id*16]);
 	}
 
-	return true;
+	batch.converted.resize(batch.fileNames.size());
+	parallelFor(batch.fileNames.size(), 1, retargetFiles, &batch);
+
+	unsigned converted = 0;
+	for (unsigned i = 0; i < batch.converted.size(); i++) if (batch.converted[i]) converted++;
+	stringstream stream(stringstream::in | stringstream::out);
+	stream << " Retargeted " << converted << " of " << batch.fileNames.size() << " animations";
+	string unmapped;
+	for (unsigned i = 0; i < boneList.size(); i++)
+		if (!targetMapped[boneList[i]->id]) unmapped += ((unmapped == "") ? "" : ", ")+boneList[i]->name;
+	if (unmapped != "") stream << ", nothing maps to " << unmapped;
+	gtk_label_set_text(GTK_LABEL(retargetLabel), stream.str().c_str());
+
+	freeBones(&batch.sourceBones);
 }
 
-void removeExcessKeyframes(bone * pBone = NULL) {
-	if (pBone == NULL) pBone = root;
+//Heading (in degrees) of the rotation about the world's vertical axis, taken from where it sends the local z axis
+float matrixHeading(const float * matrix) {
+	if ((abs(matrix[8])+abs(matrix[10])) > 0.0001f) return radToDeg(atan2(matrix[8], matrix[10]));
+	return radToDeg(atan2(-matrix[2], matrix[0]));
+}
 
-	for (unsigned i = 0; i < pBone->animations[currentAnimation].frames.size(); i++)
-		if (pBone->animations[currentAnimation].frames[i].step > animations[currentAnimation].length)
-			pBone->animations[currentAnimation].frames.erase(pBone->animations[currentAnimation].frames.begin()+i);
+//Moves the root bone's heading out of the current animation into a per-frame root motion track, leaving the clip
+//playing on the spot. The track is sampled at every frame so the runtime only has to look it up. Any heading the keys
+//still have is added to an existing track, so extracting again (after editing the keys) never loses what's there
+void extractRootMotion() {
+	if (root == NULL) return;
+	updateTrackCurves();
+
+	vector<float> * rootMotion = &(animations[currentAnimation].rootMotion);
+	bone::animation * pAnimation = &(root->animations[currentAnimation]);
+	trackCurve * curve = findTrackCurve(root, currentAnimation);
+	rootMotion->resize(animations[currentAnimation].length, rootMotion->empty() ? 0.0f : rootMotion->back());
+	float previousHeading = 0.0f;
+	for (unsigned i = 0; i < rootMotion->size(); i++) {
+		vec3 rotation;
+		float matrix[16];
+		sampleAnimation(pAnimation, i+1, &rotation, curve);
+		eulerMatrix(&rotation, matrix);
+		float heading = matrixHeading(matrix);
+		//Kept continuous so that clips which turn all the way round don't jump back by 360 degrees
+		if (i > 0) heading = previousHeading+rotationDifference(previousHeading, heading);
+		(*rootMotion)[i] += heading;
+		previousHeading = heading;
+	}
 
-	for (unsigned i = 0; i < pBone->child.size(); i++) removeExcessKeyframes(pBone->child[i]);
+	vec3 up = (vec3){{0.0f}, {1.0f}, {0.0f}};
+	for (unsigned i = 0; i < pAnimation->frames.size(); i++) {
+		float matrix[16], headingMatrix[16], inPlaceMatrix[16];
+		vec3 rotation = (vec3){{pAnimation->frames[i].xRot}, {pAnimation->frames[i].yRot},
+			{pAnimation->frames[i].zRot}};
+		eulerMatrix(&rotation, matrix);
+		axisAngleMatrix(&up, -degToRad(matrixHeading(matrix)), headingMatrix);
+		multiplyMatrices(headingMatrix, matrix, inPlaceMatrix);
+		eulerFromMatrix(inPlaceMatrix, &rotation);
+		for (short axis = X_AXIS; axis <= Z_AXIS; axis++)
+			clampRotation(root, axis, (axis == X_AXIS) ? &rotation.x : ((axis == Y_AXIS) ? &rotation.y : &rotation.z));
+		pAnimation->frames[i].xRot = rotation.x;
+		pAnimation->frames[i].yRot = rotation.y;
+		pAnimation->frames[i].zRot = rotation.z;
+	}
+
+	tracksChanged();
+	if (mode == ANIMATION_MODE) setBoneRotations(currentFrame);
 }
 
 void updateAnimationLength() {
 	animations[currentAnimation].length = gtk_spin_button_get_value(GTK_SPIN_BUTTON(animationLengthSpinButton));
-	gtk_range_set_range(GTK_RANGE(timeline), 1, animations[currentAnimation].length);
+	gtk_widget_queue_draw(timeline);
 	if ((unsigned)atoi(gtk_entry_get_text(GTK_ENTRY(timelineJumpEntry))) > animations[currentAnimation].length) {
 		stringstream stream(stringstream::in | stringstream::out);
 		stream.setf(ios::fixed, ios::floatfield);
@@ -2167,6 +6738,8 @@ void updateAnimationLength() {
 		gtk_entry_set_text(GTK_ENTRY(timelineJumpEntry), stream.str().c_str());
 	}
 	if (currentFrame > animations[currentAnimation].length) currentFrame = animations[currentAnimation].length;
+	vector<float> * rootMotion = &(animations[currentAnimation].rootMotion);
+	if (rootMotion->size() > 0) rootMotion->resize(animations[currentAnimation].length, rootMotion->back());
 	removeExcessKeyframes();
 	setAnimationMarks(selectedBone);
 }
@@ -2194,22 +6767,66 @@ void timelineJump() {
 		stream << currentFrame;
 		gtk_entry_set_text(GTK_ENTRY(timelineJumpEntry), stream.str().c_str());
 	}
-	gtk_range_set_value(GTK_RANGE(timeline), currentFrame);
+	gtk_widget_queue_draw(timeline);
 
 	setBoneRotations(currentFrame);
 }
 
-void setCurrentFrameFromScale() {
-	currentFrame = gtk_range_get_value(GTK_RANGE(timeline));
-
+void setTimelineJumpText() {
 	stringstream stream(stringstream::in | stringstream::out);
 	stream.setf(ios::fixed, ios::floatfield);
 	stream << currentFrame;
 	gtk_entry_set_text(GTK_ENTRY(timelineJumpEntry), stream.str().c_str());
+}
 
+//The jump entry is left alone during playback, where reformatting it every frame would cost more than the frame
+void setTimelineFrame(unsigned frame) {
+	currentFrame = frame;
+	if (!playAnimation) setTimelineJumpText();
+	gtk_widget_queue_draw(timeline);
 	setBoneRotations(currentFrame);
 }
 
+unsigned timelineFrameAt(GtkWidget * widget, double x) {
+	unsigned first, visible;
+	timelineView(&first, &visible);
+	float frameWidth = float(max(gtk_widget_get_allocated_width(widget)-TIMELINE_NAME_WIDTH, 1))/visible;
+	int offset = floor((x-TIMELINE_NAME_WIDTH)/frameWidth);
+	return first+min((unsigned)max(offset, 0), visible-1);
+}
+
+gboolean timelinePressed(GtkWidget * widget, GdkEventButton * event, gpointer) {
+	if (event->button == 1) setTimelineFrame(timelineFrameAt(widget, event->x));
+	return true;
+}
+
+gboolean timelineDragged(GtkWidget * widget, GdkEventMotion * event, gpointer) {
+	unsigned frame = timelineFrameAt(widget, event->x);
+	if (frame != currentFrame) setTimelineFrame(frame);
+	return true;
+}
+
+//Scrolling pans the visible range, and zooms it around the pointer with control held
+gboolean timelineScrolled(GtkWidget * widget, GdkEventScroll * event, gpointer) {
+	unsigned length = animations[currentAnimation].length, first, visible;
+	timelineView(&first, &visible);
+	if (event->state & GDK_CONTROL_MASK) {
+		unsigned pointerFrame = timelineFrameAt(widget, event->x);
+		float scale = (event->direction == GDK_SCROLL_UP) ? 0.8f : 1.25f;
+		unsigned newVisible = min(max((unsigned)(visible*scale), (unsigned)TIMELINE_MIN_VISIBLE_FRAMES), length);
+		if ((newVisible == visible) && (scale > 1.0f)) newVisible = min(visible+1, length);
+		float pointerFraction = float(pointerFrame-first)/visible;
+		timelineVisibleFrames = newVisible;
+		timelineFirstFrame = max(1, int(pointerFrame)-int(pointerFraction*newVisible));
+	} else {
+		int step = max(1u, visible/10);
+		if (event->direction == GDK_SCROLL_UP) timelineFirstFrame = max(1, int(first)-step);
+			else timelineFirstFrame = first+step;
+	}
+	gtk_widget_queue_draw(widget);
+	return true;
+}
+
 void selectAnimation() {
 	currentAnimation = gtk_spin_button_get_value(GTK_SPIN_BUTTON(animationSelectSpinButton));
 	setAnimationMarks(selectedBone);
@@ -2233,18 +6850,57 @@ void addAnimation() {
 
 void deleteAnimation() {
 	animations.erase(animations.begin()+currentAnimation);
-	for (unsigned i = 0; i < boneList.size(); i++)
+	for (unsigned i = 0; i < boneList.size(); i++) {
 		boneList[i]->animations.erase(boneList[i]->animations.begin()+currentAnimation);
+		vector<trackCurve> * curves = &boneCurves[boneList[i]];
+		if (currentAnimation < curves->size()) curves->erase(curves->begin()+currentAnimation);
+	}
+	tracksChanged();
 	if (currentAnimation > 0) currentAnimation--;
 	if (animations.size() == 0) addAnimation(); else {
 		updateAnimationSpinButtonRange();
 		gtk_spin_button_set_value(GTK_SPIN_BUTTON(animationSelectSpinButton), currentAnimation);
 		selectAnimation();
 	}
+	invalidateAnimationMarks(); //the index may now refer to the next animation, whose tracks can have as many keys
 }
 
 void updateAnimationSpinButtonRange() {
 	gtk_spin_button_set_range(GTK_SPIN_BUTTON(animationSelectSpinButton), 0, animations.size()-1);
+	for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++)
+		gtk_spin_button_set_range(GTK_SPIN_BUTTON(blendAnimationSpinButton[i]), 0, animations.size()-1);
+}
+
+void toggleBlendPreview() {
+	blendPreviewEnabled = !blendPreviewEnabled;
+	if (!blendPreviewEnabled && (root != NULL) && (mode == ANIMATION_MODE)) setBoneRotations(currentFrame);
+}
+
+void updateBlendLayers() {
+	for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++) {
+		blendLayer * layer = &blendLayers[i];
+		layer->enabled = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(blendLayerToggleButton[i]));
+		layer->animationId = gtk_spin_button_get_value(GTK_SPIN_BUTTON(blendAnimationSpinButton[i]));
+		layer->weight = gtk_spin_button_get_value(GTK_SPIN_BUTTON(blendWeightSpinButton[i]));
+		layer->speed = gtk_spin_button_get_value(GTK_SPIN_BUTTON(blendSpeedSpinButton[i]));
+		layer->additive = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(blendAdditiveToggleButton[i]));
+
+		bool synced = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(blendSyncToggleButton[i]));
+		if (layer->synced && !synced && (layer->animationId < animations.size())) layer->frame = blendLayerFrame(layer);
+		layer->synced = synced;
+
+		bool masked = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(blendMaskToggleButton[i]));
+		if (masked != (layer->maskBoneId >= 0)) {
+			layer->maskBoneId = (masked && (selectedBone != NULL)) ? selectedBone->id : -1;
+			layer->maskDirty = true;
+		}
+	}
+}
+
+void fadeBlendLayer(GtkWidget *, blendLayer * layer) {
+	float fadeLength = gtk_spin_button_get_value(GTK_SPIN_BUTTON(blendFadeLengthSpinButton));
+	layer->fadeStep = ((layer->weight < 0.5f) ? 1.0f : -1.0f)/fadeLength;
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(blendLayerToggleButton[layer-blendLayers]), 1);
 }
 
 void switchMode(GtkWidget *, bool * recreateWindow) {
@@ -2271,15 +6927,15 @@ void switchMode(GtkWidget *, bool * recreateWindow) {
 
 		verifyBoneAnimationCounts();
 		setAnimationMarks(selectedBone);
-		animationShader->bind();
+		gtk_widget_show_all(blendWindow);
 	} else {
 		mode = SKELETON_MODE;
 		if (*recreateWindow) animationWindow = createAnimationWindow();
 		gtk_widget_hide(animationWindow);
+		gtk_widget_hide(blendWindow);
 		gtk_widget_show_all(boneWindow);
 		gtk_button_set_label(GTK_BUTTON(switchModeButton), "Animation mode  ->");
 		resetBoneRotations();
-		skeletonShader->bind();
 	}
 	if (playAnimation) gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(playAnimationToggleButton), 0);
 	currentFrame = 1;
@@ -2298,6 +6954,14 @@ GtkWidget * createToolsWindow() {
 	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 3, 1);
 	row++;
 
+	button = gtk_button_new_with_label("Undo");
+	g_signal_connect(button, "clicked", G_CALLBACK(undoEditCallback), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 1, 1);
+	button = gtk_button_new_with_label("Redo");
+	g_signal_connect(button, "clicked", G_CALLBACK(redoEditCallback), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 2, row, 1, 1);
+	row++;
+
 	button = gtk_button_new_with_label("Import file");
 	g_signal_connect(button, "clicked", G_CALLBACK(flagExecuteOpenFile), NULL);
 	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 3, 1);
@@ -2317,6 +6981,15 @@ GtkWidget * createToolsWindow() {
 	gtk_grid_attach(GTK_GRID(grid), button, 2, row+1, 1, 1);
 	row += 2;
 
+	button = gtk_button_new_with_label("Retarget .sma files");
+	g_signal_connect(button, "clicked", G_CALLBACK(retargetAnimations), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 3, 1);
+	row++;
+	retargetLabel = gtk_label_new("");
+	gtk_label_set_line_wrap(GTK_LABEL(retargetLabel), TRUE);
+	gtk_grid_attach(GTK_GRID(grid), retargetLabel, 1, row, 3, 1);
+	row++;
+
 	GtkWidget * label = gtk_label_new("");
 	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
 	row++;
@@ -2326,6 +6999,37 @@ GtkWidget * createToolsWindow() {
 	gtk_grid_attach(GTK_GRID(grid), wireframeToggleButton, 1, row, 3, 1);
 	row++;
 
+	label = gtk_label_new("");
+	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
+	row++;
+	label = gtk_label_new("Level of detail");
+	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
+	row++;
+
+	button = gtk_button_new_with_label("Generate LODs");
+	g_signal_connect(button, "clicked", G_CALLBACK(generateMeshLods), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 1, 1);
+	button = gtk_button_new_with_label("Save LOD .smm");
+	g_signal_connect(button, "clicked", G_CALLBACK(exportMeshLods), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 2, row, 1, 1);
+	row++;
+
+	lodPreviewComboBox = gtk_combo_box_text_new();
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(lodPreviewComboBox), "Auto");
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(lodPreviewComboBox), "Full model");
+	for (unsigned i = 1; i <= LOD_LEVELS; i++) {
+		stringstream text(stringstream::in | stringstream::out);
+		text << "LOD " << i;
+		gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(lodPreviewComboBox), text.str().c_str());
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(lodPreviewComboBox), lodPreview);
+	g_signal_connect(lodPreviewComboBox, "changed", G_CALLBACK(updateLodPreview), NULL);
+	gtk_grid_attach(GTK_GRID(grid), lodPreviewComboBox, 1, row, 3, 1);
+	row++;
+	lodInfoLabel = gtk_label_new("");
+	gtk_grid_attach(GTK_GRID(grid), lodInfoLabel, 1, row, 3, 1);
+	row++;
+
 	label = gtk_label_new("");
 	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
 	row++;
@@ -2372,6 +7076,54 @@ GtkWidget * createToolsWindow() {
 	gtk_grid_attach(GTK_GRID(grid), viewToggleButton[FREE], 1, row, 3, 1);
 	row++;
 
+	button = gtk_toggle_button_new_with_label("Quad view");
+	g_signal_connect(button, "toggled", G_CALLBACK(toggleQuadView), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 3, 1);
+	row++;
+
+	label = gtk_label_new("");
+	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
+	row++;
+
+	label = gtk_label_new("Crowd test (animation mode)");
+	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
+	row++;
+
+	button = gtk_toggle_button_new_with_label("Crowd");
+	g_signal_connect(button, "toggled", G_CALLBACK(toggleCrowd), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 1, 1);
+
+	crowdSizeSpinButton = gtk_spin_button_new_with_range(1, MAX_CROWD_SIZE, 1);
+	gtk_spin_button_set_digits(GTK_SPIN_BUTTON(crowdSizeSpinButton), 0);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(crowdSizeSpinButton), DEFAULT_CROWD_SIZE);
+	g_signal_connect(G_OBJECT(crowdSizeSpinButton), "value-changed", G_CALLBACK(updateCrowdSettings), NULL);
+	gtk_grid_attach(GTK_GRID(grid), crowdSizeSpinButton, 2, row, 1, 1);
+	row++;
+
+	crowdVaryToggleButton = gtk_toggle_button_new_with_label("Vary animations");
+	g_signal_connect(crowdVaryToggleButton, "toggled", G_CALLBACK(updateCrowdSettings), NULL);
+	gtk_grid_attach(GTK_GRID(grid), crowdVaryToggleButton, 1, row, 3, 1);
+	row++;
+
+	crowdTimingLabel = gtk_label_new("");
+	gtk_grid_attach(GTK_GRID(grid), crowdTimingLabel, 1, row, 3, 1);
+	row++;
+
+#ifdef FRAME_PROFILING
+	label = gtk_label_new("");
+	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
+	row++;
+
+	button = gtk_toggle_button_new_with_label("Record trace");
+	g_signal_connect(button, "toggled", G_CALLBACK(toggleProfileRecording), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, row, 3, 1);
+	row++;
+
+	profileLabel = gtk_label_new("");
+	gtk_grid_attach(GTK_GRID(grid), profileLabel, 1, row, 3, 1);
+	row++;
+#endif
+
 	label = gtk_label_new("");
 	gtk_grid_attach(GTK_GRID(grid), label, 1, row, 3, 1);
 	row++;
@@ -2521,7 +7273,7 @@ GtkWidget * createBoneWindow() {
 	gtk_tree_view_append_column(GTK_TREE_VIEW(boneView), column);
 
 	boneSelect = gtk_tree_view_get_selection(GTK_TREE_VIEW(boneView));
-	g_signal_connect(G_OBJECT(boneSelect), "changed", G_CALLBACK(selectBone), NULL);
+	boneSelectHandler = g_signal_connect(G_OBJECT(boneSelect), "changed", G_CALLBACK(selectBone), NULL);
 	gtk_grid_attach(GTK_GRID(grid), boneView, 1, row, 3, 1);
 	row++;
 
@@ -2599,6 +7351,19 @@ GtkWidget * createAnimationWindow() {
 	gtk_grid_attach(GTK_GRID(grid), autoKeyToggleButton, col, 1, 3, 1);
 	col += 3;
 
+	button = gtk_toggle_button_new_with_label("IK drag");
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), ikEnabled);
+	g_signal_connect(button, "toggled", G_CALLBACK(toggleIk), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, col, 1, 3, 1);
+	col += 3;
+
+	ikChainLengthSpinButton = gtk_spin_button_new_with_range(1, MAX_IK_CHAIN_LENGTH, 1);
+	gtk_spin_button_set_digits(GTK_SPIN_BUTTON(ikChainLengthSpinButton), 0);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(ikChainLengthSpinButton), ikChainLength);
+	g_signal_connect(G_OBJECT(ikChainLengthSpinButton), "value-changed", G_CALLBACK(updateIkChainLength), NULL);
+	gtk_grid_attach(GTK_GRID(grid), ikChainLengthSpinButton, col, 1, 2, 1);
+	col += 2;
+
 	playAnimationToggleButton = gtk_toggle_button_new_with_label("Play Animation");
 	playAnimationToggleHandler = g_signal_connect(playAnimationToggleButton, "toggled", G_CALLBACK(togglePlayAnimation),
 			NULL);
@@ -2610,26 +7375,648 @@ GtkWidget * createAnimationWindow() {
 	gtk_grid_attach(GTK_GRID(grid), button, col, 1, 3, 1);
 	col += 3;
 
-	timeline = gtk_hscale_new_with_range(1, 60, 1);
-	g_signal_connect(G_OBJECT(timeline), "value-changed", G_CALLBACK(setCurrentFrameFromScale), NULL);
+	timeline = gtk_drawing_area_new();
+	gtk_widget_set_size_request(timeline, -1, TIMELINE_HEIGHT);
+	gtk_widget_set_hexpand(timeline, true);
+	gtk_widget_add_events(timeline, GDK_BUTTON_PRESS_MASK | GDK_BUTTON1_MOTION_MASK | GDK_SCROLL_MASK);
+	g_signal_connect(G_OBJECT(timeline), "draw", G_CALLBACK(drawTimeline), NULL);
+	g_signal_connect(G_OBJECT(timeline), "button-press-event", G_CALLBACK(timelinePressed), NULL);
+	g_signal_connect(G_OBJECT(timeline), "motion-notify-event", G_CALLBACK(timelineDragged), NULL);
+	g_signal_connect(G_OBJECT(timeline), "scroll-event", G_CALLBACK(timelineScrolled), NULL);
 	gtk_grid_attach(GTK_GRID(grid), timeline, 1, 2, col, 1);
+	timelineRows.clear();
+
+	button = gtk_button_new_with_label("Reduce keys");
+	g_signal_connect(button, "clicked", G_CALLBACK(reduceKeyframes), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 1, 3, 3, 1);
+
+	label = gtk_label_new(" Tolerance (deg): ");
+	gtk_grid_attach(GTK_GRID(grid), label, 4, 3, 3, 1);
+
+	keyReductionToleranceSpinButton = gtk_spin_button_new_with_range(0.0, 45.0, 0.1);
+	gtk_spin_button_set_digits(GTK_SPIN_BUTTON(keyReductionToleranceSpinButton), 2);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(keyReductionToleranceSpinButton), DEFAULT_KEY_REDUCTION_TOLERANCE);
+	gtk_grid_attach(GTK_GRID(grid), keyReductionToleranceSpinButton, 7, 3, 2, 1);
+
+	keyReductionLabel = gtk_label_new("");
+	gtk_grid_attach(GTK_GRID(grid), keyReductionLabel, 9, 3, 8, 1);
+
+	tangentModeComboBox = gtk_combo_box_text_new();
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(tangentModeComboBox), "Auto");
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(tangentModeComboBox), "Linear");
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(tangentModeComboBox), "Stepped");
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(tangentModeComboBox), "User");
+	gtk_combo_box_set_active(GTK_COMBO_BOX(tangentModeComboBox), TANGENT_AUTO);
+	gtk_grid_attach(GTK_GRID(grid), tangentModeComboBox, 17, 3, 3, 1);
+
+	for (short i = X_AXIS; i <= Z_AXIS; i++) {
+		tangentSlopeSpinButton[i] = gtk_spin_button_new_with_range(-360.0, 360.0, 0.1);
+		gtk_spin_button_set_digits(GTK_SPIN_BUTTON(tangentSlopeSpinButton[i]), 2);
+		gtk_spin_button_set_value(GTK_SPIN_BUTTON(tangentSlopeSpinButton[i]), 0.0);
+		gtk_grid_attach(GTK_GRID(grid), tangentSlopeSpinButton[i], 20+(i*2), 3, 2, 1);
+	}
+
+	button = gtk_button_new_with_label("Set tangent");
+	g_signal_connect(button, "clicked", G_CALLBACK(setKeyTangent), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 26, 3, 3, 1);
+
+	button = gtk_button_new_with_label("Extract root motion");
+	g_signal_connect(button, "clicked", G_CALLBACK(extractRootMotion), NULL);
+	gtk_grid_attach(GTK_GRID(grid), button, 29, 3, 3, 1);
+
+	gtk_container_add(GTK_CONTAINER(window), grid);
+
+	return window;
+}
+
+GtkWidget * createBlendWindow() {
+	GtkWidget * window = gtk_window_new(GTK_WINDOW_TOPLEVEL), * grid = gtk_grid_new(), * label, * button;
+	gtk_window_set_title(GTK_WINDOW(window), "Blending");
+	gtk_window_set_resizable(GTK_WINDOW(window), false);
+	g_signal_connect(window, "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+
+	int row = 1;
+
+	blendPreviewToggleButton = gtk_toggle_button_new_with_label("Preview blend");
+	g_signal_connect(blendPreviewToggleButton, "toggled", G_CALLBACK(toggleBlendPreview), NULL);
+	gtk_grid_attach(GTK_GRID(grid), blendPreviewToggleButton, 1, row, 2, 1);
+
+	label = gtk_label_new("Fade length: ");
+	gtk_grid_attach(GTK_GRID(grid), label, 3, row, 2, 1);
+
+	blendFadeLengthSpinButton = gtk_spin_button_new_with_range(1, 999, 1);
+	gtk_spin_button_set_digits(GTK_SPIN_BUTTON(blendFadeLengthSpinButton), 0);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(blendFadeLengthSpinButton), DEFAULT_BLEND_FADE_FRAMES);
+	gtk_grid_attach(GTK_GRID(grid), blendFadeLengthSpinButton, 5, row, 1, 1);
+	row++;
+
+	label = gtk_label_new("Animation");
+	gtk_grid_attach(GTK_GRID(grid), label, 2, row, 1, 1);
+	label = gtk_label_new("Weight");
+	gtk_grid_attach(GTK_GRID(grid), label, 3, row, 1, 1);
+	label = gtk_label_new("Speed");
+	gtk_grid_attach(GTK_GRID(grid), label, 4, row, 1, 1);
+	row++;
+
+	for (unsigned i = 0; i < BLEND_LAYER_COUNT; i++) {
+		stringstream stream(stringstream::in | stringstream::out);
+		stream << "Layer " << i;
+		blendLayerToggleButton[i] = gtk_toggle_button_new_with_label(stream.str().c_str());
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(blendLayerToggleButton[i]), blendLayers[i].enabled);
+		g_signal_connect(blendLayerToggleButton[i], "toggled", G_CALLBACK(updateBlendLayers), NULL);
+		gtk_grid_attach(GTK_GRID(grid), blendLayerToggleButton[i], 1, row, 1, 1);
+
+		blendAnimationSpinButton[i] = gtk_spin_button_new_with_range(0, 0, 1);
+		gtk_spin_button_set_digits(GTK_SPIN_BUTTON(blendAnimationSpinButton[i]), 0);
+		g_signal_connect(G_OBJECT(blendAnimationSpinButton[i]), "value-changed", G_CALLBACK(updateBlendLayers), NULL);
+		gtk_grid_attach(GTK_GRID(grid), blendAnimationSpinButton[i], 2, row, 1, 1);
+
+		blendWeightSpinButton[i] = gtk_spin_button_new_with_range(0.0, 1.0, 0.05);
+		gtk_spin_button_set_digits(GTK_SPIN_BUTTON(blendWeightSpinButton[i]), 2);
+		gtk_spin_button_set_value(GTK_SPIN_BUTTON(blendWeightSpinButton[i]), blendLayers[i].weight);
+		blendWeightSpinHandler[i] = g_signal_connect(G_OBJECT(blendWeightSpinButton[i]), "value-changed",
+				G_CALLBACK(updateBlendLayers), NULL);
+		gtk_grid_attach(GTK_GRID(grid), blendWeightSpinButton[i], 3, row, 1, 1);
+
+		blendSpeedSpinButton[i] = gtk_spin_button_new_with_range(-4.0, 4.0, 0.1);
+		gtk_spin_button_set_digits(GTK_SPIN_BUTTON(blendSpeedSpinButton[i]), 1);
+		gtk_spin_button_set_value(GTK_SPIN_BUTTON(blendSpeedSpinButton[i]), blendLayers[i].speed);
+		g_signal_connect(G_OBJECT(blendSpeedSpinButton[i]), "value-changed", G_CALLBACK(updateBlendLayers), NULL);
+		gtk_grid_attach(GTK_GRID(grid), blendSpeedSpinButton[i], 4, row, 1, 1);
+
+		blendSyncToggleButton[i] = gtk_toggle_button_new_with_label("Sync");
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(blendSyncToggleButton[i]), blendLayers[i].synced);
+		g_signal_connect(blendSyncToggleButton[i], "toggled", G_CALLBACK(updateBlendLayers), NULL);
+		gtk_grid_attach(GTK_GRID(grid), blendSyncToggleButton[i], 5, row, 1, 1);
+
+		blendAdditiveToggleButton[i] = gtk_toggle_button_new_with_label("Additive");
+		g_signal_connect(blendAdditiveToggleButton[i], "toggled", G_CALLBACK(updateBlendLayers), NULL);
+		gtk_grid_attach(GTK_GRID(grid), blendAdditiveToggleButton[i], 6, row, 1, 1);
+
+		blendMaskToggleButton[i] = gtk_toggle_button_new_with_label("Mask to bone");
+		g_signal_connect(blendMaskToggleButton[i], "toggled", G_CALLBACK(updateBlendLayers), NULL);
+		gtk_grid_attach(GTK_GRID(grid), blendMaskToggleButton[i], 7, row, 1, 1);
+
+		button = gtk_button_new_with_label("Fade");
+		g_signal_connect(button, "clicked", G_CALLBACK(fadeBlendLayer), &blendLayers[i]);
+		gtk_grid_attach(GTK_GRID(grid), button, 8, row, 1, 1);
+		row++;
+	}
 
 	gtk_container_add(GTK_CONTAINER(window), grid);
 
 	return window;
 }
 
+#ifdef EDITOR_BENCHMARKS
+void benchmarkResult(const char * name, benchmarkCase * testCase, vector<double> * times) {
+	if (times->empty()) return;
+	sort(times->begin(), times->end());
+	double total = 0.0;
+	for (unsigned i = 0; i < times->size(); i++) total += (*times)[i];
+
+	stringstream stream(stringstream::in | stringstream::out);
+	stream.setf(ios::fixed, ios::floatfield);
+	stream.precision(4);
+	stream << "{\"benchmark\":\"" << name << "\",\"bones\":" << testCase->bones << ",\"depth\":" << testCase->depth
+			<< ",\"keys\":" << testCase->keys << ",\"vertices\":" << testCase->vertices << ",\"iterations\":"
+			<< times->size() << ",\"min_ms\":" << times->front() << ",\"median_ms\":" << (*times)[times->size()/2]
+			<< ",\"mean_ms\":" << total/times->size() << ",\"bone_pool\":" << (bonePoolEnabled ? "true" : "false")
+			<< "}";
+	cout << stream.str() << endl;
+	times->clear();
+}
+
+bool benchmarkRepeat(gint64 startTime, vector<double> * times) {
+	return (times->size() < BENCHMARK_MAX_ITERATIONS)
+			&& ((times->size() < 3) || (g_get_monotonic_time()-startTime < BENCHMARK_MIN_TIME));
+}
+
+double benchmarkMilliseconds(gint64 startTime) {
+	return (g_get_monotonic_time()-startTime)/1000.0;
+}
+
+//Bones hang off the root in chains depth bones long, with one key on every frame of a single animation
+void buildBenchmarkSkeleton(benchmarkCase * testCase) {
+	resetBones();
+	resetAnimations();
+	animations[0].length = testCase->keys;
+
+	root = allocateBone();
+	initBone(root);
+	root->endY = 1.0f;
+	vector<bone *> bones(1, root);
+	for (unsigned i = 1; i < testCase->bones; i++) {
+		bone * parentBone = (((i-1)%testCase->depth) == 0) ? root : bones.back();
+		bone * newBone = allocateBone();
+		initBone(newBone, parentBone);
+		parentBone->child.push_back(newBone);
+		newBone->x = parentBone->x+parentBone->endX;
+		newBone->y = parentBone->y+parentBone->endY;
+		newBone->z = parentBone->z+parentBone->endZ;
+		newBone->endX = ((i%3) == 0) ? 0.5f : 0.0f;
+		newBone->endY = 1.0f;
+		bones.push_back(newBone);
+	}
+	selectedBone = root;
+	verifyBoneAnimationCounts();
+
+	for (unsigned i = 0; i < boneList.size(); i++) {
+		bone::animation * pAnimation = &(boneList[i]->animations[0]);
+		pAnimation->length = testCase->keys;
+		pAnimation->frames.resize(testCase->keys);
+		for (unsigned j = 0; j < testCase->keys; j++)
+			pAnimation->frames[j] = (bone::keyFrame){float(rand()%90), float(rand()%90), float(rand()%90), j+1};
+	}
+	tracksChanged();
+}
+
+void shuffleBenchmarkKeys() {
+	for (unsigned i = 0; i < boneList.size(); i++)
+		random_shuffle(boneList[i]->animations[0].frames.begin(), boneList[i]->animations[0].frames.end());
+}
+
+//A flat grid of vertices/3 unconnected triangles, written out as an .obj and loaded the same way openFile does
+bool loadBenchmarkMesh(unsigned vertexCount, string directory) {
+	ofstream file;
+	file.open((directory+"benchmark.mtl").c_str());
+	file << "newmtl benchmark\nKa 0.2 0.2 0.2\nKd 0.8 0.8 0.8\nKs 0 0 0\nNs 10\nd 1\n";
+	file.close();
+
+	unsigned triangleCount = vertexCount/3, gridWidth = ceil(sqrt(float(triangleCount)));
+	float cellSize = 40.0f/gridWidth;
+	file.open((directory+"benchmark.obj").c_str());
+	file << "mtllib benchmark.mtl\nvn 0 0 1\nusemtl benchmark\n";
+	for (unsigned i = 0; i < triangleCount; i++) {
+		float x = (float(i%gridWidth)*cellSize)-20.0f, y = (float(i/gridWidth)*cellSize)-20.0f;
+		file << "v " << x << " " << y << " 0\nv " << x+cellSize << " " << y << " 0\nv " << x << " " << y+cellSize
+				<< " 0\n";
+	}
+	for (unsigned i = 0; i < triangleCount; i++)
+		file << "f " << (i*3)+1 << "//1 " << (i*3)+2 << "//1 " << (i*3)+3 << "//1\n";
+	file.close();
+
+	destroyMeshLods();
+	destroyMeshClusters();
+	if (loadedModel != NULL) delete loadedModel;
+	loadedModel = new Model("model", directory, "benchmark.obj", 60, DYNAMIC_DRAW, bufferObj);
+	pickMeshDirty = true;
+	return loadedModel->vertexCount() > 0;
+}
+
+//Keeps the CPU side of the VBO edits while leaving out the driver
+void APIENTRY benchmarkBufferSubData(GLenum, GLintptr, GLsizeiptr, const GLvoid *) {}
+
+void APIENTRY benchmarkGetBufferSubData(GLenum, GLintptr, GLsizeiptr size, GLvoid * data) {
+	fill((char *)data, (char *)data+size, 0);
+}
+
+void runSkeletonBenchmarks(benchmarkCase * testCase, string directory) {
+	vector<double> times;
+	gint64 startTime;
+	buildBenchmarkSkeleton(testCase);
+
+	setBoneRotations(1.0f);
+	startTime = g_get_monotonic_time();
+	for (unsigned i = 0; benchmarkRepeat(startTime, &times); i++) {
+		gint64 iterationStart = g_get_monotonic_time();
+		setBoneRotations(1.0f+float((i*7)%testCase->keys)+0.5f);
+		times.push_back(benchmarkMilliseconds(iterationStart));
+	}
+	benchmarkResult("setBoneRotations", testCase, &times);
+
+	vector<float> matrices(boneList.size()*16);
+	startTime = g_get_monotonic_time();
+	while (benchmarkRepeat(startTime, &times)) {
+		gint64 iterationStart = g_get_monotonic_time();
+		addBoneMatrices(&matrices, root, NULL);
+		times.push_back(benchmarkMilliseconds(iterationStart));
+	}
+	benchmarkResult("addBoneMatrices", testCase, &times);
+
+	startTime = g_get_monotonic_time();
+	for (unsigned i = 0; benchmarkRepeat(startTime, &times); i++) {
+		currentFrame = 1+((i*13)%testCase->keys);
+		for (unsigned j = 0; j < boneList.size(); j++) boneList[j]->xRot = float(i%90);
+		gint64 iterationStart = g_get_monotonic_time();
+		setKeyframe();
+		times.push_back(benchmarkMilliseconds(iterationStart));
+	}
+	currentFrame = 1;
+	benchmarkResult("setKeyframe", testCase, &times);
+
+	startTime = g_get_monotonic_time();
+	while (benchmarkRepeat(startTime, &times)) {
+		shuffleBenchmarkKeys();
+		gint64 iterationStart = g_get_monotonic_time();
+		sortBoneAnimationFrames();
+		times.push_back(benchmarkMilliseconds(iterationStart));
+	}
+	benchmarkResult("sortBoneAnimationFrames", testCase, &times);
+
+	string smsFileName = directory+"benchmark.sms", smaFileName = directory+"benchmark.sma";
+	startTime = g_get_monotonic_time();
+	exportSms(smsFileName);
+	times.push_back(benchmarkMilliseconds(startTime));
+	benchmarkResult("exportSms", testCase, &times);
+
+	startTime = g_get_monotonic_time();
+	exportSma(smaFileName);
+	times.push_back(benchmarkMilliseconds(startTime));
+	benchmarkResult("exportSma", testCase, &times);
+
+	resetBones();
+	resetAnimations();
+	startTime = g_get_monotonic_time();
+	loadSms(smsFileName);
+	times.push_back(benchmarkMilliseconds(startTime));
+	benchmarkResult("loadSms", testCase, &times);
+
+	startTime = g_get_monotonic_time();
+	loadSma(smaFileName);
+	times.push_back(benchmarkMilliseconds(startTime));
+	benchmarkResult("loadSma", testCase, &times);
+
+	if (root != NULL) {
+		startTime = g_get_monotonic_time();
+		deleteBone(root);
+		times.push_back(benchmarkMilliseconds(startTime));
+		benchmarkResult("deleteBone", testCase, &times);
+	}
+	resetBones();
+	resetAnimations();
+
+	loadSms(smsFileName);
+	loadSma(smaFileName);
+	startTime = g_get_monotonic_time();
+	resetBones();
+	times.push_back(benchmarkMilliseconds(startTime));
+	benchmarkResult("resetBones", testCase, &times);
+	resetAnimations();
+	remove(smsFileName.c_str());
+	remove(smaFileName.c_str());
+}
+
+void runMeshBenchmarks(benchmarkCase * testCase, string directory) {
+	vector<double> times;
+	gint64 startTime;
+	buildBenchmarkSkeleton(testCase);
+	if (!loadBenchmarkMesh(testCase->vertices, directory)) return;
+
+	PFNGLBUFFERSUBDATAPROC bufferSubData = __glewBufferSubData;
+	PFNGLGETBUFFERSUBDATAPROC getBufferSubData = __glewGetBufferSubData;
+	__glewBufferSubData = benchmarkBufferSubData;
+	__glewGetBufferSubData = benchmarkGetBufferSubData;
+
+	//Box select the middle of the viewport
+	setMousePosition((screenWidth()*3)/4, (screenHeight()*3)/4);
+	vec2 boxStartPosition = (vec2){{float(screenWidth()/4)}, {float(screenHeight()/4)}};
+	startTime = g_get_monotonic_time();
+	while (benchmarkRepeat(startTime, &times)) {
+		gint64 iterationStart = g_get_monotonic_time();
+		selectVertices(boxStartPosition);
+		times.push_back(benchmarkMilliseconds(iterationStart));
+	}
+	benchmarkResult("selectVertices", testCase, &times);
+
+	string smmFileName = directory+"benchmark.smm";
+	startTime = g_get_monotonic_time();
+	exportSmm(smmFileName);
+	times.push_back(benchmarkMilliseconds(startTime));
+	benchmarkResult("exportSmm", testCase, &times);
+
+	startTime = g_get_monotonic_time();
+	deleteBone(root);
+	times.push_back(benchmarkMilliseconds(startTime));
+	benchmarkResult("deleteBone", testCase, &times);
+
+	__glewBufferSubData = bufferSubData;
+	__glewGetBufferSubData = getBufferSubData;
+	resetAll();
+	remove(smmFileName.c_str());
+	remove((directory+"benchmark.obj").c_str());
+	remove((directory+"benchmark.mtl").c_str());
+}
+
+void runBenchmarks() {
+	gchar * gDirectory = g_dir_make_tmp("modelanimator-benchmark-XXXXXX", NULL);
+	if (gDirectory == NULL) {
+		cout << "Could not create a directory for the benchmark files" << endl;
+		return;
+	}
+	string directory = string(gDirectory)+"/";
+	srand(1);
+
+	unsigned boneCounts[] = {10, 100, 1000, 10000}, depths[] = {4, 64}, keyCounts[] = {10, 100, 1000, 10000},
+		vertexCounts[] = {10002, 100002, 1000002, 5000001};
+	//Once allocating each bone on its own, as the editor used to, then from the pool
+	for (short pool = 0; pool < 2; pool++) {
+		bonePoolEnabled = (pool == 1);
+		for (short i = 0; i < 4; i++) {
+			for (short j = 0; j < 2; j++) {
+				for (short k = 0; k < 4; k++) {
+					if (boneCounts[i]*keyCounts[k] > BENCHMARK_MAX_TOTAL_KEYS) continue;
+					benchmarkCase testCase = {boneCounts[i], min(depths[j], boneCounts[i]), keyCounts[k], 0};
+					runSkeletonBenchmarks(&testCase, directory);
+				}
+			}
+		}
+	}
+	for (short i = 0; i < 4; i++) {
+		benchmarkCase testCase = {BENCHMARK_MESH_BONES, 4, 10, vertexCounts[i]};
+		runMeshBenchmarks(&testCase, directory);
+	}
+
+	remove(gDirectory);
+	g_free(gDirectory);
+}
+#endif
+
+struct headlessFrame {
+	string fileName;
+	vector<unsigned char> pixels; //RGBA with the rows bottom up, as read from the framebuffer
+};
+
+struct headlessBatch {
+	vector<headlessFrame> frames;
+	unsigned width, height;
+	bool png;
+	gint failures;
+};
+
+//Drops the alpha and flips the rows, since the framebuffer's run bottom up
+void flipHeadlessFrame(headlessBatch * batch, const unsigned char * source, unsigned char * image) {
+	for (unsigned y = 0; y < batch->height; y++) {
+		const unsigned char * row = &source[(batch->height-1-y)*batch->width*4];
+		for (unsigned x = 0; x < batch->width; x++) {
+			for (short i = 0; i < 3; i++) image[(((y*batch->width)+x)*3)+i] = row[(x*4)+i];
+		}
+	}
+}
+
+void encodeHeadlessFrames(unsigned begin, unsigned end, void * data) {
+	headlessBatch * batch = (headlessBatch *)data;
+	vector<unsigned char> image(batch->width*batch->height*3);
+	for (unsigned i = begin; i < end; i++) {
+		headlessFrame * frame = &(batch->frames[i]);
+		flipHeadlessFrame(batch, &(frame->pixels[0]), &image[0]);
+		bool saved;
+		if (batch->png) {
+			GdkPixbuf * pixbuf = gdk_pixbuf_new_from_data(&image[0], GDK_COLORSPACE_RGB, false, 8, batch->width,
+					batch->height, batch->width*3, NULL, NULL);
+			saved = gdk_pixbuf_save(pixbuf, frame->fileName.c_str(), "png", NULL, NULL);
+			g_object_unref(pixbuf);
+		} else {
+			ofstream file;
+			file.open(frame->fileName.c_str(), ios::out | ios::binary);
+			file << "P6\n" << batch->width << " " << batch->height << "\n255\n";
+			file.write((const char *)&image[0], image.size());
+			saved = file.good();
+			file.close();
+		}
+		if (!saved) g_atomic_int_inc(&(batch->failures));
+	}
+}
+
+//Frames the model (or the skeleton, if there is no model) at rest so that it fills a view of the given size from the
+//current angle
+void fitHeadlessView(unsigned width, unsigned height) {
+	float bounds[6];
+	emptyBounds(bounds);
+	if (loadedModel != NULL) {
+		for (unsigned i = 0; i < loadedModel->triangles()->size(); i++) {
+			for (short j = 0; j < 3; j++) {
+				vertex * coords = &((*(loadedModel->triangles()))[i].coords[j]);
+				float pointBounds[6] = {coords->x, coords->y, coords->z, coords->x, coords->y, coords->z};
+				unionBounds(bounds, pointBounds);
+			}
+		}
+	} else {
+		for (unsigned i = 0; i < boneList.size(); i++) {
+			bone * pBone = boneList[i];
+			float pointBounds[6] = {pBone->x, pBone->y, pBone->z, pBone->x, pBone->y, pBone->z},
+				endBounds[6] = {pBone->x+pBone->endX, pBone->y+pBone->endY, pBone->z+pBone->endZ,
+					pBone->x+pBone->endX, pBone->y+pBone->endY, pBone->z+pBone->endZ};
+			unionBounds(bounds, pointBounds);
+			unionBounds(bounds, endBounds);
+		}
+	}
+	if (bounds[0] > bounds[3]) return;
+
+	float radius = sqrt(((bounds[3]-bounds[0])*(bounds[3]-bounds[0]))+((bounds[4]-bounds[1])*(bounds[4]-bounds[1]))
+			+((bounds[5]-bounds[2])*(bounds[5]-bounds[2])))/2.0f, rotationMatrix[16];
+	zoom = (radius > 0.0f) ? (min(width, height)*HEADLESS_FILL)/(radius*2.0f) : DEFAULT_ZOOM;
+	vec3 rotation = (vec3){{xRotation}, {yRotation}, {0.0f}}, center;
+	eulerMatrix(&rotation, rotationMatrix);
+	transformPoint(rotationMatrix, (bounds[0]+bounds[3])/2.0f, (bounds[1]+bounds[4])/2.0f, (bounds[2]+bounds[5])/2.0f,
+			&center);
+	viewTranslation = (vec2){{-center.x}, {-center.y}};
+}
+
+bool parseHeadlessViews(string names, vector<viewOrientationEnum> * views) {
+	const char * viewNames[] = {"top", "bottom", "left", "right", "front", "back"};
+	views->clear();
+	stringstream stream(names, stringstream::in);
+	for (string name; getline(stream, name, ',');) {
+		short i = 0;
+		for (; (i < FREE) && (name != viewNames[i]); i++);
+		if (i == FREE) return false;
+		views->push_back(viewOrientationArr[i]);
+	}
+	return !views->empty();
+}
+
+//Renders animations to numbered images without showing the editor, for thumbnails and image-diff tests:
+//	--render <output directory> <model, .sms and .sma files>... [--views=front,top,...] [--size=<width>x<height>]
+//		[--format=ppm|png] [--animation=<name>] [--step=<frames>] [--skeleton]
+//Frames are drawn at the output size into a framebuffer object rather than the window, but the GL context still comes
+//from initDisplay, which opens the window. Machines without a GPU or a display can run it under Xvfb with Mesa's
+//software rasteriser (LIBGL_ALWAYS_SOFTWARE=1). Each batch of frames is encoded on the worker threads
+int runHeadlessRender(int argc, char * argv[]) {
+	if (argc < 2) {
+		cout << "Usage: --render <output directory> <files>... [--views=front,top,...] [--size=<width>x<height>]"
+				" [--format=ppm|png] [--animation=<name>] [--step=<frames>] [--skeleton]" << endl;
+		return 1;
+	}
+	string directory = argv[0], animationName;
+	vector<viewOrientationEnum> views(1, FRONT);
+	unsigned width = screenWidth(), height = screenHeight(), step = 1;
+	bool png = false, skeleton = false;
+	for (int i = 1; i < argc; i++) {
+		string argument = argv[i], value = argument.substr(argument.find('=')+1);
+		if (leftStr(argument, 8) == "--views=") {
+			if (!parseHeadlessViews(value, &views)) {
+				cout << "Unknown view in " << value << endl;
+				return 1;
+			}
+		} else if (leftStr(argument, 7) == "--size=") {
+			if ((sscanf(value.c_str(), "%ux%u", &width, &height) != 2) || (width == 0) || (height == 0)) {
+				cout << "Invalid size " << value << endl;
+				return 1;
+			}
+		} else if (leftStr(argument, 9) == "--format=") {
+			if ((value != "png") && (value != "ppm")) {
+				cout << "Unknown format " << value << endl;
+				return 1;
+			}
+			png = (value == "png");
+		} else if (leftStr(argument, 12) == "--animation=") {
+			animationName = value;
+		} else if (leftStr(argument, 7) == "--step=") {
+			step = max(atoi(value.c_str()), 1);
+		} else if (argument == "--skeleton") {
+			skeleton = true;
+		} else if (!loadFile(argument)) return 1;
+	}
+	if ((loadedModel == NULL) && (root == NULL)) {
+		cout << "Nothing to render" << endl;
+		return 1;
+	}
+	g_mkdir_with_parents(directory.c_str(), 0755);
+
+	if (root != NULL) {
+		mode = ANIMATION_MODE;
+		verifyBoneAnimationCounts();
+	}
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxSize);
+	GLuint renderbuffers[2], framebuffer = 0;
+	if ((width <= (unsigned)maxSize) && (height <= (unsigned)maxSize))
+		framebuffer = createRenderTarget(width, height, renderbuffers);
+	if (framebuffer == 0) {
+		cout << "Could not create a " << width << "x" << height << " framebuffer to render into" << endl;
+		return 1;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	headlessBatch batch;
+	batch.width = width;
+	batch.height = height;
+	batch.png = png;
+	batch.failures = 0;
+	const char * viewNames[] = {"top", "bottom", "left", "right", "front", "back"};
+	unsigned rendered = 0;
+	for (unsigned i = 0; i < animations.size(); i++) {
+		if ((animationName != "") && (animations[i].name != animationName)) continue;
+		currentAnimation = i;
+		for (unsigned j = 0; j < views.size(); j++) {
+			setViewOrientation(NULL, &views[j]);
+			fitHeadlessView(width, height);
+			unsigned frameCount = (root == NULL) ? 1 : animations[i].length;
+			for (unsigned frame = 1; frame <= frameCount; frame += step) {
+				if (root != NULL) {
+					currentFrame = frame;
+					setBoneRotations(frame);
+				}
+				frameSnapshot * snapshot = newFrameSnapshot();
+				snapshot->showSkeleton = skeleton || (loadedModel == NULL);
+				snapshot->viewWidth = width;
+				snapshot->viewHeight = height;
+				addSceneToSnapshot(snapshot);
+				drawFrame(snapshot);
+				delete snapshot;
+
+				stringstream fileName(stringstream::in | stringstream::out);
+				fileName << directory << "/" << animations[i].name << "_" << viewNames[views[j]] << "_" << setw(4)
+						<< setfill('0') << frame << (png ? ".png" : ".ppm");
+				batch.frames.push_back(headlessFrame());
+				batch.frames.back().fileName = fileName.str();
+				batch.frames.back().pixels.resize(width*height*4);
+				glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &(batch.frames.back().pixels[0]));
+
+				bool lastFrame = ((frame+step) > frameCount) && ((j+1) == views.size());
+				if ((batch.frames.size() == HEADLESS_BATCH_FRAMES) || lastFrame) {
+					parallelFor(batch.frames.size(), 1, encodeHeadlessFrames, &batch);
+					rendered += batch.frames.size();
+					batch.frames.clear();
+				}
+			}
+		}
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, screenWidth(), screenHeight());
+	glDeleteRenderbuffers(2, renderbuffers);
+	glDeleteFramebuffers(1, &framebuffer);
+	cout << "Rendered " << rendered-batch.failures << " frames to " << directory << endl;
+	if (batch.failures > 0) cout << batch.failures << " frames could not be written" << endl;
+	return ((rendered == 0) || (batch.failures > 0)) ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
+	XInitThreads(); //the render thread makes GLX calls alongside GTK's, so Xlib has to be told before anything else
 	gtk_init(&argc, &argv);
 
 	createGlWindow();
 	animations.push_back((animationDetail){"animation0", 60});
 
-	gtk_widget_show_all(createToolsWindow());
+	GtkWidget * toolsWindow = createToolsWindow();
 	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(viewToggleButton[FRONT]), 1);
 
 	boneWindow = createBoneWindow();
 	animationWindow = createAnimationWindow();
+	initBlendLayers();
+	blendWindow = createBlendWindow();
+
+	if ((argc > 1) && (string(argv[1]) == "--render")) {
+		stopRenderThread(); //frames are read back as soon as they are drawn, so the context stays on this thread
+		int result = runHeadlessRender(argc-2, argv+2);
+		destroyGlWindow();
+		return result;
+	}
+
+#ifdef EDITOR_BENCHMARKS
+	if ((argc > 1) && (string(argv[1]) == "--benchmark")) {
+		stopRenderThread(); //the benchmarks time the editor code directly, so they keep the context on this thread
+		runBenchmarks();
+		destroyGlWindow();
+		return 0;
+	}
+#endif
+
+	gtk_widget_show_all(toolsWindow);
 	gtk_widget_show_all(boneWindow);
 
 	gtk_main();
@@ -3,13 +3,12 @@
 flat in vec3 fragAmbientColor;
 smooth in vec3 fragDiffuseColor;
 flat in vec3 fragSpecularColor;
+flat in float fragSelected;
 
 out vec4 fragColor;
 
-uniform int selected;
-
 void main(void) {
   fragColor = vec4(fragAmbientColor, 1.0);
   fragColor += vec4(fragDiffuseColor, 1.0);
-  fragColor *= mix(vec4(1.0), vec4(1.0, 0.0, 0.0, 1.0), selected);
+  fragColor *= mix(vec4(1.0), vec4(1.0, 0.0, 0.0, 1.0), fragSelected);
 }
@@ -14,24 +14,27 @@ in float alpha;
 flat out vec3 fragAmbientColor;
 smooth out vec3 fragDiffuseColor;
 flat out vec3 fragSpecularColor;
+flat out float fragSelected;
 
 uniform mat4 modelviewMatrix;
 uniform mat4 projectionMatrix;
-uniform vec4 endVertex;
-uniform mat4 boneModelviewMatrix;
+uniform samplerBuffer boneInstances;
 
 void main(void) {
-  vec3 surfaceNormal = vec3(modelviewMatrix*vec4(normal, 0.0));
+  //Each bone is 5 texels: the matrix placing the bone model, then its end point with the selected flag in w
+  int texel = gl_InstanceID*5;
+  mat4 meshMatrix = mat4(texelFetch(boneInstances, texel), texelFetch(boneInstances, texel+1),
+    texelFetch(boneInstances, texel+2), texelFetch(boneInstances, texel+3));
+  vec4 endVertex = texelFetch(boneInstances, texel+4);
+
+  vec3 surfaceNormal = vec3(modelviewMatrix*(meshMatrix*vec4(normal, 0.0)));
   float diff = max(0.0, dot(normalize(surfaceNormal), normalize(vec3(0.0, 50.0, 100.0))));
   fragAmbientColor = ambientColor;
   fragDiffuseColor = diffuseColor*diff;
   fragSpecularColor = specularColor;
+  fragSelected = endVertex.w;
 
-  mat4 matrixToUse = modelviewMatrix;
-  vec4 vertexToUse = vec4(vertex.xyz, 1.0);
-  if (vertexToUse.y > 1.0) {
-    vertexToUse = endVertex;
-    matrixToUse = boneModelviewMatrix;
-  }
-  gl_Position = projectionMatrix*(matrixToUse*vertexToUse);
+  vec4 vertexToUse = meshMatrix*vec4(vertex.xyz, 1.0);
+  if (vertex.y > 1.0) vertexToUse = vec4(endVertex.xyz, 1.0);
+  gl_Position = projectionMatrix*(modelviewMatrix*vertexToUse);
 }
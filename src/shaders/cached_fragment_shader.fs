@@ -0,0 +1,7 @@
+#version 150
+
+out vec4 fragColor;
+
+void main(void) {
+  fragColor = vec4(1.0);
+}
@@ -0,0 +1,7 @@
+#version 150
+
+in vec4 vertex;
+
+void main(void) {
+  gl_Position = vertex;
+}
@@ -0,0 +1,52 @@
+#version 150
+
+in vec4 vertex;
+in vec3 normal;
+in vec3 ambientColor;
+in vec3 diffuseColor;
+in vec3 specularColor;
+in vec3 texCoords;
+in float mtlNum;
+in float hasTexture;
+in float shininess;
+in float alpha;
+in float boneId;
+
+flat out vec3 fragAmbientColor;
+smooth out vec3 fragDiffuseColor;
+flat out vec3 fragSpecularColor;
+smooth out vec2 fragTexCoords;
+flat out float fragMtlNum;
+flat out int fragHasTexture;
+flat out float fragShininess;
+flat out float fragAlpha;
+flat out float fragBoneId;
+
+uniform mat4 modelviewMatrix;
+uniform mat4 projectionMatrix;
+uniform samplerBuffer bonePalette;
+uniform float paletteStride;
+
+mat4 paletteMatrix(int index) {
+  int texel = index*4;
+  return mat4(texelFetch(bonePalette, texel), texelFetch(bonePalette, texel+1), texelFetch(bonePalette, texel+2),
+    texelFetch(bonePalette, texel+3));
+}
+
+void main(void) {
+  //Slot 0 of each instance's palette is the instance transform, used by vertices that aren't skinned to a bone
+  mat4 matrixToUse = modelviewMatrix*paletteMatrix((gl_InstanceID*int(paletteStride))+int(boneId)+1);
+  vec3 surfaceNormal = vec3(matrixToUse*vec4(normal, 0.0));
+  float diff = max(0.0, dot(normalize(surfaceNormal), normalize(vec3(0.0, 50.0, 100.0))));
+
+  fragAmbientColor = ambientColor;
+  fragDiffuseColor = diffuseColor*diff;
+  fragSpecularColor = specularColor;
+  fragTexCoords = texCoords.st;
+  fragMtlNum = mtlNum;
+  fragHasTexture = 0; //The model's texture array isn't bound for the instanced draw
+  fragShininess = shininess;
+  fragAlpha = alpha;
+  fragBoneId = boneId;
+  gl_Position = projectionMatrix*(matrixToUse*vertex);
+}